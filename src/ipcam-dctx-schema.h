@@ -0,0 +1,113 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-dctx-schema.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_DCTX_SCHEMA_H_
+#define _IPCAM_DCTX_SCHEMA_H_
+
+#include <glib.h>
+
+/* Payload definitions */
+
+typedef struct HeartBeatResponse
+{
+    guint8 dummy[0];
+} __attribute__((packed)) HeartBeatResponse;
+
+typedef struct HeartBeatRequest
+{
+    guint8 dummy[0];
+} __attribute__((packed)) HeartBeatRequest;
+
+typedef struct SetImageAttrRequest
+{
+    guint8 brightness;
+    guint8 chrominance;
+    guint8 saturation;
+    guint8 contrast;
+} __attribute__((packed)) SetImageAttrRequest;
+
+typedef struct GetImageAttrRequest
+{
+    guint8 dummy[0];
+} __attribute__((packed)) GetImageAttrRequest;
+
+typedef struct GetImageAttrResponse
+{
+    guint8 brightness;
+    guint8 chrominance;
+    guint8 saturation;
+    guint8 contrast;
+} __attribute__((packed)) GetImageAttrResponse;
+
+typedef struct SetOsdRequest
+{
+    struct {
+        guint16 year;
+        guint8  mon;
+        guint8  day;
+        guint8  hour;
+        guint8  min;
+        guint8  sec;
+    } __attribute__((packed)) datetime;
+    guint16     speed;
+    guint8      train_num[7];
+    guint8      carriage_num;
+    guint8      position_num;
+} __attribute__((packed)) SetOsdRequest;
+
+typedef struct TimeSyncRequest
+{
+    guint16 year;
+    guint8  mon;
+    guint8  day;
+    guint8  hour;
+    guint8  min;
+    guint8  sec;
+} __attribute__((packed)) TimeSyncRequest;
+
+typedef struct QueryStatusRequest
+{
+    guint8 dummy[0];
+} __attribute__((packed)) QueryStatusRequest;
+
+typedef struct QueryStatusResponse
+{
+    guint8  carriage_num;
+    guint8  position_num;
+    guint8  online_state;
+    guint8  camera_type;
+    guint8  manufacturer[10];
+    guint16 version;
+} __attribute__((packed)) QueryStatusResponse;
+
+typedef struct VideoFaultEvent
+{
+    guint8 carriage_num;
+    guint8 position_num;
+    guint8 occlusion_stat;
+    guint8 loss_stat;
+} __attribute__((packed)) VideoFaultEvent;
+
+/* X(name, code, payload, size, handler, flags) */
+#define DCTX_REQUESTS(X)                                                                        \
+    X(HEARTBEAT_RESPONSE,   0x51, HeartBeatResponse,   0,  ipcam_dctx_heartbeat,      0)        \
+    X(SETIMAGEATTR_REQUEST, 0x02, SetImageAttrRequest, 4,  ipcam_dctx_set_image_attr,           \
+      PROTO_MSG_MATCH | PROTO_MSG_THROTTLE)                                                     \
+    X(GETIMAGEATTR_REQUEST, 0x03, GetImageAttrRequest, 0,  ipcam_dctx_get_image_attr, PROTO_MSG_MATCH) \
+    X(SETOSD_REQUEST,       0x05, SetOsdRequest,       18, ipcam_dctx_set_osd,        PROTO_MSG_MATCH) \
+    X(TIMESYNC_REQUEST,     0x06, TimeSyncRequest,     7,  ipcam_dctx_time_sync,                \
+      PROTO_MSG_MATCH | PROTO_MSG_THROTTLE)                                                     \
+    X(QUERYSTATUS_REQUEST,  0x08, QueryStatusRequest,  0,  ipcam_dctx_query_status,   PROTO_MSG_MATCH)
+
+/* X(name, code, payload, size) */
+#define DCTX_REPLIES(X)                                                 \
+    X(HEARTBEAT_REQUEST,     0x01, HeartBeatRequest,     0)             \
+    X(GETIMAGEATTR_RESPONSE, 0x53, GetImageAttrResponse, 4)             \
+    X(QUERYSTATUS_RESPONSE,  0x58, QueryStatusResponse,  16)            \
+    X(VIDEO_FAULT_EVENT,     0x09, VideoFaultEvent,      4)
+
+#endif /* _IPCAM_DCTX_SCHEMA_H_ */
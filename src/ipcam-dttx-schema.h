@@ -0,0 +1,79 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-dttx-schema.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_DTTX_SCHEMA_H_
+#define _IPCAM_DTTX_SCHEMA_H_
+
+#include <glib.h>
+
+/* Payload definitions */
+
+typedef struct HeartBeatResponse
+{
+    guint8 dummy[0];
+} __attribute__((packed)) HeartBeatResponse;
+
+typedef struct HeartBeatRequest
+{
+    guint8 dummy[0];
+} __attribute__((packed)) HeartBeatRequest;
+
+typedef struct QueryStatusRequest
+{
+    guint8 dummy[0];
+} __attribute__((packed)) QueryStatusRequest;
+
+typedef struct QueryStatusResponse
+{
+    guint32 train_num;
+    guint8  position_num;
+    guint8  online_state;
+    guint8  camera_type;
+    guint8  manufacturer[8];
+    guint16 version;
+} __attribute__((packed)) QueryStatusResponse;
+
+typedef struct VideoFaultEvent
+{
+    guint32 train_num;
+    guint8  position_num;
+    guint8  occlusion_stat;
+    guint8  loss_stat;
+} __attribute__((packed)) VideoFaultEvent;
+
+typedef struct SetTrainNumRequest
+{
+    guint32  train_num;
+} __attribute__((packed)) SetTrainNumRequest;
+
+typedef struct SetTrainNumResponse
+{
+    guint8  result;
+} __attribute__((packed)) SetTrainNumResponse;
+
+typedef struct SetNetworkRequest
+{
+    guint8  network_num;
+} __attribute__((packed)) SetNetworkRequest;
+
+/* X(name, code, payload, size, handler, flags) */
+#define DTTX_REQUESTS(X)                                                                        \
+    X(HEARTBEAT_RESPONSE,     0x51, HeartBeatResponse,  0, ipcam_dttx_heartbeat,    0)          \
+    X(QUERYSTATUS_REQUEST,    0x07, QueryStatusRequest, 0, ipcam_dttx_query_status, PROTO_MSG_MATCH) \
+    X(SET_TRAIN_NUM_REQUEST,  0x11, SetTrainNumRequest, 4, ipcam_dttx_set_train_num,            \
+      PROTO_MSG_MATCH | PROTO_MSG_THROTTLE)                                                     \
+    X(SETNETWORK_REQUEST,     0x12, SetNetworkRequest,  1, ipcam_dttx_set_network,              \
+      PROTO_MSG_MATCH | PROTO_MSG_THROTTLE)
+
+/* X(name, code, payload, size) */
+#define DTTX_REPLIES(X)                                                 \
+    X(HEARTBEAT_REQUEST,      0x01, HeartBeatRequest,    0)             \
+    X(QUERYSTATUS_RESPONSE,   0x57, QueryStatusResponse, 17)            \
+    X(VIDEO_FAULT_EVENT,      0x08, VideoFaultEvent,     7)             \
+    X(SET_TRAIN_NUM_RESPONSE, 0x61, SetTrainNumResponse, 1)
+
+#endif /* _IPCAM_DTTX_SCHEMA_H_ */
@@ -0,0 +1,304 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-camera.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#include <string.h>
+#include <malloc.h>
+#include <arpa/inet.h>
+
+#include "ipcam-itrain-camera.h"
+#include "ipcam-itrain-mem.h"
+
+static const gchar *camera_szyc_items[] = {
+    "train_num", "carriage_num", "position_num", NULL
+};
+
+/* "train_num" -> "szyc:train_num", "firmware" -> "base_info:firmware" */
+static gchar *
+itrain_camera_property_key(const gchar *item)
+{
+    const gchar **szyc;
+
+    for (szyc = camera_szyc_items; *szyc; szyc++) {
+        if (strcmp(item, *szyc) == 0)
+            return g_strconcat("szyc:", item, NULL);
+    }
+
+    return g_strconcat("base_info:", item, NULL);
+}
+
+/* the key file item of a property, NULL if the camera can not hold it */
+static const gchar *
+itrain_camera_item(const gchar *key)
+{
+    if (g_str_has_prefix(key, "szyc:"))
+        return key + strlen("szyc:");
+    if (g_str_has_prefix(key, "base_info:"))
+        return key + strlen("base_info:");
+
+    return NULL;
+}
+
+static gsize
+itrain_camera_property_size(gpointer key, gpointer value)
+{
+    return malloc_usable_size(key) + malloc_usable_size(value);
+}
+
+static void
+itrain_camera_set_property(IpcamITrainCamera *camera, gchar *key, gchar *value)
+{
+    gpointer old_key, old_value;
+
+    g_mutex_lock(&camera->prop_mutex);
+    if (g_hash_table_lookup_extended(camera->properties, key, &old_key, &old_value))
+        ipcam_itrain_mem_uncharge(ITRAIN_MEM_PROPERTY, itrain_camera_property_size(old_key, old_value));
+    ipcam_itrain_mem_charge(ITRAIN_MEM_PROPERTY, itrain_camera_property_size(key, value));
+    g_hash_table_replace(camera->properties, key, value);
+    g_mutex_unlock(&camera->prop_mutex);
+}
+
+static void
+itrain_camera_free(IpcamITrainCamera *camera)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, camera->properties);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        ipcam_itrain_mem_uncharge(ITRAIN_MEM_PROPERTY, itrain_camera_property_size(key, value));
+    g_hash_table_destroy(camera->properties);
+    g_mutex_clear(&camera->prop_mutex);
+    g_free(camera->protocol);
+    g_free(camera->name);
+    g_free(camera);
+}
+
+static IpcamITrainCamera *
+itrain_camera_load(GKeyFile *key_file, const gchar *group, guint index)
+{
+    IpcamITrainCamera *camera;
+    gchar *address;
+    gchar **items;
+    int i;
+
+    address = g_key_file_get_string(key_file, group, "address", NULL);
+    camera = g_new0(IpcamITrainCamera, 1);
+    if (!address || !inet_aton(address, &camera->address)) {
+        g_print("ITrain: cameras: [%s] needs an address.\n", group);
+        g_free(address);
+        g_free(camera);
+        return NULL;
+    }
+    g_free(address);
+
+    camera->index = index;
+    camera->name = g_strdup(group);
+    camera->protocol = g_key_file_get_string(key_file, group, "protocol", NULL);
+    camera->video_frames = -1;
+    g_mutex_init(&camera->prop_mutex);
+    camera->properties = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    items = g_key_file_get_keys(key_file, group, NULL, NULL);
+    for (i = 0; items && items[i]; i++) {
+        if (strcmp(items[i], "address") == 0 || strcmp(items[i], "protocol") == 0)
+            continue;
+        itrain_camera_set_property(camera, itrain_camera_property_key(items[i]),
+                                   g_key_file_get_string(key_file, group, items[i], NULL));
+    }
+    g_strfreev(items);
+
+    return camera;
+}
+
+/* NULL if the file can not be read or lists no usable camera */
+IpcamITrainCameras *ipcam_itrain_cameras_load(const gchar *path)
+{
+    IpcamITrainCameras *cameras;
+    GError *error = NULL;
+    gchar **groups;
+    int i;
+
+    g_return_val_if_fail(path != NULL, NULL);
+
+    cameras = g_new0(IpcamITrainCameras, 1);
+    cameras->path = g_strdup(path);
+    g_mutex_init(&cameras->file_mutex);
+    cameras->key_file = g_key_file_new();
+    if (!g_key_file_load_from_file(cameras->key_file, path,
+                                   G_KEY_FILE_KEEP_COMMENTS, &error)) {
+        g_print("ITrain: cameras: %s: %s\n", path, error->message);
+        g_error_free(error);
+        ipcam_itrain_cameras_free(cameras);
+        return NULL;
+    }
+
+    groups = g_key_file_get_groups(cameras->key_file, NULL);
+    for (i = 0; groups[i]; i++) {
+        IpcamITrainCamera *camera;
+
+        if (cameras->nr_cameras == ITRAIN_MAX_CAMERAS) {
+            g_print("ITrain: cameras: only the first %d cameras are served.\n", ITRAIN_MAX_CAMERAS);
+            break;
+        }
+        camera = itrain_camera_load(cameras->key_file, groups[i], cameras->nr_cameras);
+        if (camera)
+            cameras->cameras[cameras->nr_cameras++] = camera;
+    }
+    g_strfreev(groups);
+
+    if (cameras->nr_cameras == 0) {
+        ipcam_itrain_cameras_free(cameras);
+        return NULL;
+    }
+
+    return cameras;
+}
+
+void ipcam_itrain_cameras_free(IpcamITrainCameras *cameras)
+{
+    guint i;
+
+    g_return_if_fail(cameras != NULL);
+
+    for (i = 0; i < cameras->nr_cameras; i++)
+        itrain_camera_free(cameras->cameras[i]);
+    g_key_file_free(cameras->key_file);
+    g_mutex_clear(&cameras->file_mutex);
+    g_free(cameras->path);
+    g_free(cameras);
+}
+
+IpcamITrainCamera *ipcam_itrain_cameras_lookup(IpcamITrainCameras *cameras, const gchar *name)
+{
+    guint i;
+
+    for (i = 0; i < cameras->nr_cameras; i++) {
+        if (g_strcmp0(cameras->cameras[i]->name, name) == 0)
+            return cameras->cameras[i];
+    }
+
+    return NULL;
+}
+
+/* the camera a client is talking to, by the address it connected to */
+IpcamITrainCamera *ipcam_itrain_cameras_route(IpcamITrainCameras *cameras, struct in_addr local)
+{
+    guint i;
+
+    for (i = 0; i < cameras->nr_cameras; i++) {
+        if (cameras->cameras[i]->address.s_addr == local.s_addr)
+            return cameras->cameras[i];
+    }
+
+    return NULL;
+}
+
+/* TRUE if the value changed; the file is written by the next sync */
+gboolean ipcam_itrain_cameras_update(IpcamITrainCameras *cameras,
+                                     IpcamITrainCamera *camera,
+                                     const gchar *key,
+                                     const gchar *value)
+{
+    const gchar *item = itrain_camera_item(key);
+    gboolean changed;
+
+    if (!item || !value)
+        return FALSE;
+
+    g_mutex_lock(&camera->prop_mutex);
+    changed = g_strcmp0(g_hash_table_lookup(camera->properties, key), value) != 0;
+    g_mutex_unlock(&camera->prop_mutex);
+    if (!changed)
+        return FALSE;
+
+    itrain_camera_set_property(camera, g_strdup(key), g_strdup(value));
+    g_mutex_lock(&cameras->file_mutex);
+    g_key_file_set_string(cameras->key_file, camera->name, item, value);
+    cameras->dirty = TRUE;
+    g_mutex_unlock(&cameras->file_mutex);
+
+    return TRUE;
+}
+
+/* the string members of items, keyed as prefix + name */
+gboolean ipcam_itrain_cameras_update_items(IpcamITrainCameras *cameras,
+                                           IpcamITrainCamera *camera,
+                                           const gchar *prefix,
+                                           JsonObject *items)
+{
+    GList *members, *item;
+    gboolean changed = FALSE;
+
+    if (!items)
+        return FALSE;
+
+    members = json_object_get_members(items);
+    for (item = members; item; item = item->next) {
+        const gchar *name = item->data;
+        gchar *key = g_strconcat(prefix, name, NULL);
+
+        changed |= ipcam_itrain_cameras_update(cameras, camera, key,
+                                               json_object_get_string_member(items, name));
+        g_free(key);
+    }
+    g_list_free(members);
+
+    return changed;
+}
+
+/*
+ * Main loop only: write the file if anything changed since the last
+ * call, TRUE if so.  The flash write stays off the server thread.
+ */
+gboolean ipcam_itrain_cameras_sync(IpcamITrainCameras *cameras)
+{
+    GError *error = NULL;
+    gchar *data;
+    gsize length;
+
+    g_mutex_lock(&cameras->file_mutex);
+    if (!cameras->dirty) {
+        g_mutex_unlock(&cameras->file_mutex);
+        return FALSE;
+    }
+    data = g_key_file_to_data(cameras->key_file, &length, NULL);
+    cameras->dirty = FALSE;
+    g_mutex_unlock(&cameras->file_mutex);
+
+    /* replaced through a temporary file, like the snapshot */
+    if (!g_file_set_contents(cameras->path, data, length, &error)) {
+        g_print("ITrain: cameras: %s: %s\n", cameras->path, error->message);
+        g_error_free(error);
+    }
+    g_free(data);
+
+    return TRUE;
+}
+
+/*
+ * A copy of the camera's own value, free it with g_free(); a base_info
+ * item it does not set is ours.  Without a camera, our own identity.
+ * The value is replaced under the lock, so it is copied under it too.
+ */
+gchar *ipcam_itrain_camera_dup_string_property(IpcamITrainCamera *camera,
+                                               IpcamITrain *itrain,
+                                               const gchar *key)
+{
+    gchar *value;
+
+    if (!camera)
+        return ipcam_itrain_dup_string_property(itrain, key);
+
+    g_mutex_lock(&camera->prop_mutex);
+    value = g_strdup(g_hash_table_lookup(camera->properties, key));
+    g_mutex_unlock(&camera->prop_mutex);
+
+    if (!value && g_str_has_prefix(key, "base_info:"))
+        value = ipcam_itrain_dup_string_property(itrain, key);
+
+    return value;
+}
@@ -0,0 +1,79 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-camera.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_CAMERA_H_
+#define _IPCAM_ITRAIN_CAMERA_H_
+
+#include <glib.h>
+#include <netinet/in.h>
+
+#include "ipcam-itrain.h"
+
+/*
+ * Gateway mode: one process fronts the cameras listed in a key file,
+ * one group per camera,
+ *
+ *   [cam01]
+ *   address=192.168.1.71
+ *   protocol=DTTX
+ *   train_num=1
+ *   carriage_num=1
+ *   position_num=1
+ *
+ * A client is routed to the camera whose address it connected to, so
+ * the addresses are aliases on one of our interfaces.  train_num,
+ * carriage_num and position_num are the szyc identity, any other key
+ * except address and protocol is a base_info item; base_info items a
+ * camera does not set are our own.
+ *
+ * The cameras are not behind iconfig: a set_szyc from a client is
+ * applied here and written back to the file by the main loop, other
+ * settings have nowhere to go and are refused.
+ */
+
+#define ITRAIN_MAX_CAMERAS      64
+
+typedef struct IpcamITrainCamera
+{
+    guint           index;
+    gchar           *name;          /* group in the key file */
+    struct in_addr  address;
+    gchar           *protocol;      /* DCTX, DTTX or NULL for the default */
+    gint64          video_frames;   /* main loop only, last liveness counter */
+    GMutex          prop_mutex;
+    GHashTable      *properties;
+} IpcamITrainCamera;
+
+typedef struct IpcamITrainCameras
+{
+    gchar               *path;
+    GMutex              file_mutex;
+    GKeyFile            *key_file;
+    gboolean            dirty;      /* key_file changed since the last sync */
+    guint               nr_cameras;
+    IpcamITrainCamera   *cameras[ITRAIN_MAX_CAMERAS];
+} IpcamITrainCameras;
+
+IpcamITrainCameras *ipcam_itrain_cameras_load(const gchar *path);
+void                ipcam_itrain_cameras_free(IpcamITrainCameras *cameras);
+IpcamITrainCamera  *ipcam_itrain_cameras_lookup(IpcamITrainCameras *cameras, const gchar *name);
+IpcamITrainCamera  *ipcam_itrain_cameras_route(IpcamITrainCameras *cameras, struct in_addr local);
+gboolean            ipcam_itrain_cameras_update(IpcamITrainCameras *cameras,
+                                                IpcamITrainCamera *camera,
+                                                const gchar *key,
+                                                const gchar *value);
+gboolean            ipcam_itrain_cameras_update_items(IpcamITrainCameras *cameras,
+                                                      IpcamITrainCamera *camera,
+                                                      const gchar *prefix,
+                                                      JsonObject *items);
+gboolean            ipcam_itrain_cameras_sync(IpcamITrainCameras *cameras);
+
+gchar *ipcam_itrain_camera_dup_string_property(IpcamITrainCamera *camera,
+                                               IpcamITrain *itrain,
+                                               const gchar *key);
+
+#endif /* _IPCAM_ITRAIN_CAMERA_H_ */
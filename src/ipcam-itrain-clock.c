@@ -0,0 +1,39 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-clock.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#include "ipcam-itrain-clock.h"
+
+/* usec, negative while the real clock is in use */
+static gint64 virtual_now = -1;
+
+gint64 ipcam_itrain_clock_now(void)
+{
+    gint64 now = __atomic_load_n(&virtual_now, __ATOMIC_RELAXED);
+
+    return now >= 0 ? now : g_get_monotonic_time();
+}
+
+void ipcam_itrain_clock_set_virtual(gint64 start)
+{
+    g_return_if_fail(start >= 0);
+
+    __atomic_store_n(&virtual_now, start, __ATOMIC_RELAXED);
+}
+
+gboolean ipcam_itrain_clock_is_virtual(void)
+{
+    return __atomic_load_n(&virtual_now, __ATOMIC_RELAXED) >= 0;
+}
+
+/* virtual time never goes back */
+void ipcam_itrain_clock_advance(gint64 to)
+{
+    g_return_if_fail(ipcam_itrain_clock_is_virtual());
+
+    if (to > __atomic_load_n(&virtual_now, __ATOMIC_RELAXED))
+        __atomic_store_n(&virtual_now, to, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,33 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-clock.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_CLOCK_H_
+#define _IPCAM_ITRAIN_CLOCK_H_
+
+#include <time.h>
+#include <glib.h>
+
+/*
+ * Time source of the server: heartbeats, session timeouts, debouncing,
+ * beacons and throttling all read it.  Normally CLOCK_MONOTONIC, so a
+ * TIMESYNC from the train does not fire or stall every timer at once.
+ * The simulator switches it to a virtual clock that only moves when it
+ * is advanced, which makes every expiry happen at a repeatable instant.
+ */
+
+gint64   ipcam_itrain_clock_now(void);
+void     ipcam_itrain_clock_set_virtual(gint64 start);
+gboolean ipcam_itrain_clock_is_virtual(void);
+void     ipcam_itrain_clock_advance(gint64 to);
+
+/* whole seconds, for the drain deadline */
+static inline time_t ipcam_itrain_clock_seconds(void)
+{
+    return ipcam_itrain_clock_now() / G_USEC_PER_SEC;
+}
+
+#endif /* _IPCAM_ITRAIN_CLOCK_H_ */
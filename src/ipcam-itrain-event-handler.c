@@ -58,4 +58,6 @@ ipcam_itrain_event_handler_run_impl(IpcamEventHandler *event_handler,
         ipcam_itrain_update_base_info_setting(itrain, body);
     else if (g_strcmp0(event, "set_szyc") == 0)
         ipcam_itrain_update_szyc_setting(itrain, body);
+    else if (ipcam_itrain_is_video_liveness_event(itrain, event))
+        ipcam_itrain_video_liveness_handler(itrain, body);
 }
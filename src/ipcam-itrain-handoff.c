@@ -0,0 +1,221 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-handoff.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include "ipcam-itrain-handoff.h"
+
+#define HANDOFF_REQUEST     "HANDOFF1"
+
+static gboolean handoff_make_addr(const gchar *path, struct sockaddr_un *addr)
+{
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return FALSE;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+
+    return TRUE;
+}
+
+/* only another instance of ours may take or hand over our sockets */
+static gboolean handoff_peer_trusted(int sock)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return FALSE;
+
+    return cred.uid == geteuid();
+}
+
+static void handoff_set_timeout(int sock)
+{
+    struct timeval tv = { .tv_sec = HANDOFF_TIMEOUT, .tv_usec = 0 };
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+gint ipcam_itrain_handoff_receive(const gchar *path,
+                                  IpcamHandoffSocket *sockets,
+                                  guint max_sockets)
+{
+    struct sockaddr_un addr;
+    guint8 roles[HANDOFF_MAX_SOCKETS + 1];
+    int fds[HANDOFF_MAX_SOCKETS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = roles, .iov_len = sizeof(roles) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    guint nr_fds = 0;
+    gint count = 0;
+    gssize received;
+    int sock, i;
+
+    if (!handoff_make_addr(path, &addr))
+        return 0;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return 0;
+    handoff_set_timeout(sock);
+
+    /* no previous instance running */
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return 0;
+    }
+    if (!handoff_peer_trusted(sock)) {
+        g_print("ITrain: %s is not served by our user, no handoff.\n", path);
+        close(sock);
+        return 0;
+    }
+
+    if (send(sock, HANDOFF_REQUEST, strlen(HANDOFF_REQUEST), MSG_NOSIGNAL) < 0 ||
+        (received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+        g_print("ITrain: no handoff answer from the previous instance: %s\n", strerror(errno));
+        close(sock);
+        return 0;
+    }
+    close(sock);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nr_fds * sizeof(int));
+            break;
+        }
+    }
+
+    /*
+     * roles[0] is the socket count, one role byte per descriptor follows.
+     * Descriptors lost to a truncated control message or not matching
+     * the roles would end up in the wrong place, take none of them.
+     */
+    if ((msg.msg_flags & (MSG_CTRUNC | MSG_TRUNC)) ||
+        received < 1 + roles[0] || roles[0] != nr_fds) {
+        g_print("ITrain: invalid handoff answer, %u sockets for %u roles.\n",
+                nr_fds, roles[0]);
+        for (i = 0; i < nr_fds; i++)
+            close(fds[i]);
+        return 0;
+    }
+
+    for (i = 0; i < nr_fds; i++) {
+        if (count < max_sockets) {
+            sockets[count].role = roles[i + 1];
+            sockets[count].fd = fds[i];
+            count++;
+        }
+        else {
+            close(fds[i]);
+        }
+    }
+
+    return count;
+}
+
+int ipcam_itrain_handoff_listen(const gchar *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (!handoff_make_addr(path, &addr))
+        return -1;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    /* the mode is taken at bind time, nothing is changed by path later */
+    fchmod(sock, 0600);
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(sock, 1) != 0) {
+        g_print("ITrain: can not listen on %s: %s\n", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/*
+ * The request of a new instance on the non-blocking sock: 1 once it is
+ * in, 0 while nothing arrived yet, -1 for anything else.  It is sent in
+ * one piece, a part of it is as bad as a wrong one.
+ */
+gint ipcam_itrain_handoff_read_request(int sock)
+{
+    gchar request[sizeof(HANDOFF_REQUEST) - 1];
+    gssize ret;
+
+    if (!handoff_peer_trusted(sock))
+        return -1;
+
+    ret = recv(sock, request, sizeof(request), MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (ret != sizeof(request) || memcmp(request, HANDOFF_REQUEST, sizeof(request)) != 0)
+        return -1;
+
+    return 1;
+}
+
+/* after ipcam_itrain_handoff_read_request() said 1, never blocks */
+gboolean ipcam_itrain_handoff_send(int sock,
+                                   const IpcamHandoffSocket *sockets,
+                                   guint nr_sockets)
+{
+    guint8 roles[HANDOFF_MAX_SOCKETS + 1];
+    int fds[HANDOFF_MAX_SOCKETS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = roles };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+    };
+    struct cmsghdr *cmsg;
+    int i;
+
+    g_return_val_if_fail(nr_sockets > 0 && nr_sockets <= HANDOFF_MAX_SOCKETS, FALSE);
+
+    roles[0] = nr_sockets;
+    for (i = 0; i < nr_sockets; i++) {
+        roles[i + 1] = sockets[i].role;
+        fds[i] = sockets[i].fd;
+    }
+    iov.iov_len = nr_sockets + 1;
+
+    memset(control, 0, sizeof(control));
+    msg.msg_controllen = CMSG_SPACE(nr_sockets * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nr_sockets * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nr_sockets * sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) == (gssize)iov.iov_len;
+}
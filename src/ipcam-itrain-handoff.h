@@ -0,0 +1,52 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-handoff.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_HANDOFF_H_
+#define _IPCAM_ITRAIN_HANDOFF_H_
+
+#include <glib.h>
+
+/*
+ * Hot restart: the running instance listens on a unix socket, a newly
+ * started instance connects to it and receives the listening and
+ * datagram sockets (SCM_RIGHTS) so no client connection is refused
+ * while the old instance drains.
+ *
+ * The new instance receives before its server loop starts and may block
+ * for HANDOFF_TIMEOUT, the running one serves the request from its loop
+ * on a non-blocking socket.  Both ends insist on a peer running as our
+ * own user; the socket belongs in a directory only that user can write.
+ */
+
+#define HANDOFF_MAX_SOCKETS     8
+#define HANDOFF_TIMEOUT         2   /* seconds */
+
+enum
+{
+    HANDOFF_ROLE_LISTEN_MAIN,
+    HANDOFF_ROLE_LISTEN_DCTX,
+    HANDOFF_ROLE_LISTEN_DTTX,
+    HANDOFF_ROLE_OSD,
+    HANDOFF_ROLE_MCAST,
+};
+
+typedef struct IpcamHandoffSocket
+{
+    guint8  role;
+    int     fd;
+} IpcamHandoffSocket;
+
+gint     ipcam_itrain_handoff_receive(const gchar *path,
+                                      IpcamHandoffSocket *sockets,
+                                      guint max_sockets);
+int      ipcam_itrain_handoff_listen(const gchar *path);
+gint     ipcam_itrain_handoff_read_request(int sock);
+gboolean ipcam_itrain_handoff_send(int sock,
+                                   const IpcamHandoffSocket *sockets,
+                                   guint nr_sockets);
+
+#endif /* _IPCAM_ITRAIN_HANDOFF_H_ */
@@ -0,0 +1,104 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-local.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "ipcam-itrain-local.h"
+
+#define LOCAL_BACKLOG       8
+
+int ipcam_itrain_local_listen(const gchar *path)
+{
+    struct sockaddr_un addr;
+    mode_t old_umask;
+    int sock, ret;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    /*
+     * Anyone may connect, what a peer may do depends on its credentials.
+     * The mode is fixed at bind time, the path is never touched again.
+     */
+    fchmod(sock, 0666);
+    unlink(path);
+    old_umask = umask(0);
+    ret = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (ret != 0 || listen(sock, LOCAL_BACKLOG) != 0) {
+        g_print("ITrain: local: can not listen on %s: %s\n", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* comma separated numeric uids, returns how many were stored */
+guint ipcam_itrain_local_parse_uids(const gchar *list, uid_t *uids, guint max_uids)
+{
+    gchar **items;
+    guint count = 0;
+    int i;
+
+    if (!list)
+        return 0;
+
+    items = g_strsplit(list, ",", -1);
+    for (i = 0; items[i] && count < max_uids; i++) {
+        gchar *item = g_strstrip(items[i]);
+        gchar *end;
+        gulong uid;
+
+        if (*item == 0)
+            continue;
+        uid = strtoul(item, &end, 10);
+        if (*end == 0)
+            uids[count++] = uid;
+        else
+            g_print("ITrain: local: ignoring uid '%s'.\n", item);
+    }
+    g_strfreev(items);
+
+    return count;
+}
+
+/* root, our own user and the configured uids are trusted */
+gboolean ipcam_itrain_local_peer_trusted(int sock, const uid_t *uids, guint nr_uids)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    guint i;
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return FALSE;
+
+    if (cred.uid == 0 || cred.uid == geteuid())
+        return TRUE;
+
+    for (i = 0; i < nr_uids; i++) {
+        if (cred.uid == uids[i])
+            return TRUE;
+    }
+
+    return FALSE;
+}
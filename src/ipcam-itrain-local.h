@@ -0,0 +1,80 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-local.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_LOCAL_H_
+#define _IPCAM_ITRAIN_LOCAL_H_
+
+#include <glib.h>
+#include <sys/types.h>
+
+/*
+ * Local endpoint for other processes on the camera: a SOCK_SEQPACKET
+ * unix socket, one message per packet in host byte order, so there is
+ * no framing or checksum to deal with.  A client sends SUBSCRIBE or
+ * QUERY with an event mask; it gets the current state of each event
+ * right away and, once subscribed, every change as it happens.  Both
+ * are refused with ERROR unless the peer credentials are trusted.
+ */
+
+#define ITRAIN_LOCAL_MAX_UIDS       8
+
+enum
+{
+    ITRAIN_LOCAL_SUBSCRIBE = 1,     /* IpcamLocalRequest */
+    ITRAIN_LOCAL_QUERY,             /* IpcamLocalRequest */
+    ITRAIN_LOCAL_STATE,             /* IpcamLocalState */
+    ITRAIN_LOCAL_IDENTITY,          /* IpcamLocalIdentity */
+    ITRAIN_LOCAL_ERROR,             /* IpcamLocalError */
+};
+
+/* event mask of SUBSCRIBE and QUERY */
+#define ITRAIN_LOCAL_EVENT_STATE        (1 << 0)
+#define ITRAIN_LOCAL_EVENT_IDENTITY     (1 << 1)
+#define ITRAIN_LOCAL_EVENT_ALL          (ITRAIN_LOCAL_EVENT_STATE | ITRAIN_LOCAL_EVENT_IDENTITY)
+
+typedef struct IpcamLocalHeader
+{
+    guint8  type;
+    guint8  reserved[3];
+} IpcamLocalHeader;
+
+/* SUBSCRIBE replaces the mask, 0 unsubscribes */
+typedef struct IpcamLocalRequest
+{
+    IpcamLocalHeader header;
+    guint32 events;
+} IpcamLocalRequest;
+
+typedef struct IpcamLocalState
+{
+    IpcamLocalHeader header;
+    guint8  occlusion_stat;
+    guint8  loss_stat;
+    guint8  reserved[2];
+    gint64  time;       /* CLOCK_MONOTONIC usec of the change */
+} IpcamLocalState;
+
+/* empty strings until the identity is known */
+typedef struct IpcamLocalIdentity
+{
+    IpcamLocalHeader header;
+    gchar   train_num[16];
+    gchar   carriage_num[16];
+    gchar   position_num[16];
+} IpcamLocalIdentity;
+
+typedef struct IpcamLocalError
+{
+    IpcamLocalHeader header;
+    guint32 error;      /* errno value, EACCES or EINVAL */
+} IpcamLocalError;
+
+int      ipcam_itrain_local_listen(const gchar *path);
+guint    ipcam_itrain_local_parse_uids(const gchar *list, uid_t *uids, guint max_uids);
+gboolean ipcam_itrain_local_peer_trusted(int sock, const uid_t *uids, guint nr_uids);
+
+#endif /* _IPCAM_ITRAIN_LOCAL_H_ */
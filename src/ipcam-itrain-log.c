@@ -0,0 +1,303 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-log.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ipcam-itrain-stats.h"
+#include "ipcam-itrain-log.h"
+
+#define LOG_RING_SIZE           2048    /* power of 2 */
+#define LOG_RING_MASK           (LOG_RING_SIZE - 1)
+#define LOG_DRAIN_INTERVAL      (200 * 1000)
+#define LOG_FILE_MAX_SIZE       (1024 * 1024)
+
+guint8 ipcam_itrain_log_levels[NR_ITRAIN_LOG_CATEGORIES] = {
+#define ITRAIN_LOG_CATEGORY_LEVEL(id, name) [ITRAIN_LOG_CAT_##id] = ITRAIN_LOG_LEVEL_WARN,
+    ITRAIN_LOG_CATEGORIES(ITRAIN_LOG_CATEGORY_LEVEL)
+#undef ITRAIN_LOG_CATEGORY_LEVEL
+};
+
+const guint8 ipcam_itrain_log_event_category[NR_ITRAIN_LOG_EVENTS] = {
+#define ITRAIN_LOG_EVENT_CATEGORY(id, category, level, format) \
+    [ITRAIN_LOG_##id] = ITRAIN_LOG_CAT_##category,
+    ITRAIN_LOG_EVENTS(ITRAIN_LOG_EVENT_CATEGORY)
+#undef ITRAIN_LOG_EVENT_CATEGORY
+};
+
+const guint8 ipcam_itrain_log_event_level[NR_ITRAIN_LOG_EVENTS] = {
+#define ITRAIN_LOG_EVENT_LEVEL(id, category, level, format) \
+    [ITRAIN_LOG_##id] = ITRAIN_LOG_LEVEL_##level,
+    ITRAIN_LOG_EVENTS(ITRAIN_LOG_EVENT_LEVEL)
+#undef ITRAIN_LOG_EVENT_LEVEL
+};
+
+static const gchar *category_names[NR_ITRAIN_LOG_CATEGORIES] = {
+#define ITRAIN_LOG_CATEGORY_NAME(id, name) [ITRAIN_LOG_CAT_##id] = name,
+    ITRAIN_LOG_CATEGORIES(ITRAIN_LOG_CATEGORY_NAME)
+#undef ITRAIN_LOG_CATEGORY_NAME
+};
+
+static const gchar *level_names[NR_ITRAIN_LOG_LEVELS] = {
+#define ITRAIN_LOG_LEVEL_NAME(id, name) [ITRAIN_LOG_LEVEL_##id] = name,
+    ITRAIN_LOG_LEVELS(ITRAIN_LOG_LEVEL_NAME)
+#undef ITRAIN_LOG_LEVEL_NAME
+};
+
+static IpcamITrainLogRecord log_ring[LOG_RING_SIZE];
+static guint64 log_head;
+
+static gchar *log_path;
+static int log_fd = -1;
+static int crash_fd = -1;
+
+void ipcam_itrain_log_write(IpcamITrainLogEvent event, const guint32 *args, guint nargs)
+{
+    guint64 index = __atomic_fetch_add(&log_head, 1, __ATOMIC_RELAXED);
+    IpcamITrainLogRecord *record = &log_ring[index & LOG_RING_MASK];
+
+    /* readers skip the record while it is rewritten */
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    record->time = g_get_real_time();
+    record->event = event;
+    record->nargs = MIN(nargs, ITRAIN_LOG_MAX_ARGS);
+    memcpy(record->args, args, record->nargs * sizeof(guint32));
+
+    __atomic_store_n(&record->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+/* copy a complete record, FALSE if it is not (or no longer) index */
+static gboolean
+itrain_log_read(guint64 index, IpcamITrainLogRecord *out)
+{
+    IpcamITrainLogRecord *record = &log_ring[index & LOG_RING_MASK];
+
+    if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != index + 1)
+        return FALSE;
+    memcpy(out, record, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&record->seq, __ATOMIC_RELAXED) == index + 1;
+}
+
+/* "server=info,proto=debug", categories not mentioned are left alone */
+gboolean ipcam_itrain_log_set_levels(const gchar *spec)
+{
+    gchar **items;
+    gboolean ret = TRUE;
+    int i, cat, level;
+
+    g_return_val_if_fail(spec != NULL, FALSE);
+
+    items = g_strsplit(spec, ",", -1);
+    for (i = 0; items[i]; i++) {
+        gchar **pair = g_strsplit(g_strstrip(items[i]), "=", 2);
+
+        if (!pair[0] || !pair[1]) {
+            g_strfreev(pair);
+            ret = FALSE;
+            continue;
+        }
+        for (cat = 0; cat < NR_ITRAIN_LOG_CATEGORIES; cat++) {
+            if (g_strcmp0(pair[0], category_names[cat]) == 0)
+                break;
+        }
+        for (level = 0; level < NR_ITRAIN_LOG_LEVELS; level++) {
+            if (g_strcmp0(pair[1], level_names[level]) == 0)
+                break;
+        }
+        if (cat < NR_ITRAIN_LOG_CATEGORIES && level < NR_ITRAIN_LOG_LEVELS)
+            ipcam_itrain_log_levels[cat] = level;
+        else
+            ret = FALSE;
+        g_strfreev(pair);
+    }
+    g_strfreev(items);
+
+    return ret;
+}
+
+static gboolean
+itrain_log_write_header(int fd)
+{
+    IpcamITrainLogHeader header;
+
+    memcpy(header.magic, ITRAIN_LOG_MAGIC, sizeof(header.magic));
+    header.version = ITRAIN_LOG_VERSION;
+    header.record_size = sizeof(IpcamITrainLogRecord);
+
+    return write(fd, &header, sizeof(header)) == sizeof(header);
+}
+
+/*
+ * Write the whole ring, unordered and possibly with torn records which
+ * the decoder sorts out.  Only async-signal-safe calls are used.
+ */
+gboolean ipcam_itrain_log_dump(int fd)
+{
+    gsize total = sizeof(log_ring);
+    const gchar *p = (const gchar *)log_ring;
+
+    if (fd < 0 || !itrain_log_write_header(fd))
+        return FALSE;
+
+    while (total > 0) {
+        ssize_t n = write(fd, p, total);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        p += n;
+        total -= n;
+    }
+
+    return TRUE;
+}
+
+static int
+itrain_log_open(const gchar *path)
+{
+    struct stat st;
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) == 0 && st.st_size == 0 && !itrain_log_write_header(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* keep one previous file around */
+static void
+itrain_log_rotate(void)
+{
+    gchar *old_path = g_strdup_printf("%s.1", log_path);
+
+    close(log_fd);
+    rename(log_path, old_path);
+    g_free(old_path);
+    log_fd = itrain_log_open(log_path);
+}
+
+static gpointer
+itrain_log_thread_proc(gpointer data)
+{
+    guint64 tail = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        IpcamITrainLogRecord records[64];
+        guint64 head;
+        guint n = 0;
+
+        g_usleep(LOG_DRAIN_INTERVAL);
+
+        head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+        if (head - tail > LOG_RING_SIZE) {
+            /* the writers lapped us */
+            ipcam_itrain_stats_add(ITRAIN_STAT_LOG_LOST, head - tail - LOG_RING_SIZE);
+            tail = head - LOG_RING_SIZE;
+        }
+
+        while (tail < head) {
+            /* a record still being written ends this round */
+            if (!itrain_log_read(tail, &records[n]))
+                break;
+            tail++;
+            if (++n == G_N_ELEMENTS(records) || tail == head) {
+                if (log_fd >= 0 && write(log_fd, records, n * sizeof(records[0])) < 0)
+                    ipcam_itrain_stats_add(ITRAIN_STAT_LOG_LOST, n);
+                n = 0;
+            }
+        }
+        if (n > 0 && log_fd >= 0 && write(log_fd, records, n * sizeof(records[0])) < 0)
+            ipcam_itrain_stats_add(ITRAIN_STAT_LOG_LOST, n);
+
+        if (log_fd >= 0 && lseek(log_fd, 0, SEEK_END) > LOG_FILE_MAX_SIZE)
+            itrain_log_rotate();
+    }
+
+    return NULL;
+}
+
+static void
+itrain_log_crash_handler(int signo)
+{
+    ftruncate(crash_fd, 0);
+    lseek(crash_fd, 0, SEEK_SET);
+    ipcam_itrain_log_dump(crash_fd);
+
+    /* let the default action produce the core or exit status */
+    signal(signo, SIG_DFL);
+    raise(signo);
+}
+
+/* the latest dump replaces the previous one */
+static void
+itrain_log_dump_handler(int signo)
+{
+    ftruncate(crash_fd, 0);
+    lseek(crash_fd, 0, SEEK_SET);
+    ipcam_itrain_log_dump(crash_fd);
+}
+
+/* the dump of the crash that got us restarted is kept as <crash>.1 */
+static void
+itrain_log_keep_crash(const gchar *crash_path)
+{
+    struct stat st;
+    gchar *old_path;
+
+    if (stat(crash_path, &st) < 0 || st.st_size == 0)
+        return;
+
+    old_path = g_strdup_printf("%s.1", crash_path);
+    rename(crash_path, old_path);
+    g_free(old_path);
+}
+
+/*
+ * Start draining the ring to path, if set.  crash_path is opened now as
+ * nothing but write() can be used once we crashed; it is only truncated
+ * when a dump is written.
+ */
+void ipcam_itrain_log_start(const gchar *path, const gchar *crash_path)
+{
+    if (path) {
+        log_path = g_strdup(path);
+        log_fd = itrain_log_open(path);
+        if (log_fd < 0)
+            g_print("ITrain: failed to open log file %s: %s\n", path, strerror(errno));
+        else
+            g_thread_new("itrain-log", itrain_log_thread_proc, NULL);
+    }
+
+    if (crash_path) {
+        itrain_log_keep_crash(crash_path);
+        crash_fd = open(crash_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (crash_fd < 0) {
+            g_print("ITrain: failed to open %s: %s\n", crash_path, strerror(errno));
+            return;
+        }
+        signal(SIGSEGV, itrain_log_crash_handler);
+        signal(SIGBUS, itrain_log_crash_handler);
+        signal(SIGFPE, itrain_log_crash_handler);
+        signal(SIGABRT, itrain_log_crash_handler);
+        signal(SIGUSR2, itrain_log_dump_handler);
+    }
+}
@@ -0,0 +1,129 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-log.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_LOG_H_
+#define _IPCAM_ITRAIN_LOG_H_
+
+#include <glib.h>
+
+/*
+ * Binary event log for the hot paths.  Writers only fill a fixed size
+ * record in a lock-free ring, formatting is left to itrain-logdump.
+ * The ring is drained to a file by a background thread, and can be
+ * dumped with SIGUSR2 or after a crash.
+ */
+
+/* X(id, name) */
+#define ITRAIN_LOG_CATEGORIES(X)                \
+    X(SERVER,   "server")                       \
+    X(PROTO,    "proto")                        \
+    X(OSD,      "osd")
+
+/* X(id, name) */
+#define ITRAIN_LOG_LEVELS(X)                    \
+    X(ERROR,    "error")                        \
+    X(WARN,     "warn")                         \
+    X(INFO,     "info")                         \
+    X(DEBUG,    "debug")
+
+/* X(id, category, level, format), the format takes up to 5 integers */
+#define ITRAIN_LOG_EVENTS(X)                                                            \
+    X(CMD_OCCLUSION,    SERVER, DEBUG,  "occlusion notice region %u state %u")          \
+    X(CMD_VIDEO,        SERVER, DEBUG,  "video notice alive %u")                        \
+    X(CMD_IDENTITY,     SERVER, DEBUG,  "identity changed")                             \
+    X(CMD_ACCEPT,       SERVER, DEBUG,  "accept connections %u")                        \
+    X(VIDEO_STATE,      SERVER, WARN,   "video loss %u")                                \
+    X(CONN_DETECTED,    SERVER, INFO,   "fd %u detected by request 0x%02x")             \
+    X(CONN_REFUSED,     SERVER, INFO,   "refused client %u.%u.%u.%u")                   \
+    X(CONN_EVICTED,     SERVER, WARN,   "evicted idle client %u.%u.%u.%u")              \
+    X(ACCEPT_FAILED,    SERVER, ERROR,  "accept failed, errno %u")                      \
+    X(PDU_UNHANDLED,    PROTO,  WARN,   "fd %u unhandled request 0x%02x")               \
+    X(PDU_CHECKSUM,     PROTO,  WARN,   "fd %u checksum 0x%02x, expected 0x%02x")       \
+    X(PDU_SHORT,        PROTO,  WARN,   "fd %u request 0x%02x payload of %u bytes too small") \
+    X(SESSION_TIMEOUT,  PROTO,  INFO,   "fd %u session timeout")                        \
+    X(OSD_INVALID,      OSD,    WARN,   "invalid osd datagram, %u bytes, head 0x%02x code 0x%02x") \
+    X(OSD_CHECKSUM,     OSD,    WARN,   "osd datagram of %u bytes, checksum 0x%02x, expected 0x%02x") \
+    X(OSD_UNKNOWN_OVERLAY, OSD, WARN,   "unknown osd overlay %u")
+
+typedef enum
+{
+#define ITRAIN_LOG_CATEGORY_ENUM(id, name) ITRAIN_LOG_CAT_##id,
+    ITRAIN_LOG_CATEGORIES(ITRAIN_LOG_CATEGORY_ENUM)
+#undef ITRAIN_LOG_CATEGORY_ENUM
+    NR_ITRAIN_LOG_CATEGORIES
+} IpcamITrainLogCategory;
+
+typedef enum
+{
+#define ITRAIN_LOG_LEVEL_ENUM(id, name) ITRAIN_LOG_LEVEL_##id,
+    ITRAIN_LOG_LEVELS(ITRAIN_LOG_LEVEL_ENUM)
+#undef ITRAIN_LOG_LEVEL_ENUM
+    NR_ITRAIN_LOG_LEVELS
+} IpcamITrainLogLevel;
+
+typedef enum
+{
+#define ITRAIN_LOG_EVENT_ENUM(id, category, level, format) ITRAIN_LOG_##id,
+    ITRAIN_LOG_EVENTS(ITRAIN_LOG_EVENT_ENUM)
+#undef ITRAIN_LOG_EVENT_ENUM
+    NR_ITRAIN_LOG_EVENTS
+} IpcamITrainLogEvent;
+
+#define ITRAIN_LOG_MAX_ARGS     5
+
+/* on-disk record, seq is index + 1 once the record is complete */
+typedef struct IpcamITrainLogRecord
+{
+    guint64 seq;
+    gint64  time;       /* usec since the epoch */
+    guint16 event;
+    guint16 nargs;
+    guint32 args[ITRAIN_LOG_MAX_ARGS];
+} IpcamITrainLogRecord;
+
+/* file header, followed by records */
+#define ITRAIN_LOG_MAGIC        "ITLG"
+#define ITRAIN_LOG_VERSION      1
+
+typedef struct IpcamITrainLogHeader
+{
+    gchar   magic[4];
+    guint16 version;
+    guint16 record_size;
+} IpcamITrainLogHeader;
+
+extern guint8 ipcam_itrain_log_levels[NR_ITRAIN_LOG_CATEGORIES];
+extern const guint8 ipcam_itrain_log_event_category[NR_ITRAIN_LOG_EVENTS];
+extern const guint8 ipcam_itrain_log_event_level[NR_ITRAIN_LOG_EVENTS];
+
+void     ipcam_itrain_log_write(IpcamITrainLogEvent event, const guint32 *args, guint nargs);
+gboolean ipcam_itrain_log_set_levels(const gchar *spec);
+void     ipcam_itrain_log_start(const gchar *path, const gchar *crash_path);
+gboolean ipcam_itrain_log_dump(int fd);
+
+static inline gboolean ipcam_itrain_log_enabled(IpcamITrainLogEvent event)
+{
+    /* a stale level only lets a few records more or less through */
+    return ipcam_itrain_log_levels[ipcam_itrain_log_event_category[event]] >=
+        ipcam_itrain_log_event_level[event];
+}
+
+/* an in_addr as four arguments for "%u.%u.%u.%u" */
+#define ITRAIN_LOG_INADDR(addr)                                                 \
+    ((guint8 *)&(addr).s_addr)[0], ((guint8 *)&(addr).s_addr)[1],               \
+    ((guint8 *)&(addr).s_addr)[2], ((guint8 *)&(addr).s_addr)[3]
+
+#define ITRAIN_LOG(event, ...)                                                  \
+    do {                                                                        \
+        if (ipcam_itrain_log_enabled(ITRAIN_LOG_##event)) {                     \
+            const guint32 _log_args[] = { 0, ##__VA_ARGS__ };                   \
+            ipcam_itrain_log_write(ITRAIN_LOG_##event, &_log_args[1],           \
+                                   G_N_ELEMENTS(_log_args) - 1);                \
+        }                                                                       \
+    } while (0)
+
+#endif /* _IPCAM_ITRAIN_LOG_H_ */
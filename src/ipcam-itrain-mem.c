@@ -0,0 +1,168 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-mem.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#include <string.h>
+
+#include "ipcam-itrain-mem.h"
+
+/* rough cost of a JsonNode with its JsonObject/JsonArray or value */
+#define JSON_NODE_COST      64
+
+typedef struct IpcamITrainMemStat
+{
+    gint64 bytes;
+    gint64 peak;
+    gint64 objects;
+    gint64 allocs;      /* since startup */
+} IpcamITrainMemStat;
+
+static const gchar *pool_names[NR_ITRAIN_MEM_POOLS] = {
+#define ITRAIN_MEM_POOL_NAME(id, name) name,
+    ITRAIN_MEM_POOLS(ITRAIN_MEM_POOL_NAME)
+#undef ITRAIN_MEM_POOL_NAME
+};
+
+/* charged from the server, OSD and main threads */
+static IpcamITrainMemStat mem_stats[NR_ITRAIN_MEM_POOLS];
+
+/* allocation rate between two dumps, main loop only */
+static gint64 last_allocs[NR_ITRAIN_MEM_POOLS];
+static gint64 last_dump_time;
+
+void ipcam_itrain_mem_charge(IpcamITrainMemPool pool, gsize size)
+{
+    IpcamITrainMemStat *stat;
+    gint64 bytes, peak;
+
+    g_return_if_fail(pool < NR_ITRAIN_MEM_POOLS);
+
+    stat = &mem_stats[pool];
+    bytes = __atomic_add_fetch(&stat->bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stat->objects, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stat->allocs, 1, __ATOMIC_RELAXED);
+
+    peak = __atomic_load_n(&stat->peak, __ATOMIC_RELAXED);
+    while (bytes > peak &&
+           !__atomic_compare_exchange_n(&stat->peak, &peak, bytes, TRUE,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void ipcam_itrain_mem_uncharge(IpcamITrainMemPool pool, gsize size)
+{
+    g_return_if_fail(pool < NR_ITRAIN_MEM_POOLS);
+
+    __atomic_sub_fetch(&mem_stats[pool].bytes, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mem_stats[pool].objects, 1, __ATOMIC_RELAXED);
+}
+
+gpointer ipcam_itrain_mem_alloc(IpcamITrainMemPool pool, gsize size)
+{
+    ipcam_itrain_mem_charge(pool, size);
+
+    return g_malloc(size);
+}
+
+gpointer ipcam_itrain_mem_alloc0(IpcamITrainMemPool pool, gsize size)
+{
+    ipcam_itrain_mem_charge(pool, size);
+
+    return g_malloc0(size);
+}
+
+/* size must be the one given to ipcam_itrain_mem_alloc */
+void ipcam_itrain_mem_free(IpcamITrainMemPool pool, gpointer mem, gsize size)
+{
+    if (!mem)
+        return;
+
+    ipcam_itrain_mem_uncharge(pool, size);
+    g_free(mem);
+}
+
+/* json-glib allocates internally, estimate what a tree costs */
+gsize ipcam_itrain_mem_json_size(JsonNode *node)
+{
+    gsize size = JSON_NODE_COST;
+
+    if (!node)
+        return 0;
+
+    switch (json_node_get_node_type(node)) {
+    case JSON_NODE_OBJECT: {
+        JsonObject *object = json_node_get_object(node);
+        GList *members = json_object_get_members(object);
+        GList *l;
+
+        for (l = members; l; l = l->next) {
+            size += strlen(l->data) + 1;
+            size += ipcam_itrain_mem_json_size(json_object_get_member(object, l->data));
+        }
+        g_list_free(members);
+        break;
+    }
+    case JSON_NODE_ARRAY: {
+        JsonArray *array = json_node_get_array(node);
+        guint i;
+
+        for (i = 0; i < json_array_get_length(array); i++)
+            size += ipcam_itrain_mem_json_size(json_array_get_element(array, i));
+        break;
+    }
+    case JSON_NODE_VALUE:
+        if (json_node_get_value_type(node) == G_TYPE_STRING)
+            size += strlen(json_node_get_string(node)) + 1;
+        break;
+    default:
+        break;
+    }
+
+    return size;
+}
+
+void ipcam_itrain_mem_dump(GString *out)
+{
+    gint64 now = g_get_monotonic_time();
+    gint64 elapsed = last_dump_time ? now - last_dump_time : 0;
+    int i;
+
+    for (i = 0; i < NR_ITRAIN_MEM_POOLS; i++) {
+        IpcamITrainMemStat *stat = &mem_stats[i];
+        gint64 allocs = __atomic_load_n(&stat->allocs, __ATOMIC_RELAXED);
+
+        g_string_append_printf(out, "mem.%s.bytes %lld\n", pool_names[i],
+                               (long long)__atomic_load_n(&stat->bytes, __ATOMIC_RELAXED));
+        g_string_append_printf(out, "mem.%s.peak %lld\n", pool_names[i],
+                               (long long)__atomic_load_n(&stat->peak, __ATOMIC_RELAXED));
+        g_string_append_printf(out, "mem.%s.objects %lld\n", pool_names[i],
+                               (long long)__atomic_load_n(&stat->objects, __ATOMIC_RELAXED));
+        g_string_append_printf(out, "mem.%s.allocs_per_sec %lld\n", pool_names[i],
+                               elapsed > 0 ?
+                               (long long)((allocs - last_allocs[i]) * G_USEC_PER_SEC / elapsed) : 0LL);
+        last_allocs[i] = allocs;
+    }
+    last_dump_time = now;
+}
+
+/* report what is still charged, meant to run after everything is freed */
+gboolean ipcam_itrain_mem_check_leaks(void)
+{
+    gboolean clean = TRUE;
+    int i;
+
+    for (i = 0; i < NR_ITRAIN_MEM_POOLS; i++) {
+        IpcamITrainMemStat *stat = &mem_stats[i];
+
+        if (stat->objects != 0 || stat->bytes != 0) {
+            g_print("ITrain: %s leaked %lld objects, %lld bytes.\n", pool_names[i],
+                    (long long)stat->objects, (long long)stat->bytes);
+            clean = FALSE;
+        }
+    }
+
+    return clean;
+}
@@ -0,0 +1,44 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-mem.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_MEM_H_
+#define _IPCAM_ITRAIN_MEM_H_
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+/*
+ * Allocation accounting per subsystem.  Only what itrain itself owns is
+ * charged: a JSON tree handed over to a message is uncharged there.
+ */
+
+/* X(id, name) */
+#define ITRAIN_MEM_POOLS(X)                     \
+    X(CONN,     "conn")                         \
+    X(BUFFER,   "buffer")                       \
+    X(PDU,      "pdu")                          \
+    X(JSON,     "json")                         \
+    X(PROPERTY, "property")
+
+typedef enum
+{
+#define ITRAIN_MEM_POOL_ENUM(id, name) ITRAIN_MEM_##id,
+    ITRAIN_MEM_POOLS(ITRAIN_MEM_POOL_ENUM)
+#undef ITRAIN_MEM_POOL_ENUM
+    NR_ITRAIN_MEM_POOLS
+} IpcamITrainMemPool;
+
+void     ipcam_itrain_mem_charge(IpcamITrainMemPool pool, gsize size);
+void     ipcam_itrain_mem_uncharge(IpcamITrainMemPool pool, gsize size);
+gpointer ipcam_itrain_mem_alloc(IpcamITrainMemPool pool, gsize size);
+gpointer ipcam_itrain_mem_alloc0(IpcamITrainMemPool pool, gsize size);
+void     ipcam_itrain_mem_free(IpcamITrainMemPool pool, gpointer mem, gsize size);
+gsize    ipcam_itrain_mem_json_size(JsonNode *node);
+void     ipcam_itrain_mem_dump(GString *out);
+gboolean ipcam_itrain_mem_check_leaks(void);
+
+#endif /* _IPCAM_ITRAIN_MEM_H_ */
@@ -6,6 +6,7 @@
  */
 
 #include "ipcam-itrain-message.h"
+#include "ipcam-itrain-mem.h"
 #include <string.h>
 #include <arpa/inet.h>
 
@@ -36,7 +37,7 @@ static guint8 calculate_checksum(guint8 *p, guint len)
 IpcamTrainPDU *ipcam_train_pdu_new(guint8 type, guint16 payload_size)
 {
     guint16 packet_size = sizeof(IpcamTrainPDUHeader) + payload_size + 1;
-    IpcamTrainPDU *pdu = g_malloc0(packet_size);
+    IpcamTrainPDU *pdu = ipcam_itrain_mem_alloc0(ITRAIN_MEM_PDU, packet_size);
 
     pdu->header.start = PACKET_START;
     pdu->header.type = type;
@@ -60,7 +61,7 @@ IpcamTrainPDU *ipcam_train_pdu_new_from_buffer(guint8 *buffer, guint16 buffer_si
 
     pkt_size = sizeof(*header) + payload_size + 1;
 
-    pdu = g_malloc(pkt_size);
+    pdu = ipcam_itrain_mem_alloc(ITRAIN_MEM_PDU, pkt_size);
 
     if (pdu) {
         memcpy(&pdu->header, buffer, pkt_size);
@@ -71,7 +72,8 @@ IpcamTrainPDU *ipcam_train_pdu_new_from_buffer(guint8 *buffer, guint16 buffer_si
 
 void ipcam_train_pdu_free(IpcamTrainPDU *pdu)
 {
-    g_free(pdu);
+    if (pdu)
+        ipcam_itrain_mem_free(ITRAIN_MEM_PDU, pdu, ipcam_train_pdu_get_packet_size(pdu));
 }
 
 guint8 ipcam_train_pdu_get_type(IpcamTrainPDU *pdu)
@@ -0,0 +1,75 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-occlusion.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#include <string.h>
+
+#include "ipcam-itrain-occlusion.h"
+
+void ipcam_occlusion_table_init(IpcamOcclusionTable *table,
+                                guint on_delay_ms,
+                                guint off_delay_ms)
+{
+    memset(table, 0, sizeof(*table));
+    table->on_delay = (gint64)on_delay_ms * 1000;
+    table->off_delay = (gint64)off_delay_ms * 1000;
+}
+
+/* record a raw region state, returns TRUE if the aggregate changed */
+gboolean ipcam_occlusion_table_update(IpcamOcclusionTable *table,
+                                      guint region,
+                                      gboolean state,
+                                      gint64 now)
+{
+    guint32 mask;
+
+    g_return_val_if_fail(region < OCCLUSION_MAX_REGIONS, FALSE);
+
+    mask = 1u << region;
+    if (!!(table->raw & mask) != !!state) {
+        table->raw ^= mask;
+        table->changed_at[region] = now;
+    }
+
+    return ipcam_occlusion_table_poll(table, now);
+}
+
+/* apply the transitions whose delay has expired */
+gboolean ipcam_occlusion_table_poll(IpcamOcclusionTable *table, gint64 now)
+{
+    gboolean occluded = ipcam_occlusion_table_aggregate(table);
+    guint32 pending = table->raw ^ table->stable;
+
+    while (pending) {
+        guint region = __builtin_ctz(pending);
+        guint32 mask = 1u << region;
+        gint64 delay = (table->raw & mask) ? table->on_delay : table->off_delay;
+
+        if (now - table->changed_at[region] >= delay)
+            table->stable ^= mask;
+        pending &= ~mask;
+    }
+
+    return occluded != ipcam_occlusion_table_aggregate(table);
+}
+
+/* when the next pending transition is due, G_MAXINT64 if none */
+gint64 ipcam_occlusion_table_next_deadline(IpcamOcclusionTable *table)
+{
+    guint32 pending = table->raw ^ table->stable;
+    gint64 deadline = G_MAXINT64;
+
+    while (pending) {
+        guint region = __builtin_ctz(pending);
+        guint32 mask = 1u << region;
+        gint64 delay = (table->raw & mask) ? table->on_delay : table->off_delay;
+
+        deadline = MIN(deadline, table->changed_at[region] + delay);
+        pending &= ~mask;
+    }
+
+    return deadline;
+}
@@ -0,0 +1,44 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-occlusion.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_OCCLUSION_H_
+#define _IPCAM_ITRAIN_OCCLUSION_H_
+
+#include <glib.h>
+
+#define OCCLUSION_MAX_REGIONS   32
+
+/*
+ * Per-region occlusion state.  A region only becomes occluded after the
+ * raw state stayed set for on_delay, and only clears after it stayed
+ * clear for off_delay.  The camera is occluded while any region is.
+ */
+typedef struct IpcamOcclusionTable
+{
+    guint32 raw;                                /* last reported state */
+    guint32 stable;                             /* debounced state */
+    gint64  changed_at[OCCLUSION_MAX_REGIONS];  /* when raw last changed */
+    gint64  on_delay;                           /* usec */
+    gint64  off_delay;                          /* usec */
+} IpcamOcclusionTable;
+
+void     ipcam_occlusion_table_init(IpcamOcclusionTable *table,
+                                    guint on_delay_ms,
+                                    guint off_delay_ms);
+gboolean ipcam_occlusion_table_update(IpcamOcclusionTable *table,
+                                      guint region,
+                                      gboolean state,
+                                      gint64 now);
+gboolean ipcam_occlusion_table_poll(IpcamOcclusionTable *table, gint64 now);
+gint64   ipcam_occlusion_table_next_deadline(IpcamOcclusionTable *table);
+
+static inline gboolean ipcam_occlusion_table_aggregate(IpcamOcclusionTable *table)
+{
+    return table->stable != 0;
+}
+
+#endif /* _IPCAM_ITRAIN_OCCLUSION_H_ */
@@ -0,0 +1,415 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-osd.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <json-glib/json-glib.h>
+
+#include "ipcam-itrain-stats.h"
+#include "ipcam-itrain-log.h"
+#include "ipcam-itrain-mem.h"
+#include "ipcam-itrain-osd.h"
+#include "ipcam-itrain-rt.h"
+
+#define OSD_HEAD                0xff
+#define OSD_CODE_TEXT           0x09    /* one line for the speed_gps overlay */
+#define OSD_CODE_OVERLAYS       0x0a    /* several overlay records */
+#define OSD_TEXT_MAX            1024
+#define OSD_DATAGRAM_MAX        4096
+
+typedef struct SetOSDRequest
+{
+    guint8 head;    /* 0xff */
+    guint8 code;    /* function code */
+    guint8 keeptime;   /* time to keep on screen */
+    guint16 x;       /* X position */
+    guint16 y;       /* Y position */
+    guint16 fontsize;
+    guint16 length;  /* max to 1024 */
+    guint8 data[0];  /* length bytes of text, then the checksum */
+} __attribute__((packed)) SetOSDRequest;
+
+/* senders of the fixed layout always pad the text to 1024 bytes */
+#define OSD_LEGACY_SIZE         (sizeof(SetOSDRequest) + OSD_TEXT_MAX + 1)
+
+typedef struct SetOverlaysRequest
+{
+    guint8 head;    /* 0xff */
+    guint8 code;    /* OSD_CODE_OVERLAYS */
+    guint8 count;   /* overlay records following, then the checksum */
+} __attribute__((packed)) SetOverlaysRequest;
+
+typedef struct OverlayRecord
+{
+    guint8 id;      /* index in osd_overlay_names */
+    guint16 x;
+    guint16 y;
+    guint16 fontsize;
+    guint8 red;
+    guint8 green;
+    guint8 blue;
+    guint8 alpha;
+    guint16 length; /* of text */
+    guint8 text[0];
+} __attribute__((packed)) OverlayRecord;
+
+static const gchar *osd_overlay_names[] = {
+    "speed_gps", "datetime", "device_name", "comment", "frame_rate", "bit_rate"
+};
+
+struct IpcamOsdIngest
+{
+    int         sock;
+    int         wake_fds[2];
+    GAsyncQueue *queue;
+    guint       max_depth;
+    gchar       *cpus;
+    GThread     *thread;
+};
+
+static guint8
+itrain_osd_checksum(const guint8 *p, guint len)
+{
+    guint8 checksum = 0;
+    guint i;
+
+    for (i = 0; i < len; i++)
+        checksum ^= p[i];
+
+    return checksum;
+}
+
+/* an overlay member of the items.master object */
+static void
+itrain_osd_add_overlay(JsonBuilder *builder, const gchar *name,
+                       guint x, guint y, guint fontsize,
+                       const guint8 color[4], const guint8 *text, guint length)
+{
+    gchar *str;
+
+    /* the text is not guaranteed to be terminated */
+    str = g_strndup((const gchar *)text, length);
+
+    json_builder_set_member_name(builder, name);
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "isshow");
+    json_builder_add_boolean_value(builder, TRUE);
+    json_builder_set_member_name(builder, "size");
+    json_builder_add_int_value(builder, fontsize);
+    json_builder_set_member_name(builder, "left");
+    json_builder_add_int_value(builder, x);
+    json_builder_set_member_name(builder, "top");
+    json_builder_add_int_value(builder, y);
+    json_builder_set_member_name(builder, "color");
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "red");
+    json_builder_add_int_value(builder, color[0]);
+    json_builder_set_member_name(builder, "green");
+    json_builder_add_int_value(builder, color[1]);
+    json_builder_set_member_name(builder, "blue");
+    json_builder_add_int_value(builder, color[2]);
+    json_builder_set_member_name(builder, "alpha");
+    json_builder_add_int_value(builder, color[3]);
+    json_builder_end_object(builder); // color
+    json_builder_set_member_name(builder, "text");
+    json_builder_add_string_value(builder, str);
+    json_builder_end_object(builder);
+
+    g_free(str);
+}
+
+static JsonBuilder *
+itrain_osd_begin_notice(void)
+{
+    JsonBuilder *builder = json_builder_new();
+
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "items");
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "master");
+    json_builder_begin_object(builder);
+
+    return builder;
+}
+
+static JsonNode *
+itrain_osd_end_notice(JsonBuilder *builder)
+{
+    JsonNode *notice_body;
+
+    json_builder_end_object(builder); // master
+    json_builder_end_object(builder); // items
+    json_builder_end_object(builder); // root
+
+    notice_body = json_builder_get_root(builder);
+    g_object_unref(builder);
+    ipcam_itrain_mem_charge(ITRAIN_MEM_JSON, ipcam_itrain_mem_json_size(notice_body));
+
+    return notice_body;
+}
+
+static JsonNode *
+itrain_osd_parse_text(const guint8 *buf, guint size)
+{
+    static const guint8 black[4];
+    const SetOSDRequest *req = (const SetOSDRequest *)buf;
+    guint length;
+    JsonBuilder *builder;
+
+    if (size < sizeof(*req))
+        return NULL;
+
+    length = ntohs(req->length);
+    if (size == OSD_LEGACY_SIZE) {
+        /* the fixed layout never had its checksum checked, keep it that way */
+        length = MIN(length, OSD_TEXT_MAX);
+    }
+    else if (length > OSD_TEXT_MAX || size != sizeof(*req) + length + 1) {
+        return NULL;
+    }
+    else if (itrain_osd_checksum(buf, size - 1) != buf[size - 1]) {
+        ITRAIN_LOG(OSD_CHECKSUM, size, buf[size - 1], itrain_osd_checksum(buf, size - 1));
+        return NULL;
+    }
+
+    builder = itrain_osd_begin_notice();
+    itrain_osd_add_overlay(builder, osd_overlay_names[0],
+                           ntohs(req->x), ntohs(req->y), ntohs(req->fontsize),
+                           black, req->data, length);
+    ipcam_itrain_stats_inc(ITRAIN_STAT_OSD_OVERLAYS);
+
+    return itrain_osd_end_notice(builder);
+}
+
+static JsonNode *
+itrain_osd_parse_overlays(const guint8 *buf, guint size)
+{
+    const SetOverlaysRequest *req = (const SetOverlaysRequest *)buf;
+    JsonBuilder *builder;
+    guint offset, i;
+
+    if (size < sizeof(*req) + 1 || req->count == 0)
+        return NULL;
+    if (itrain_osd_checksum(buf, size - 1) != buf[size - 1]) {
+        ITRAIN_LOG(OSD_CHECKSUM, size, buf[size - 1], itrain_osd_checksum(buf, size - 1));
+        return NULL;
+    }
+
+    /* check the whole layout before building anything */
+    offset = sizeof(*req);
+    for (i = 0; i < req->count; i++) {
+        const OverlayRecord *rec = (const OverlayRecord *)&buf[offset];
+
+        if (offset + sizeof(*rec) > size - 1)
+            return NULL;
+        offset += sizeof(*rec) + ntohs(rec->length);
+    }
+    if (offset != size - 1)
+        return NULL;
+
+    builder = itrain_osd_begin_notice();
+    offset = sizeof(*req);
+    for (i = 0; i < req->count; i++) {
+        const OverlayRecord *rec = (const OverlayRecord *)&buf[offset];
+
+        offset += sizeof(*rec) + ntohs(rec->length);
+        if (rec->id >= G_N_ELEMENTS(osd_overlay_names)) {
+            ITRAIN_LOG(OSD_UNKNOWN_OVERLAY, rec->id);
+            continue;
+        }
+        itrain_osd_add_overlay(builder, osd_overlay_names[rec->id],
+                               ntohs(rec->x), ntohs(rec->y), ntohs(rec->fontsize),
+                               &rec->red, rec->text, ntohs(rec->length));
+        ipcam_itrain_stats_inc(ITRAIN_STAT_OSD_OVERLAYS);
+    }
+
+    return itrain_osd_end_notice(builder);
+}
+
+static JsonObject *
+itrain_osd_notice_overlays(JsonNode *notice_body)
+{
+    JsonObject *items = json_object_get_object_member(json_node_get_object(notice_body), "items");
+
+    return json_object_get_object_member(items, "master");
+}
+
+/*
+ * Overlays of a stale notice that the newer one does not set are carried
+ * over, so a full queue never loses the last update of an overlay.
+ */
+static void
+itrain_osd_coalesce(JsonNode *notice_body, JsonNode *stale)
+{
+    JsonObject *overlays = itrain_osd_notice_overlays(notice_body);
+    JsonObject *stale_overlays = itrain_osd_notice_overlays(stale);
+    GList *members, *l;
+
+    ipcam_itrain_mem_uncharge(ITRAIN_MEM_JSON, ipcam_itrain_mem_json_size(notice_body));
+    members = json_object_get_members(stale_overlays);
+    for (l = members; l; l = l->next) {
+        if (!json_object_has_member(overlays, l->data))
+            json_object_set_member(overlays, l->data,
+                                   json_node_copy(json_object_get_member(stale_overlays, l->data)));
+    }
+    g_list_free(members);
+    ipcam_itrain_mem_charge(ITRAIN_MEM_JSON, ipcam_itrain_mem_json_size(notice_body));
+}
+
+/* queue a notice for the main loop, the queue takes it over */
+void ipcam_osd_queue_push(GAsyncQueue *queue, guint max_depth, JsonNode *notice_body)
+{
+    g_async_queue_lock(queue);
+    while (g_async_queue_length_unlocked(queue) >= (gint)MAX(max_depth, 1)) {
+        JsonNode *stale = g_async_queue_try_pop_unlocked(queue);
+
+        if (!stale)
+            break;
+        itrain_osd_coalesce(notice_body, stale);
+        ipcam_osd_notice_free(stale);
+        ipcam_itrain_stats_inc(ITRAIN_STAT_OSD_DROPPED);
+    }
+    g_async_queue_push_unlocked(queue, notice_body);
+    ipcam_itrain_stats_set(ITRAIN_STAT_OSD_QUEUE_DEPTH,
+                           g_async_queue_length_unlocked(queue));
+    g_async_queue_unlock(queue);
+}
+
+/*
+ * Text only update of the speed_gps and datetime overlays, position and
+ * style stay as configured.
+ */
+JsonNode *ipcam_osd_live_notice(const gchar *speed, const gchar *datetime)
+{
+    JsonBuilder *builder = itrain_osd_begin_notice();
+
+    json_builder_set_member_name(builder, "speed_gps");
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "text");
+    json_builder_add_string_value(builder, speed);
+    json_builder_end_object(builder);
+    json_builder_set_member_name(builder, "datetime");
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "text");
+    json_builder_add_string_value(builder, datetime);
+    json_builder_end_object(builder);
+
+    return itrain_osd_end_notice(builder);
+}
+
+static void
+itrain_osd_receive(IpcamOsdIngest *osd)
+{
+    guint8 buf[OSD_DATAGRAM_MAX];
+    struct sockaddr_in peer_addr;
+    socklen_t peer_len;
+    JsonNode *notice_body = NULL;
+    int n;
+
+    for (;;) {
+        peer_len = sizeof(peer_addr);
+        n = recvfrom(osd->sock, buf, sizeof(buf), 0,
+                     (struct sockaddr*)&peer_addr, &peer_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        ipcam_itrain_stats_inc(ITRAIN_STAT_OSD_RECEIVED);
+        notice_body = NULL;
+        if (n >= 2 && buf[0] == OSD_HEAD) {
+            if (buf[1] == OSD_CODE_TEXT)
+                notice_body = itrain_osd_parse_text(buf, n);
+            else if (buf[1] == OSD_CODE_OVERLAYS)
+                notice_body = itrain_osd_parse_overlays(buf, n);
+        }
+        if (!notice_body) {
+            ITRAIN_LOG(OSD_INVALID, n, n > 0 ? buf[0] : 0, n > 1 ? buf[1] : 0);
+            ipcam_itrain_stats_inc(ITRAIN_STAT_OSD_INVALID);
+            continue;
+        }
+
+        ipcam_osd_queue_push(osd->queue, osd->max_depth, notice_body);
+    }
+}
+
+static gpointer
+itrain_osd_thread_proc(gpointer data)
+{
+    IpcamOsdIngest *osd = data;
+    struct pollfd fds[2];
+
+    ipcam_itrain_rt_tune_thread("itrain-osd", osd->cpus, 0);
+
+    fds[0].fd = osd->sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = osd->wake_fds[0];
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, G_N_ELEMENTS(fds), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            g_print("%s:error\n", __func__);
+            break;
+        }
+        /* asked to stop */
+        if (fds[1].revents)
+            break;
+        if (fds[0].revents & POLLIN)
+            itrain_osd_receive(osd);
+    }
+
+    return NULL;
+}
+
+/* for notices never published */
+void ipcam_osd_notice_free(JsonNode *notice_body)
+{
+    ipcam_itrain_mem_uncharge(ITRAIN_MEM_JSON, ipcam_itrain_mem_json_size(notice_body));
+    json_node_free(notice_body);
+}
+
+/* sock must be non-blocking, it stays owned by the caller */
+IpcamOsdIngest *ipcam_osd_ingest_start(int sock, GAsyncQueue *queue, guint max_depth,
+                                       const gchar *cpus)
+{
+    IpcamOsdIngest *osd;
+
+    g_return_val_if_fail(sock >= 0 && queue != NULL, NULL);
+
+    osd = g_new0(IpcamOsdIngest, 1);
+    osd->sock = sock;
+    osd->queue = queue;
+    osd->max_depth = MAX(max_depth, 1);
+    osd->cpus = g_strdup(cpus);
+    if (pipe(osd->wake_fds) != 0) {
+        g_free(osd->cpus);
+        g_free(osd);
+        return NULL;
+    }
+    osd->thread = g_thread_new("itrain-osd", itrain_osd_thread_proc, osd);
+
+    return osd;
+}
+
+void ipcam_osd_ingest_stop(IpcamOsdIngest *osd)
+{
+    g_return_if_fail(osd != NULL);
+
+    if (write(osd->wake_fds[1], "Q", 1) != 1)
+        g_print("%s: failed to wake the osd thread\n", __func__);
+    g_thread_join(osd->thread);
+    close(osd->wake_fds[0]);
+    close(osd->wake_fds[1]);
+    g_free(osd->cpus);
+    g_free(osd);
+}
@@ -0,0 +1,34 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-osd.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_OSD_H_
+#define _IPCAM_ITRAIN_OSD_H_
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+
+/*
+ * OSD datagrams are received and decoded on a thread of their own, the
+ * resulting set_osd notice bodies are queued for the main loop which
+ * publishes them.  When the main loop falls behind the oldest queued
+ * notice is folded into the newest one, only the latest text of each
+ * overlay matters.
+ *
+ * Datagrams are either a single speed_gps line (code 0x09, sized by its
+ * length field) or a batch of overlay records (code 0x0a), both followed
+ * by an XOR checksum.  The old fixed 1036 byte layout is still accepted.
+ */
+typedef struct IpcamOsdIngest IpcamOsdIngest;
+
+IpcamOsdIngest *ipcam_osd_ingest_start(int sock, GAsyncQueue *queue, guint max_depth,
+                                       const gchar *cpus);
+void            ipcam_osd_ingest_stop(IpcamOsdIngest *osd);
+void            ipcam_osd_notice_free(JsonNode *notice_body);
+void            ipcam_osd_queue_push(GAsyncQueue *queue, guint max_depth, JsonNode *notice_body);
+JsonNode       *ipcam_osd_live_notice(const gchar *speed, const gchar *datetime);
+
+#endif /* _IPCAM_ITRAIN_OSD_H_ */
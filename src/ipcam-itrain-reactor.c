@@ -0,0 +1,1002 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-reactor.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "ipcam-itrain-stats.h"
+#include "ipcam-itrain-reactor.h"
+
+#define REACTOR_URING_ENTRIES   256
+#define REACTOR_URING_MAX_SENDS (64 * 1024)     /* bytes in flight per socket */
+#define REACTOR_URING_RECV_SIZE 2048            /* a few PDUs */
+
+/* above any descriptor the kernel hands out */
+#define REACTOR_SIM_FD_BASE     (1 << 24)
+#define REACTOR_IS_SIM_FD(fd)   ((fd) >= REACTOR_SIM_FD_BASE)
+
+#ifdef HAVE_LIBURING
+typedef enum
+{
+    REACTOR_REQ_POLL,
+    REACTOR_REQ_SEND,
+} ReactorRequestKind;
+
+/*
+ * One-shot poll, re-armed after its event has been handled.  EPOLLOUT is
+ * not polled for, it is reported once the sends in flight have completed.
+ * Once its owner reads with ipcam_reactor_recv, a recv into recv_buf is
+ * armed instead and the data comes with the completion.
+ */
+typedef struct ReactorPoll
+{
+    ReactorRequestKind kind;
+    int      fd;
+    guint32  events;
+    gpointer data;
+    gboolean armed;     /* queued or in flight */
+    gboolean removed;
+    gboolean rearm;     /* events changed while armed */
+    gboolean writable_queued;
+    guint    sends;     /* in flight */
+    gsize    send_bytes;
+    gboolean send_failed;
+    gboolean recv_mode;
+    gboolean recv_armed;    /* the request armed is a recv */
+    gboolean buffered;      /* the last event came with recv_buf */
+    gsize    recv_off;
+    gsize    recv_len;
+    int      recv_res;      /* of the completion, 0 at end of stream */
+    guint8   recv_buf[REACTOR_URING_RECV_SIZE];
+} ReactorPoll;
+
+/* the payload is copied, the caller's buffer is gone by completion time */
+typedef struct ReactorSend
+{
+    ReactorRequestKind      kind;
+    ReactorPoll             *poll;      /* NULL for datagrams */
+    gsize                   len;
+    struct msghdr           msg;
+    struct iovec            iov;
+    struct sockaddr_storage addr;
+    guint8                  buf[0];
+} ReactorSend;
+#endif
+
+/* an in-memory stream, freed once both ends are done with it */
+typedef struct ReactorSimSocket
+{
+    int        fd;
+    guint32    events;
+    gpointer   data;
+    gboolean   registered;
+    GByteArray *input;          /* client -> server */
+    GByteArray *output;         /* server -> client */
+    gboolean   hangup;          /* by the client */
+    gboolean   closed;          /* by the server */
+    gboolean   ready_queued;
+    gboolean   output_queued;
+} ReactorSimSocket;
+
+typedef struct ReactorSim
+{
+    GHashTable *sockets;        /* fd -> ReactorSimSocket */
+    GQueue     ready;           /* fds with an event for the server */
+    GQueue     output;          /* fds with something for the client */
+    int        current;         /* last reported, checked again on next wait */
+    int        next_fd;
+} ReactorSim;
+
+struct IpcamReactor
+{
+    gboolean          use_uring;
+    int               epoll_fd;
+    ReactorSim        *sim;
+#ifdef HAVE_LIBURING
+    struct io_uring   ring;
+    GHashTable        *polls;           /* fd -> ReactorPoll */
+    ReactorPoll       *current;         /* last reported, re-armed on next wait */
+    GQueue            writable;         /* polls to report EPOLLOUT for */
+    struct io_uring_sqe *last_send;     /* to keep sends on one socket in order */
+    int               last_send_fd;
+    guint             nr_sends;         /* queued, not yet submitted */
+#endif
+};
+
+#ifdef HAVE_LIBURING
+static void
+reactor_uring_submit(IpcamReactor *reactor)
+{
+    io_uring_submit(&reactor->ring);
+    ipcam_itrain_stats_inc(ITRAIN_STAT_IO_SYSCALLS);
+    reactor->last_send = NULL;
+    reactor->nr_sends = 0;
+}
+
+static struct io_uring_sqe *
+reactor_uring_get_sqe(IpcamReactor *reactor)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&reactor->ring);
+
+    if (!sqe) {
+        /* submission queue full, push it out and retry */
+        reactor_uring_submit(reactor);
+        sqe = io_uring_get_sqe(&reactor->ring);
+    }
+
+    return sqe;
+}
+
+static gboolean
+reactor_uring_arm(IpcamReactor *reactor, ReactorPoll *poll)
+{
+    struct io_uring_sqe *sqe = reactor_uring_get_sqe(reactor);
+
+    if (!sqe)
+        return FALSE;
+
+    poll->recv_armed = poll->recv_mode && (poll->events & EPOLLIN);
+    poll->buffered = FALSE;
+    if (poll->recv_armed)
+        io_uring_prep_recv(sqe, poll->fd, poll->recv_buf, sizeof(poll->recv_buf), 0);
+    else
+        io_uring_prep_poll_add(sqe, poll->fd, poll->events & ~EPOLLOUT);
+    io_uring_sqe_set_data(sqe, poll);
+    poll->armed = TRUE;
+
+    return TRUE;
+}
+
+/* cancel the poll or recv in flight, its completion comes all the same */
+static gboolean
+reactor_uring_cancel(IpcamReactor *reactor, ReactorPoll *poll)
+{
+    struct io_uring_sqe *sqe = reactor_uring_get_sqe(reactor);
+
+    if (!sqe)
+        return FALSE;
+
+    if (poll->recv_armed)
+        io_uring_prep_cancel(sqe, poll, 0);
+    else
+        io_uring_prep_poll_remove(sqe, (__u64)(uintptr_t)poll);
+    io_uring_sqe_set_data(sqe, NULL);
+
+    return TRUE;
+}
+
+static gboolean
+reactor_uring_init(IpcamReactor *reactor)
+{
+    int ret = io_uring_queue_init(REACTOR_URING_ENTRIES, &reactor->ring, 0);
+
+    if (ret < 0) {
+        g_print("ITrain: io_uring unavailable (%s).\n", strerror(-ret));
+        return FALSE;
+    }
+    reactor->polls = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
+    g_queue_init(&reactor->writable);
+    reactor->use_uring = TRUE;
+
+    return TRUE;
+}
+
+/* a removed poll goes once nothing in the ring or in our hands refers to it */
+static void
+reactor_uring_release(IpcamReactor *reactor, ReactorPoll *poll)
+{
+    if (poll->removed && !poll->armed && !poll->sends &&
+        !poll->writable_queued && reactor->current != poll)
+        g_free(poll);
+}
+
+static void
+reactor_uring_queue_writable(IpcamReactor *reactor, ReactorPoll *poll)
+{
+    if (poll->writable_queued)
+        return;
+
+    g_queue_push_tail(&reactor->writable, poll);
+    poll->writable_queued = TRUE;
+}
+
+/* returns 1 and fills the event if a socket is writable again */
+static int
+reactor_uring_next_writable(IpcamReactor *reactor, struct epoll_event *event)
+{
+    while (!g_queue_is_empty(&reactor->writable)) {
+        ReactorPoll *poll = g_queue_pop_head(&reactor->writable);
+
+        poll->writable_queued = FALSE;
+        if (poll->removed) {
+            reactor_uring_release(reactor, poll);
+            continue;
+        }
+        if (!(poll->events & EPOLLOUT) || poll->sends || poll->send_failed)
+            continue;
+
+        /* the poll itself stays armed for input */
+        event->events = EPOLLOUT;
+        event->data.ptr = poll->data;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * The socket has a hole in its stream after a short or failed send, and
+ * the sends linked behind it are cancelled.  Shut it down so the owner
+ * sees a hangup and closes it; a reused fd number is left alone.
+ */
+static void
+reactor_uring_send_done(IpcamReactor *reactor, ReactorSend *send, int res)
+{
+    ReactorPoll *poll = send->poll;
+
+    if (!poll)
+        return;
+
+    poll->sends--;
+    poll->send_bytes -= send->len;
+    if (res < 0 || (gsize)res < send->len) {
+        if (!poll->removed && !poll->send_failed) {
+            poll->send_failed = TRUE;
+            shutdown(poll->fd, SHUT_RDWR);
+        }
+    }
+    else if (!poll->removed && !poll->sends && (poll->events & EPOLLOUT))
+        reactor_uring_queue_writable(reactor, poll);
+
+    reactor_uring_release(reactor, poll);
+}
+
+/* returns 1 and fills the event for a poll completion, 0 for anything else */
+static int
+reactor_uring_complete(IpcamReactor *reactor, struct io_uring_cqe *cqe,
+                       struct epoll_event *event)
+{
+    ReactorRequestKind *kind = io_uring_cqe_get_data(cqe);
+    ReactorPoll *poll;
+    int res = cqe->res;
+
+    io_uring_cqe_seen(&reactor->ring, cqe);
+
+    /* poll removals and cancels carry no data */
+    if (!kind)
+        return 0;
+
+    if (*kind == REACTOR_REQ_SEND) {
+        reactor_uring_send_done(reactor, (ReactorSend *)kind, res);
+        g_free(kind);
+        return 0;
+    }
+
+    poll = (ReactorPoll *)kind;
+    poll->armed = FALSE;
+    if (poll->removed) {
+        reactor_uring_release(reactor, poll);
+        return 0;
+    }
+
+    /* cancelled by ipcam_reactor_modify, watch the new events */
+    if (poll->rearm) {
+        poll->rearm = FALSE;
+        if (res == -ECANCELED) {
+            reactor_uring_arm(reactor, poll);
+            return 0;
+        }
+    }
+
+    if (poll->recv_armed) {
+        /* what a recv on the socket would have said, kept for the owner */
+        poll->buffered = TRUE;
+        poll->recv_off = 0;
+        poll->recv_len = MAX(res, 0);
+        poll->recv_res = res;
+        if (res > 0)
+            event->events = EPOLLIN;
+        else if (res == 0)
+            event->events = EPOLLIN | EPOLLRDHUP;
+        else
+            event->events = EPOLLIN | EPOLLERR;
+    }
+    else
+        event->events = res < 0 ? EPOLLERR : (guint32)res;
+    event->data.ptr = poll->data;
+    reactor->current = poll;
+
+    return 1;
+}
+
+/*
+ * Data a ring recv brought in is handed out first.  The first read of a
+ * socket goes to the kernel and turns the ring recv on for it.
+ */
+static gssize
+reactor_uring_recv(IpcamReactor *reactor, int fd, void *buf, gsize len, int flags)
+{
+    ReactorPoll *poll = g_hash_table_lookup(reactor->polls, GINT_TO_POINTER(fd));
+    gsize n;
+
+    if (!poll || !poll->buffered) {
+        if (poll)
+            poll->recv_mode = TRUE;
+        ipcam_itrain_stats_inc(ITRAIN_STAT_IO_SYSCALLS);
+        return recv(fd, buf, len, flags);
+    }
+
+    if (poll->recv_len) {
+        n = MIN(len, poll->recv_len);
+        memcpy(buf, poll->recv_buf + poll->recv_off, n);
+        if (!(flags & MSG_PEEK)) {
+            poll->recv_off += n;
+            poll->recv_len -= n;
+        }
+        return n;
+    }
+    if (poll->recv_res == 0)
+        return 0;
+
+    /* consumed, or failed: the next wait arms a recv again */
+    errno = poll->recv_res < 0 ? -poll->recv_res : EAGAIN;
+    poll->recv_res = -EAGAIN;
+
+    return -1;
+}
+
+static int
+reactor_uring_wait(IpcamReactor *reactor, struct epoll_event *event, int timeout_ms)
+{
+    struct io_uring_cqe *cqe;
+    struct __kernel_timespec ts;
+    int ret;
+
+    /* the previous event has been handled, watch that fd again */
+    if (reactor->current) {
+        ReactorPoll *poll = reactor->current;
+
+        reactor->current = NULL;
+        if (poll->removed)
+            reactor_uring_release(reactor, poll);
+        else if (poll->buffered && poll->recv_len) {
+            /* the owner has not taken all of it yet */
+            event->events = EPOLLIN;
+            event->data.ptr = poll->data;
+            reactor->current = poll;
+            return 1;
+        }
+        else
+            reactor_uring_arm(reactor, poll);
+    }
+
+    /* completions already in the ring need no system call */
+    while (io_uring_peek_cqe(&reactor->ring, &cqe) == 0) {
+        if (reactor_uring_complete(reactor, cqe, event))
+            return 1;
+    }
+    if (reactor_uring_next_writable(reactor, event))
+        return 1;
+
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    ret = io_uring_submit_and_wait_timeout(&reactor->ring, &cqe, 1, &ts, NULL);
+    ipcam_itrain_stats_inc(ITRAIN_STAT_IO_SYSCALLS);
+    reactor->last_send = NULL;
+    reactor->nr_sends = 0;
+    if (ret < 0)
+        return (ret == -ETIME || ret == -EINTR) ? 0 : -1;
+
+    while (io_uring_peek_cqe(&reactor->ring, &cqe) == 0) {
+        if (reactor_uring_complete(reactor, cqe, event))
+            return 1;
+    }
+
+    return reactor_uring_next_writable(reactor, event);
+}
+
+/*
+ * The send is only queued, its outcome is known at completion time.  A
+ * stream with too much in flight gets EAGAIN and EPOLLOUT once that is
+ * done, one with a failed send EPIPE.
+ */
+static gssize
+reactor_uring_send(IpcamReactor *reactor, int fd, const void *buf, gsize len,
+                   const struct sockaddr *addr, socklen_t addr_len)
+{
+    struct io_uring_sqe *sqe;
+    ReactorSend *send;
+    ReactorPoll *poll = NULL;
+
+    if (addr_len > sizeof(send->addr))
+        return -1;
+
+    if (!addr) {
+        poll = g_hash_table_lookup(reactor->polls, GINT_TO_POINTER(fd));
+        if (poll && poll->send_failed) {
+            errno = EPIPE;
+            return -1;
+        }
+        if (poll && poll->sends && poll->send_bytes + len > REACTOR_URING_MAX_SENDS) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    send = g_malloc0(sizeof(ReactorSend) + len);
+    send->kind = REACTOR_REQ_SEND;
+    send->len = len;
+    memcpy(send->buf, buf, len);
+    send->iov.iov_base = send->buf;
+    send->iov.iov_len = len;
+    send->msg.msg_iov = &send->iov;
+    send->msg.msg_iovlen = 1;
+    if (addr) {
+        memcpy(&send->addr, addr, addr_len);
+        send->msg.msg_name = &send->addr;
+        send->msg.msg_namelen = addr_len;
+    }
+
+    sqe = reactor_uring_get_sqe(reactor);
+    if (!sqe) {
+        g_free(send);
+        return -1;
+    }
+
+    /* a stream must not be reordered, chain it to the previous send */
+    if (reactor->last_send && reactor->last_send_fd == fd)
+        reactor->last_send->flags |= IOSQE_IO_LINK;
+
+    io_uring_prep_sendmsg(sqe, fd, &send->msg, MSG_NOSIGNAL);
+    io_uring_sqe_set_data(sqe, send);
+    reactor->last_send = sqe;
+    reactor->last_send_fd = fd;
+    reactor->nr_sends++;
+    if (poll) {
+        send->poll = poll;
+        poll->sends++;
+        poll->send_bytes += len;
+    }
+
+    return len;
+}
+#endif
+
+static void
+reactor_sim_socket_free(gpointer data)
+{
+    ReactorSimSocket *sock = data;
+
+    g_byte_array_unref(sock->input);
+    g_byte_array_unref(sock->output);
+    g_free(sock);
+}
+
+static ReactorSimSocket *
+reactor_sim_lookup(IpcamReactor *reactor, int fd)
+{
+    return g_hash_table_lookup(reactor->sim->sockets, GINT_TO_POINTER(fd));
+}
+
+/* level triggered like epoll: ready while there is input or a hangup */
+static void
+reactor_sim_check_ready(IpcamReactor *reactor, ReactorSimSocket *sock)
+{
+    if (sock->ready_queued || !sock->registered || !(sock->events & EPOLLIN))
+        return;
+    if (sock->input->len == 0 && !sock->hangup)
+        return;
+
+    g_queue_push_tail(&reactor->sim->ready, GINT_TO_POINTER(sock->fd));
+    sock->ready_queued = TRUE;
+}
+
+static void
+reactor_sim_queue_output(IpcamReactor *reactor, ReactorSimSocket *sock)
+{
+    if (sock->output_queued)
+        return;
+
+    g_queue_push_tail(&reactor->sim->output, GINT_TO_POINTER(sock->fd));
+    sock->output_queued = TRUE;
+}
+
+/* drop the socket once neither end refers to it any more */
+static void
+reactor_sim_release(IpcamReactor *reactor, ReactorSimSocket *sock)
+{
+    if (sock->closed && sock->hangup)
+        g_hash_table_remove(reactor->sim->sockets, GINT_TO_POINTER(sock->fd));
+}
+
+static int
+reactor_sim_wait(IpcamReactor *reactor, struct epoll_event *event)
+{
+    ReactorSim *sim = reactor->sim;
+    ReactorSimSocket *sock;
+    int ret;
+
+    if (sim->current >= 0) {
+        if ((sock = reactor_sim_lookup(reactor, sim->current)) != NULL)
+            reactor_sim_check_ready(reactor, sock);
+        sim->current = -1;
+    }
+
+    while (!g_queue_is_empty(&sim->ready)) {
+        int fd = GPOINTER_TO_INT(g_queue_pop_head(&sim->ready));
+
+        sock = reactor_sim_lookup(reactor, fd);
+        if (!sock)
+            continue;
+        sock->ready_queued = FALSE;
+        if (!sock->registered || (sock->input->len == 0 && !sock->hangup))
+            continue;
+
+        event->events = EPOLLIN | (sock->hangup ? EPOLLRDHUP : 0);
+        event->data.ptr = sock->data;
+        sim->current = fd;
+
+        return 1;
+    }
+
+    /* the command pipe, never block */
+    ret = epoll_wait(reactor->epoll_fd, event, 1, 0);
+    if (ret < 0 && errno == EINTR)
+        ret = 0;
+
+    return ret;
+}
+
+static gssize
+reactor_sim_send(IpcamReactor *reactor, int fd, const void *buf, gsize len)
+{
+    ReactorSimSocket *sock = reactor_sim_lookup(reactor, fd);
+
+    if (!sock || sock->closed) {
+        errno = EBADF;
+        return -1;
+    }
+    if (sock->hangup) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    g_byte_array_append(sock->output, buf, len);
+    reactor_sim_queue_output(reactor, sock);
+
+    return len;
+}
+
+static gssize
+reactor_sim_recv(IpcamReactor *reactor, int fd, void *buf, gsize len, int flags)
+{
+    ReactorSimSocket *sock = reactor_sim_lookup(reactor, fd);
+    gsize n;
+
+    if (!sock || sock->closed) {
+        errno = EBADF;
+        return -1;
+    }
+
+    n = MIN(len, sock->input->len);
+    if (n == 0) {
+        if (sock->hangup)
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    memcpy(buf, sock->input->data, n);
+    if (!(flags & MSG_PEEK))
+        g_byte_array_remove_range(sock->input, 0, n);
+
+    return n;
+}
+
+int ipcam_reactor_sim_socket(IpcamReactor *reactor)
+{
+    ReactorSimSocket *sock;
+
+    g_return_val_if_fail(reactor->sim != NULL, -1);
+
+    sock = g_new0(ReactorSimSocket, 1);
+    sock->fd = reactor->sim->next_fd++;
+    sock->input = g_byte_array_new();
+    sock->output = g_byte_array_new();
+    g_hash_table_insert(reactor->sim->sockets, GINT_TO_POINTER(sock->fd), sock);
+
+    return sock->fd;
+}
+
+void ipcam_reactor_sim_write(IpcamReactor *reactor, int fd, const void *buf, gsize len)
+{
+    ReactorSimSocket *sock = reactor_sim_lookup(reactor, fd);
+
+    if (!sock || sock->closed || sock->hangup)
+        return;
+
+    g_byte_array_append(sock->input, buf, len);
+    reactor_sim_check_ready(reactor, sock);
+}
+
+/* like recv(): -1 with EAGAIN while open and empty, 0 once closed */
+gssize ipcam_reactor_sim_read(IpcamReactor *reactor, int fd, void *buf, gsize len)
+{
+    ReactorSimSocket *sock = reactor_sim_lookup(reactor, fd);
+    gsize n;
+
+    if (!sock) {
+        errno = EBADF;
+        return -1;
+    }
+
+    n = MIN(len, sock->output->len);
+    if (n == 0) {
+        if (sock->closed)
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    memcpy(buf, sock->output->data, n);
+    g_byte_array_remove_range(sock->output, 0, n);
+
+    return n;
+}
+
+/* a socket with data for the client or closed by the server, -1 if none */
+int ipcam_reactor_sim_next_output(IpcamReactor *reactor)
+{
+    while (!g_queue_is_empty(&reactor->sim->output)) {
+        int fd = GPOINTER_TO_INT(g_queue_pop_head(&reactor->sim->output));
+        ReactorSimSocket *sock = reactor_sim_lookup(reactor, fd);
+
+        if (sock) {
+            sock->output_queued = FALSE;
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+gboolean ipcam_reactor_sim_closed(IpcamReactor *reactor, int fd)
+{
+    ReactorSimSocket *sock = reactor_sim_lookup(reactor, fd);
+
+    return !sock || sock->closed;
+}
+
+/* the client end goes away, the server sees EPOLLRDHUP */
+void ipcam_reactor_sim_hangup(IpcamReactor *reactor, int fd)
+{
+    ReactorSimSocket *sock = reactor_sim_lookup(reactor, fd);
+
+    if (!sock || sock->hangup)
+        return;
+
+    sock->hangup = TRUE;
+    reactor_sim_check_ready(reactor, sock);
+    reactor_sim_release(reactor, sock);
+}
+
+IpcamReactor *ipcam_reactor_new(const gchar *backend)
+{
+    IpcamReactor *reactor = g_new0(IpcamReactor, 1);
+
+    reactor->epoll_fd = -1;
+
+    if (g_strcmp0(backend, "io_uring") == 0) {
+#ifdef HAVE_LIBURING
+        if (reactor_uring_init(reactor))
+            return reactor;
+#else
+        g_print("ITrain: built without io_uring support.\n");
+#endif
+        g_print("ITrain: falling back to epoll.\n");
+    }
+
+    reactor->epoll_fd = epoll_create(10);
+    if (reactor->epoll_fd < 0) {
+        g_free(reactor);
+        return NULL;
+    }
+
+    if (g_strcmp0(backend, "sim") == 0) {
+        reactor->sim = g_new0(ReactorSim, 1);
+        reactor->sim->sockets = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                      NULL, reactor_sim_socket_free);
+        g_queue_init(&reactor->sim->ready);
+        g_queue_init(&reactor->sim->output);
+        reactor->sim->current = -1;
+        reactor->sim->next_fd = REACTOR_SIM_FD_BASE;
+    }
+
+    return reactor;
+}
+
+void ipcam_reactor_free(IpcamReactor *reactor)
+{
+    g_return_if_fail(reactor != NULL);
+
+#ifdef HAVE_LIBURING
+    if (reactor->use_uring) {
+        GHashTableIter iter;
+        gpointer value;
+
+        if (reactor->nr_sends)
+            reactor_uring_submit(reactor);
+        io_uring_queue_exit(&reactor->ring);
+
+        /* the ring is gone, so are all requests in flight */
+        g_hash_table_iter_init(&iter, reactor->polls);
+        while (g_hash_table_iter_next(&iter, NULL, &value))
+            g_free(value);
+        g_hash_table_destroy(reactor->polls);
+        g_queue_clear(&reactor->writable);
+        if (reactor->current && reactor->current->removed)
+            g_free(reactor->current);
+    }
+#endif
+    if (reactor->sim) {
+        g_hash_table_destroy(reactor->sim->sockets);
+        g_queue_clear(&reactor->sim->ready);
+        g_queue_clear(&reactor->sim->output);
+        g_free(reactor->sim);
+    }
+    if (reactor->epoll_fd >= 0)
+        close(reactor->epoll_fd);
+    g_free(reactor);
+}
+
+const gchar *ipcam_reactor_backend_name(IpcamReactor *reactor)
+{
+    if (reactor->sim)
+        return "sim";
+
+    return reactor->use_uring ? "io_uring" : "epoll";
+}
+
+int ipcam_reactor_add(IpcamReactor *reactor, int fd, guint32 events, gpointer data)
+{
+    struct epoll_event event;
+
+    if (REACTOR_IS_SIM_FD(fd) && reactor->sim) {
+        ReactorSimSocket *sock = reactor_sim_lookup(reactor, fd);
+
+        if (!sock || sock->registered)
+            return -1;
+        sock->registered = TRUE;
+        sock->events = events;
+        sock->data = data;
+        reactor_sim_check_ready(reactor, sock);
+
+        return 0;
+    }
+
+#ifdef HAVE_LIBURING
+    if (reactor->use_uring) {
+        ReactorPoll *poll;
+
+        if (g_hash_table_lookup(reactor->polls, GINT_TO_POINTER(fd)))
+            return -1;
+
+        poll = g_new0(ReactorPoll, 1);
+        poll->kind = REACTOR_REQ_POLL;
+        poll->fd = fd;
+        poll->events = events;
+        poll->data = data;
+        if (!reactor_uring_arm(reactor, poll)) {
+            g_free(poll);
+            return -1;
+        }
+        g_hash_table_insert(reactor->polls, GINT_TO_POINTER(fd), poll);
+
+        return 0;
+    }
+#endif
+
+    event.events = events;
+    event.data.ptr = data;
+    ipcam_itrain_stats_inc(ITRAIN_STAT_IO_SYSCALLS);
+
+    return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/* the caller may close fd right after this returns */
+int ipcam_reactor_del(IpcamReactor *reactor, int fd)
+{
+    if (REACTOR_IS_SIM_FD(fd) && reactor->sim) {
+        ReactorSimSocket *sock = reactor_sim_lookup(reactor, fd);
+
+        if (!sock || !sock->registered)
+            return -1;
+        sock->registered = FALSE;
+
+        return 0;
+    }
+
+#ifdef HAVE_LIBURING
+    if (reactor->use_uring) {
+        ReactorPoll *poll = g_hash_table_lookup(reactor->polls, GINT_TO_POINTER(fd));
+
+        if (!poll)
+            return -1;
+
+        g_hash_table_remove(reactor->polls, GINT_TO_POINTER(fd));
+        poll->removed = TRUE;
+        if (poll->armed)
+            reactor_uring_cancel(reactor, poll);
+        /* queued sends refer to the fd number, not the file */
+        if (reactor->nr_sends)
+            reactor_uring_submit(reactor);
+        reactor_uring_release(reactor, poll);
+
+        return 0;
+    }
+#endif
+
+    ipcam_itrain_stats_inc(ITRAIN_STAT_IO_SYSCALLS);
+
+    return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* change the events watched on fd, e.g. EPOLLOUT while output is pending */
+int ipcam_reactor_modify(IpcamReactor *reactor, int fd, guint32 events, gpointer data)
+{
+    struct epoll_event event;
+
+    if (REACTOR_IS_SIM_FD(fd) && reactor->sim) {
+        ReactorSimSocket *sock = reactor_sim_lookup(reactor, fd);
+
+        if (!sock || !sock->registered)
+            return -1;
+        sock->events = events;
+        sock->data = data;
+        reactor_sim_check_ready(reactor, sock);
+
+        return 0;
+    }
+
+#ifdef HAVE_LIBURING
+    if (reactor->use_uring) {
+        ReactorPoll *poll = g_hash_table_lookup(reactor->polls, GINT_TO_POINTER(fd));
+        guint32 polled;
+
+        if (!poll)
+            return -1;
+
+        /* the sends in flight keep their poll, only EPOLLOUT is ours */
+        polled = poll->events & ~EPOLLOUT;
+        poll->events = events;
+        poll->data = data;
+        /* the cancelled poll is armed again with the new events */
+        if ((events & ~EPOLLOUT) != polled && poll->armed && !poll->rearm)
+            poll->rearm = reactor_uring_cancel(reactor, poll);
+        if ((events & EPOLLOUT) && !poll->sends && !poll->send_failed)
+            reactor_uring_queue_writable(reactor, poll);
+
+        return 0;
+    }
+#endif
+
+    event.events = events;
+    event.data.ptr = data;
+    ipcam_itrain_stats_inc(ITRAIN_STAT_IO_SYSCALLS);
+
+    return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+/*
+ * Wait for a single event, handlers may free anything a batch of events
+ * would still refer to.  Returns 1 for an event, 0 on timeout.
+ */
+int ipcam_reactor_wait(IpcamReactor *reactor, struct epoll_event *event, int timeout_ms)
+{
+    int ret;
+
+    if (reactor->sim)
+        return reactor_sim_wait(reactor, event);
+#ifdef HAVE_LIBURING
+    if (reactor->use_uring)
+        return reactor_uring_wait(reactor, event, timeout_ms);
+#endif
+
+    ret = epoll_wait(reactor->epoll_fd, event, 1, timeout_ms);
+    ipcam_itrain_stats_inc(ITRAIN_STAT_IO_SYSCALLS);
+    if (ret < 0 && errno == EINTR)
+        ret = 0;
+
+    return ret;
+}
+
+gssize ipcam_reactor_send(IpcamReactor *reactor, int fd, const void *buf, gsize len)
+{
+    if (REACTOR_IS_SIM_FD(fd) && reactor->sim)
+        return reactor_sim_send(reactor, fd, buf, len);
+#ifdef HAVE_LIBURING
+    if (reactor->use_uring)
+        return reactor_uring_send(reactor, fd, buf, len, NULL, 0);
+#endif
+
+    ipcam_itrain_stats_inc(ITRAIN_STAT_IO_SYSCALLS);
+
+    return send(fd, buf, len, MSG_NOSIGNAL);
+}
+
+gssize ipcam_reactor_sendto(IpcamReactor *reactor, int fd, const void *buf, gsize len,
+                            const struct sockaddr *addr, socklen_t addr_len)
+{
+#ifdef HAVE_LIBURING
+    if (reactor->use_uring)
+        return reactor_uring_send(reactor, fd, buf, len, addr, addr_len);
+#endif
+
+    ipcam_itrain_stats_inc(ITRAIN_STAT_IO_SYSCALLS);
+
+    return sendto(fd, buf, len, 0, addr, addr_len);
+}
+
+gssize ipcam_reactor_recv(IpcamReactor *reactor, int fd, void *buf, gsize len, int flags)
+{
+    if (REACTOR_IS_SIM_FD(fd) && reactor->sim)
+        return reactor_sim_recv(reactor, fd, buf, len, flags);
+#ifdef HAVE_LIBURING
+    if (reactor->use_uring)
+        return reactor_uring_recv(reactor, fd, buf, len, flags);
+#endif
+
+    ipcam_itrain_stats_inc(ITRAIN_STAT_IO_SYSCALLS);
+
+    return recv(fd, buf, len, flags);
+}
+
+/* stop watching fd and close it */
+void ipcam_reactor_close(IpcamReactor *reactor, int fd)
+{
+    if (REACTOR_IS_SIM_FD(fd) && reactor->sim) {
+        ReactorSimSocket *sock = reactor_sim_lookup(reactor, fd);
+
+        if (!sock || sock->closed)
+            return;
+        sock->registered = FALSE;
+        sock->closed = TRUE;
+        reactor_sim_queue_output(reactor, sock);
+        reactor_sim_release(reactor, sock);
+        return;
+    }
+
+    ipcam_reactor_del(reactor, fd);
+    close(fd);
+}
+
+/* the owner of fd sees a hangup on the next wait and closes it */
+void ipcam_reactor_shutdown(IpcamReactor *reactor, int fd)
+{
+    if (REACTOR_IS_SIM_FD(fd) && reactor->sim) {
+        ipcam_reactor_sim_hangup(reactor, fd);
+        return;
+    }
+
+    shutdown(fd, SHUT_RDWR);
+}
+
+/* push queued sends out now, e.g. before the sockets are handed over */
+void ipcam_reactor_flush(IpcamReactor *reactor)
+{
+#ifdef HAVE_LIBURING
+    if (reactor->use_uring && reactor->nr_sends)
+        reactor_uring_submit(reactor);
+#endif
+}
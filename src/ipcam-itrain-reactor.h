@@ -0,0 +1,59 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-reactor.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_REACTOR_H_
+#define _IPCAM_ITRAIN_REACTOR_H_
+
+#include <glib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+/*
+ * I/O backend of the server thread.  Readiness is reported as epoll
+ * events whatever the backend, so the event handlers do not care.
+ *
+ * The epoll backend sends right away and may send less than asked for
+ * or fail with EAGAIN, the caller keeps the rest until fd is writable.
+ * The io_uring backend (built with
+ * --enable-io-uring) queues sends and re-armed polls and submits them in
+ * one go with the next wait, so a fan-out to all clients costs a single
+ * system call.  A queued send is not done yet: past 64 KiB in flight on
+ * a socket send fails with EAGAIN until EPOLLOUT, and after a short or
+ * failed completion the socket is shut down and sends fail with EPIPE.
+ *
+ * The "sim" backend keeps client sockets in memory for tools/itrain-sim:
+ * ipcam_reactor_sim_socket() hands out a descriptor the server uses like
+ * an accepted socket while the simulator plays the client with the
+ * sim_write/sim_read calls.  Real descriptors such as the command pipe are
+ * still watched, but wait never blocks, the caller moves the clock.
+ */
+typedef struct IpcamReactor IpcamReactor;
+
+IpcamReactor *ipcam_reactor_new(const gchar *backend);
+void          ipcam_reactor_free(IpcamReactor *reactor);
+const gchar  *ipcam_reactor_backend_name(IpcamReactor *reactor);
+
+int    ipcam_reactor_add(IpcamReactor *reactor, int fd, guint32 events, gpointer data);
+int    ipcam_reactor_del(IpcamReactor *reactor, int fd);
+int    ipcam_reactor_modify(IpcamReactor *reactor, int fd, guint32 events, gpointer data);
+int    ipcam_reactor_wait(IpcamReactor *reactor, struct epoll_event *event, int timeout_ms);
+gssize ipcam_reactor_send(IpcamReactor *reactor, int fd, const void *buf, gsize len);
+gssize ipcam_reactor_sendto(IpcamReactor *reactor, int fd, const void *buf, gsize len,
+                            const struct sockaddr *addr, socklen_t addr_len);
+gssize ipcam_reactor_recv(IpcamReactor *reactor, int fd, void *buf, gsize len, int flags);
+void   ipcam_reactor_close(IpcamReactor *reactor, int fd);
+void   ipcam_reactor_shutdown(IpcamReactor *reactor, int fd);
+void   ipcam_reactor_flush(IpcamReactor *reactor);
+
+int      ipcam_reactor_sim_socket(IpcamReactor *reactor);
+void     ipcam_reactor_sim_write(IpcamReactor *reactor, int fd, const void *buf, gsize len);
+gssize   ipcam_reactor_sim_read(IpcamReactor *reactor, int fd, void *buf, gsize len);
+int      ipcam_reactor_sim_next_output(IpcamReactor *reactor);
+gboolean ipcam_reactor_sim_closed(IpcamReactor *reactor, int fd);
+void     ipcam_reactor_sim_hangup(IpcamReactor *reactor, int fd);
+
+#endif /* _IPCAM_ITRAIN_REACTOR_H_ */
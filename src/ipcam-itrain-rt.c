@@ -0,0 +1,128 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-rt.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "ipcam-itrain-rt.h"
+
+/* "1", "2-3" or "0,2-3" */
+static gboolean
+itrain_rt_parse_cpus(const gchar *cpus, cpu_set_t *set)
+{
+    const gchar *p = cpus;
+
+    CPU_ZERO(set);
+    while (*p) {
+        gchar *end;
+        gulong first, last;
+
+        first = last = strtoul(p, &end, 10);
+        if (end == p)
+            return FALSE;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p || last < first)
+                return FALSE;
+        }
+        if (last >= CPU_SETSIZE)
+            return FALSE;
+        for (; first <= last; first++)
+            CPU_SET(first, set);
+
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return FALSE;
+    }
+
+    return CPU_COUNT(set) > 0;
+}
+
+gboolean ipcam_itrain_rt_check_cpus(const gchar *cpus)
+{
+    cpu_set_t set;
+
+    return itrain_rt_parse_cpus(cpus, &set);
+}
+
+/* applies to the calling thread, NULL or "" cpus leaves the affinity alone */
+void ipcam_itrain_rt_tune_thread(const gchar *name, const gchar *cpus, guint fifo_priority)
+{
+    cpu_set_t set;
+    int err;
+
+    if (cpus && *cpus) {
+        if (!itrain_rt_parse_cpus(cpus, &set))
+            g_print("ITrain: %s: invalid cpu list \"%s\".\n", name, cpus);
+        else if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+            g_print("ITrain: %s: cannot bind to cpus %s: %s\n", name, cpus, strerror(err));
+    }
+
+    if (fifo_priority) {
+        struct sched_param param = { .sched_priority = fifo_priority };
+
+        param.sched_priority = CLAMP(param.sched_priority,
+                                     sched_get_priority_min(SCHED_FIFO),
+                                     sched_get_priority_max(SCHED_FIFO));
+        if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+            g_print("ITrain: %s: cannot switch to SCHED_FIFO %d: %s\n",
+                    name, param.sched_priority, strerror(err));
+    }
+}
+
+/*
+ * Keep our pages resident so the fault path never waits for the text
+ * to be read back from flash.  With MCL_ONFAULT pages are locked as
+ * they are touched, the 8 MiB thread stacks are not faulted in whole.
+ */
+void ipcam_itrain_rt_lock_memory(void)
+{
+    int flags = MCL_CURRENT | MCL_FUTURE;
+
+#ifdef MCL_ONFAULT
+    if (mlockall(flags | MCL_ONFAULT) == 0)
+        return;
+#endif
+    if (mlockall(flags) != 0)
+        g_print("ITrain: mlockall: %s\n", strerror(errno));
+}
+
+void ipcam_itrain_rt_tune_socket(int sock, guint busy_poll_us, gboolean nodelay)
+{
+    int value;
+
+    if (nodelay) {
+        value = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+    }
+
+#ifdef SO_BUSY_POLL
+    if (busy_poll_us) {
+        value = busy_poll_us;
+        setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value));
+    }
+#endif
+}
+
+/* the kernel clears it again on its own, so it is set after every read */
+void ipcam_itrain_rt_quickack(int sock)
+{
+    int value = 1;
+
+    setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &value, sizeof(value));
+}
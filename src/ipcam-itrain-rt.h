@@ -0,0 +1,28 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-rt.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_RT_H_
+#define _IPCAM_ITRAIN_RT_H_
+
+#include <glib.h>
+
+/*
+ * The itrain:low_latency settings.  The server and OSD threads can be
+ * kept off the cores doing the encoding and the server thread can run
+ * SCHED_FIFO, which needs CAP_SYS_NICE.  Client sockets can busy poll
+ * and skip Nagle and delayed ACKs.  Nothing here is fatal: a setting
+ * the kernel or our privileges refuse is logged and the thread runs as
+ * it would have without it.
+ */
+
+gboolean ipcam_itrain_rt_check_cpus(const gchar *cpus);
+void     ipcam_itrain_rt_tune_thread(const gchar *name, const gchar *cpus, guint fifo_priority);
+void     ipcam_itrain_rt_lock_memory(void);
+void     ipcam_itrain_rt_tune_socket(int sock, guint busy_poll_us, gboolean nodelay);
+void     ipcam_itrain_rt_quickack(int sock);
+
+#endif /* _IPCAM_ITRAIN_RT_H_ */
@@ -5,9 +5,11 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <arpa/inet.h>
@@ -22,28 +24,186 @@
 #include "ipcam-itrain-server.h"
 #include "ipcam-dctx-proto-handler.h"
 #include "ipcam-dttx-proto-handler.h"
+#include "ipcam-itrain-handoff.h"
+#include "ipcam-itrain-occlusion.h"
+#include "ipcam-itrain-stats.h"
+#include "ipcam-itrain-reactor.h"
+#include "ipcam-itrain-osd.h"
+#include "ipcam-itrain-log.h"
+#include "ipcam-itrain-trace.h"
+#include "ipcam-itrain-mem.h"
+#include "ipcam-itrain-local.h"
+#include "ipcam-itrain-status.h"
+#include "ipcam-itrain-clock.h"
+#include "ipcam-itrain-rt.h"
+#include "ipcam-itrain-camera.h"
 
 
+typedef struct EpollEventHandler
+{
+    void (*event_handler)(struct epoll_event *event);
+    gpointer data;
+} EpollEventHandler;
+
+typedef struct IpcamITrainListener
+{
+    EpollEventHandler       epoll_handler;
+    IpcamITrainServer       *itrain_server;
+    IpcamTrainProtocolType  *protocol;      /* NULL to follow the server default */
+    gboolean                auto_detect;
+    int                     sock;
+} IpcamITrainListener;
+
+enum
+{
+    LISTENER_MAIN,
+    LISTENER_DCTX,
+    LISTENER_DTTX,
+    NR_LISTENERS
+};
+
+#define MULTICAST_GROUP             ("224.0.0.88")
+#define MULTICAST_PORT              (10100)
+#define MULTICAST_MAX_INTERFACES    4
+
+#define SERVER_TICK_INTERVAL        (100 * 1000)            /* usec */
+#define TIMER_WHEEL_SLOTS           64                      /* ticks, one turn is 6.4 s */
+#define BEACON_KEEPALIVE_INTERVAL   (5 * G_USEC_PER_SEC)
+#define BEACON_BURST_INTERVAL       (200 * 1000)
+#define BEACON_BURST_COUNT          3
+
+/* subscribers of the local unix socket */
+#define LOCAL_MAX_CLIENTS           16
+
+/* rate limited request types per connection */
+#define THROTTLE_MAX_TYPES          4
+
+/* unsent output a client may fall behind by before it is closed */
+#define CONN_MAX_OUTPUT             (64 * 1024)
+
+/* the first 7 bytes are the original beacon, seq was appended */
+typedef struct McastBeacon
+{
+    guint32 train_num;
+    guint8  position_num;
+    guint8  occlusion_stat;
+    guint8  loss_stat;
+    guint16 seq;
+} __attribute__((packed)) McastBeacon;
+
+/* fault state of one camera, the only one unless in gateway mode */
+typedef struct IpcamITrainContext
+{
+    IpcamITrainCamera   *camera;        /* NULL for our own identity */
+    IpcamOcclusionTable occlusion;
+    gboolean            occlusion_stat;
+    gboolean            loss_stat;
+    gint64              video_alive_at;
+    gint64              state_time;
+    McastBeacon         beacon;
+    gboolean            beacon_valid;
+    guint               beacon_burst;
+    gint64              beacon_next;
+} IpcamITrainContext;
+
+typedef struct IpcamLocalClient
+{
+    IpcamITrainServer       *itrain_server;
+    EpollEventHandler       handler;
+    int                     sock;
+    gboolean                trusted;
+    guint32                 events;     /* subscribed */
+} IpcamLocalClient;
+
+static IpcamTrainProtocolType *itrain_protocols[] = {
+    &ipcam_dctx_protocol_type,
+    &ipcam_dttx_protocol_type,
+};
+
 struct _IpcamITrainServerPrivate
 {
     IpcamITrain *itrain;
     gchar *address;
     guint port;
+    guint dctx_port;
+    guint dttx_port;
+    gboolean auto_detect;
     gchar *osd_address;
     guint osd_port;
     gboolean terminated;
-    gboolean occlusion_stat;
+    IpcamITrainCameras *cameras;    /* gateway mode */
+    IpcamITrainContext *contexts;
+    guint nr_contexts;
+    guint occlusion_on_delay;
+    guint occlusion_off_delay;
+    guint video_loss_timeout;
     GThread *server_thread;
-    GList *conn_list;
+    GQueue conn_list;       /* least recently active first */
+    GHashTable *peer_conns; /* peer address -> number of connections */
+    gpointer timeout_conn;
+    GQueue timer_wheel[TIMER_WHEEL_SLOTS];
+    gint64 timer_tick;      /* start of the next slot to handle */
     IpcamTrainProtocolType *protocol;
-    int server_sock;
+    IpcamITrainListener listeners[NR_LISTENERS];
     int osd_server_sock;
-    int mcast_sock;
-    int mcast_timer_count;
+    IpcamOsdIngest *osd;
+    GAsyncQueue *osd_queue;
+    guint osd_queue_depth;
+    gint64 osd_feed_interval;
+    gint64 osd_feed_next;
+    JsonNode *osd_feed_pending;
+    gchar *mcast_interfaces;
+    int mcast_socks[MULTICAST_MAX_INTERFACES];
+    guint nr_mcast_socks;
+    struct sockaddr_in mcast_addr;
+    gint64 next_tick;
     int pipe_fds[2];
 #define pipe_read_fd    pipe_fds[0]
 #define pipe_write_fd   pipe_fds[1]
-    int epoll_fd;
+    EpollEventHandler pipe_handler;
+    gchar pipe_buffer[256];
+    guint pipe_data_size;
+    gboolean accepting;
+    gchar *handoff_path;
+    int handoff_sock;
+    EpollEventHandler handoff_handler;
+    int handoff_peer;                   /* new instance waiting for an answer */
+    EpollEventHandler handoff_peer_handler;
+    time_t handoff_peer_deadline;
+    gchar *local_path;
+    gchar *local_uids;
+    int local_sock;
+    EpollEventHandler local_handler;
+    uid_t trusted_uids[ITRAIN_LOCAL_MAX_UIDS];
+    guint nr_trusted_uids;
+    GList *local_clients;
+    guint nr_local_clients;
+    IpcamHandoffSocket inherited[HANDOFF_MAX_SOCKETS];
+    gint nr_inherited;
+    guint drain_timeout;
+    gboolean draining;
+    time_t drain_deadline;
+    gboolean drained;
+    IpcamReactor *reactor;
+    gchar *io_backend;
+    guint backlog;
+    guint max_connections;
+    guint max_per_ip;
+    gboolean evict_idle;
+    guint nr_connections;
+    guint32 last_conn_id;
+    int reserve_fd;
+    gint64 throttle_interval;
+    gint64 throttle_burst;
+    gboolean throttle_defer;
+    gboolean simulated;
+    gchar *server_cpus;
+    gchar *osd_cpus;
+    guint fifo_priority;
+    guint busy_poll;
+    gboolean tcp_nodelay;
+    gboolean tcp_quickack;
+    gint64 notify_at;       /* first notify not yet read, for latency.wakeup */
 };
 
 
@@ -55,8 +215,36 @@ enum
     PROP_PROTOCOL,
     PROP_ADDRESS,
     PROP_PORT,
+    PROP_DCTX_PORT,
+    PROP_DTTX_PORT,
+    PROP_AUTO_DETECT,
     PROP_OSD_ADDRESS,
     PROP_OSD_PORT,
+    PROP_HANDOFF_PATH,
+    PROP_DRAIN_TIMEOUT,
+    PROP_MCAST_INTERFACES,
+    PROP_OCCLUSION_ON_DELAY,
+    PROP_OCCLUSION_OFF_DELAY,
+    PROP_VIDEO_LOSS_TIMEOUT,
+    PROP_IO_BACKEND,
+    PROP_BACKLOG,
+    PROP_MAX_CONNECTIONS,
+    PROP_MAX_PER_IP,
+    PROP_OVERLOAD_POLICY,
+    PROP_THROTTLE_INTERVAL,
+    PROP_THROTTLE_BURST,
+    PROP_THROTTLE_POLICY,
+    PROP_OSD_QUEUE_DEPTH,
+    PROP_OSD_FEED_INTERVAL,
+    PROP_LOCAL_SOCKET,
+    PROP_LOCAL_UIDS,
+    PROP_SIMULATED,
+    PROP_SERVER_CPUS,
+    PROP_OSD_CPUS,
+    PROP_FIFO_PRIORITY,
+    PROP_BUSY_POLL,
+    PROP_TCP_NODELAY,
+    PROP_TCP_QUICKACK,
 };
 
 
@@ -64,30 +252,96 @@ enum
 G_DEFINE_TYPE (IpcamITrainServer, ipcam_itrain_server, G_TYPE_OBJECT);
 
 static gpointer itrain_server_thread_proc(gpointer data);
+static void itrain_server_setup(IpcamITrainServer *itrain_server);
+static void itrain_server_cleanup(IpcamITrainServer *itrain_server);
+static void itrain_server_beacon_changed(IpcamITrainServer *itrain_server,
+                                         IpcamITrainContext *ctx);
+static void itrain_server_occlusion_changed(IpcamITrainServer *itrain_server,
+                                            IpcamITrainContext *ctx);
+static void itrain_server_video_timeout(IpcamITrainServer *itrain_server,
+                                        IpcamITrainContext *ctx, gint64 now);
+static int itrain_server_take_inherited(IpcamITrainServer *itrain_server, guint8 role);
+static void itrain_server_local_notify(IpcamITrainServer *itrain_server, guint32 events);
 
 static void
 ipcam_itrain_server_init (IpcamITrainServer *ipcam_itrain_server)
 {
     ipcam_itrain_server->priv = G_TYPE_INSTANCE_GET_PRIVATE (ipcam_itrain_server, IPCAM_TYPE_ITRAIN_SERVER, IpcamITrainServerPrivate);
     IpcamITrainServerPrivate *priv = ipcam_itrain_server->priv;
+    int i;
 
     priv->itrain = NULL;
     priv->address = NULL;
     priv->port = 0;
+    priv->dctx_port = 0;
+    priv->dttx_port = 0;
+    priv->auto_detect = FALSE;
     priv->osd_address = NULL;
     priv->osd_port = 0;
     priv->terminated = FALSE;
-    priv->occlusion_stat = FALSE;
+    priv->cameras = NULL;
+    priv->contexts = NULL;
+    priv->nr_contexts = 0;
     priv->server_thread = NULL;
-    priv->conn_list = NULL;
+    g_queue_init(&priv->conn_list);
+    priv->peer_conns = g_hash_table_new(g_direct_hash, g_direct_equal);
+    priv->timeout_conn = NULL;
+    for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+        g_queue_init(&priv->timer_wheel[i]);
+    priv->timer_tick = 0;
     priv->protocol = &ipcam_dctx_protocol_type;
-    priv->server_sock = -1;
+    for (i = 0; i < NR_LISTENERS; i++) {
+        priv->listeners[i].itrain_server = ipcam_itrain_server;
+        priv->listeners[i].protocol = NULL;
+        priv->listeners[i].auto_detect = FALSE;
+        priv->listeners[i].sock = -1;
+    }
     priv->osd_server_sock = -1;
-    priv->mcast_sock = -1;
-    priv->mcast_timer_count = 0;
+    priv->osd = NULL;
+    priv->osd_queue = NULL;
+    priv->osd_queue_depth = 0;
+    priv->osd_feed_interval = 0;
+    priv->osd_feed_next = 0;
+    priv->osd_feed_pending = NULL;
+    priv->mcast_interfaces = NULL;
+    priv->nr_mcast_socks = 0;
+    priv->next_tick = 0;
     priv->pipe_read_fd = -1;
     priv->pipe_write_fd = -1;
-    priv->epoll_fd = -1;
+    priv->pipe_data_size = 0;
+    priv->accepting = FALSE;
+    priv->handoff_path = NULL;
+    priv->handoff_sock = -1;
+    priv->handoff_peer = -1;
+    priv->local_path = NULL;
+    priv->local_uids = NULL;
+    priv->local_sock = -1;
+    priv->nr_trusted_uids = 0;
+    priv->local_clients = NULL;
+    priv->nr_local_clients = 0;
+    priv->nr_inherited = 0;
+    priv->drain_timeout = 0;
+    priv->draining = FALSE;
+    priv->drained = FALSE;
+    priv->reactor = NULL;
+    priv->io_backend = NULL;
+    priv->backlog = 0;
+    priv->max_connections = 0;
+    priv->max_per_ip = 0;
+    priv->evict_idle = FALSE;
+    priv->nr_connections = 0;
+    priv->reserve_fd = -1;
+    priv->throttle_interval = 0;
+    priv->throttle_burst = 0;
+    priv->throttle_defer = FALSE;
+    priv->simulated = FALSE;
+    priv->server_cpus = NULL;
+    priv->osd_cpus = NULL;
+    priv->fifo_priority = 0;
+    priv->busy_poll = 0;
+    priv->tcp_nodelay = FALSE;
+    priv->tcp_quickack = FALSE;
+    priv->notify_at = 0;
 }
 
 static GObject *
@@ -98,6 +352,7 @@ ipcam_itrain_server_constructor(GType gtype,
     GObject *obj;
     IpcamITrainServer *itrain_server;
     IpcamITrainServerPrivate *priv;
+    guint i;
 
     /* Always chain up to the parent constructor */
     obj = G_OBJECT_CLASS(ipcam_itrain_server_parent_class)->constructor(gtype, n_properties, properties);
@@ -107,8 +362,24 @@ ipcam_itrain_server_constructor(GType gtype,
 
     priv = itrain_server->priv;
 
+    /* one fault state per camera, fixed for the life of the server */
+    priv->cameras = ipcam_itrain_get_cameras(priv->itrain);
+    priv->nr_contexts = priv->cameras ? priv->cameras->nr_cameras : 1;
+    priv->contexts = g_new0(IpcamITrainContext, priv->nr_contexts);
+    for (i = 0; i < priv->nr_contexts; i++)
+        priv->contexts[i].camera = priv->cameras ? priv->cameras->cameras[i] : NULL;
+
+    /* the pipe must exist before anyone can send a notify */
+    g_assert(pipe(priv->pipe_fds) == 0);
+    priv->osd_queue = g_async_queue_new_full((GDestroyNotify)ipcam_osd_notice_free);
+
     /* thread must be create after construction has alread initialized the properties */
     priv->terminated = FALSE;
+    if (priv->simulated) {
+        /* driven by ipcam_itrain_server_sim_run() on the caller's thread */
+        itrain_server_setup(itrain_server);
+        return obj;
+    }
     priv->server_thread = g_thread_new("itrain-server",
                                        itrain_server_thread_proc,
                                        itrain_server);
@@ -125,9 +396,24 @@ ipcam_itrain_server_finalize (GObject *object)
 
     g_free(priv->address);
     g_free(priv->osd_address);
+    g_free(priv->handoff_path);
+    g_free(priv->local_path);
+    g_free(priv->local_uids);
+    g_free(priv->io_backend);
+    g_free(priv->mcast_interfaces);
+    g_free(priv->server_cpus);
+    g_free(priv->osd_cpus);
     priv->terminated = TRUE;
-    ipcam_itrain_server_send_notify(itrain_server, quit_cmd, strlen(quit_cmd));
-    g_thread_join(priv->server_thread);
+    if (priv->simulated) {
+        itrain_server_cleanup(itrain_server);
+    }
+    else {
+        ipcam_itrain_server_send_notify(itrain_server, quit_cmd, strlen(quit_cmd));
+        g_thread_join(priv->server_thread);
+    }
+    g_async_queue_unref(priv->osd_queue);
+    g_hash_table_destroy(priv->peer_conns);
+    g_free(priv->contexts);
 
     G_OBJECT_CLASS (ipcam_itrain_server_parent_class)->finalize (object);
 }
@@ -173,6 +459,15 @@ ipcam_itrain_server_set_property (GObject *object, guint prop_id, const GValue *
     case PROP_PORT:
         priv->port = g_value_get_uint(value);
         break;
+    case PROP_DCTX_PORT:
+        priv->dctx_port = g_value_get_uint(value);
+        break;
+    case PROP_DTTX_PORT:
+        priv->dttx_port = g_value_get_uint(value);
+        break;
+    case PROP_AUTO_DETECT:
+        priv->auto_detect = g_value_get_boolean(value);
+        break;
     case PROP_OSD_ADDRESS:
         g_free(priv->osd_address);
         priv->osd_address =  g_value_dup_string(value);
@@ -180,6 +475,88 @@ ipcam_itrain_server_set_property (GObject *object, guint prop_id, const GValue *
     case PROP_OSD_PORT:
         priv->osd_port = g_value_get_uint(value);
         break;
+    case PROP_HANDOFF_PATH:
+        g_free(priv->handoff_path);
+        priv->handoff_path = g_value_dup_string(value);
+        break;
+    case PROP_DRAIN_TIMEOUT:
+        priv->drain_timeout = g_value_get_uint(value);
+        break;
+    case PROP_MCAST_INTERFACES:
+        g_free(priv->mcast_interfaces);
+        priv->mcast_interfaces = g_value_dup_string(value);
+        break;
+    case PROP_OCCLUSION_ON_DELAY:
+        priv->occlusion_on_delay = g_value_get_uint(value);
+        break;
+    case PROP_OCCLUSION_OFF_DELAY:
+        priv->occlusion_off_delay = g_value_get_uint(value);
+        break;
+    case PROP_VIDEO_LOSS_TIMEOUT:
+        priv->video_loss_timeout = g_value_get_uint(value);
+        break;
+    case PROP_IO_BACKEND:
+        g_free(priv->io_backend);
+        priv->io_backend = g_value_dup_string(value);
+        break;
+    case PROP_BACKLOG:
+        priv->backlog = g_value_get_uint(value);
+        break;
+    case PROP_MAX_CONNECTIONS:
+        priv->max_connections = g_value_get_uint(value);
+        break;
+    case PROP_MAX_PER_IP:
+        priv->max_per_ip = g_value_get_uint(value);
+        break;
+    case PROP_OVERLOAD_POLICY:
+        priv->evict_idle = g_strcmp0(g_value_get_string(value), "evict-idle") == 0;
+        break;
+    case PROP_THROTTLE_INTERVAL:
+        priv->throttle_interval = (gint64)g_value_get_uint(value) * 1000;
+        break;
+    case PROP_THROTTLE_BURST:
+        priv->throttle_burst = g_value_get_uint(value);
+        break;
+    case PROP_THROTTLE_POLICY:
+        priv->throttle_defer = g_strcmp0(g_value_get_string(value), "defer") == 0;
+        break;
+    case PROP_OSD_QUEUE_DEPTH:
+        priv->osd_queue_depth = g_value_get_uint(value);
+        break;
+    case PROP_OSD_FEED_INTERVAL:
+        priv->osd_feed_interval = (gint64)g_value_get_uint(value) * 1000;
+        break;
+    case PROP_LOCAL_SOCKET:
+        g_free(priv->local_path);
+        priv->local_path = g_value_dup_string(value);
+        break;
+    case PROP_LOCAL_UIDS:
+        g_free(priv->local_uids);
+        priv->local_uids = g_value_dup_string(value);
+        break;
+    case PROP_SIMULATED:
+        priv->simulated = g_value_get_boolean(value);
+        break;
+    case PROP_SERVER_CPUS:
+        g_free(priv->server_cpus);
+        priv->server_cpus = g_value_dup_string(value);
+        break;
+    case PROP_OSD_CPUS:
+        g_free(priv->osd_cpus);
+        priv->osd_cpus = g_value_dup_string(value);
+        break;
+    case PROP_FIFO_PRIORITY:
+        priv->fifo_priority = g_value_get_uint(value);
+        break;
+    case PROP_BUSY_POLL:
+        priv->busy_poll = g_value_get_uint(value);
+        break;
+    case PROP_TCP_NODELAY:
+        priv->tcp_nodelay = g_value_get_boolean(value);
+        break;
+    case PROP_TCP_QUICKACK:
+        priv->tcp_quickack = g_value_get_boolean(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
@@ -208,12 +585,96 @@ ipcam_itrain_server_get_property (GObject *object, guint prop_id, GValue *value,
     case PROP_PORT:
         g_value_set_uint(value, priv->port);
         break;
+    case PROP_DCTX_PORT:
+        g_value_set_uint(value, priv->dctx_port);
+        break;
+    case PROP_DTTX_PORT:
+        g_value_set_uint(value, priv->dttx_port);
+        break;
+    case PROP_AUTO_DETECT:
+        g_value_set_boolean(value, priv->auto_detect);
+        break;
     case PROP_OSD_ADDRESS:
         g_value_set_string(value, priv->osd_address);
         break;
     case PROP_OSD_PORT:
         g_value_set_uint(value, priv->osd_port);
         break;
+    case PROP_HANDOFF_PATH:
+        g_value_set_string(value, priv->handoff_path);
+        break;
+    case PROP_DRAIN_TIMEOUT:
+        g_value_set_uint(value, priv->drain_timeout);
+        break;
+    case PROP_MCAST_INTERFACES:
+        g_value_set_string(value, priv->mcast_interfaces);
+        break;
+    case PROP_OCCLUSION_ON_DELAY:
+        g_value_set_uint(value, priv->occlusion_on_delay);
+        break;
+    case PROP_OCCLUSION_OFF_DELAY:
+        g_value_set_uint(value, priv->occlusion_off_delay);
+        break;
+    case PROP_VIDEO_LOSS_TIMEOUT:
+        g_value_set_uint(value, priv->video_loss_timeout);
+        break;
+    case PROP_IO_BACKEND:
+        g_value_set_string(value, priv->io_backend);
+        break;
+    case PROP_BACKLOG:
+        g_value_set_uint(value, priv->backlog);
+        break;
+    case PROP_MAX_CONNECTIONS:
+        g_value_set_uint(value, priv->max_connections);
+        break;
+    case PROP_MAX_PER_IP:
+        g_value_set_uint(value, priv->max_per_ip);
+        break;
+    case PROP_OVERLOAD_POLICY:
+        g_value_set_string(value, priv->evict_idle ? "evict-idle" : "refuse");
+        break;
+    case PROP_THROTTLE_INTERVAL:
+        g_value_set_uint(value, priv->throttle_interval / 1000);
+        break;
+    case PROP_THROTTLE_BURST:
+        g_value_set_uint(value, priv->throttle_burst);
+        break;
+    case PROP_THROTTLE_POLICY:
+        g_value_set_string(value, priv->throttle_defer ? "defer" : "drop");
+        break;
+    case PROP_OSD_QUEUE_DEPTH:
+        g_value_set_uint(value, priv->osd_queue_depth);
+        break;
+    case PROP_OSD_FEED_INTERVAL:
+        g_value_set_uint(value, priv->osd_feed_interval / 1000);
+        break;
+    case PROP_LOCAL_SOCKET:
+        g_value_set_string(value, priv->local_path);
+        break;
+    case PROP_LOCAL_UIDS:
+        g_value_set_string(value, priv->local_uids);
+        break;
+    case PROP_SIMULATED:
+        g_value_set_boolean(value, priv->simulated);
+        break;
+    case PROP_SERVER_CPUS:
+        g_value_set_string(value, priv->server_cpus);
+        break;
+    case PROP_OSD_CPUS:
+        g_value_set_string(value, priv->osd_cpus);
+        break;
+    case PROP_FIFO_PRIORITY:
+        g_value_set_uint(value, priv->fifo_priority);
+        break;
+    case PROP_BUSY_POLL:
+        g_value_set_uint(value, priv->busy_poll);
+        break;
+    case PROP_TCP_NODELAY:
+        g_value_set_boolean(value, priv->tcp_nodelay);
+        break;
+    case PROP_TCP_QUICKACK:
+        g_value_set_boolean(value, priv->tcp_quickack);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
@@ -267,7 +728,35 @@ ipcam_itrain_server_class_init (IpcamITrainServerClass *klass)
                                                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
 
     g_object_class_install_property (object_class,
-                                     PROP_ADDRESS,
+                                     PROP_DCTX_PORT,
+                                     g_param_spec_uint ("dctx-port",
+                                                        "DCTX Server Port",
+                                                        "DCTX Server Port, 0 to disable",
+                                                        0,
+                                                        G_MAXUINT,
+                                                        0,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_DTTX_PORT,
+                                     g_param_spec_uint ("dttx-port",
+                                                        "DTTX Server Port",
+                                                        "DTTX Server Port, 0 to disable",
+                                                        0,
+                                                        G_MAXUINT,
+                                                        0,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_AUTO_DETECT,
+                                     g_param_spec_boolean ("auto-detect",
+                                                           "Protocol Auto Detection",
+                                                           "Detect the protocol from the first PDU on the main port",
+                                                           FALSE,
+                                                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_OSD_ADDRESS,
                                      g_param_spec_string ("osd-address",
                                                           "OSD Server Address",
                                                           "OSD Server Address",
@@ -275,7 +764,7 @@ ipcam_itrain_server_class_init (IpcamITrainServerClass *klass)
                                                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
 
     g_object_class_install_property (object_class,
-                                     PROP_PORT,
+                                     PROP_OSD_PORT,
                                      g_param_spec_uint ("osd-port",
                                                         "OSD Server Port",
                                                         "OSD Server Port",
@@ -283,6 +772,232 @@ ipcam_itrain_server_class_init (IpcamITrainServerClass *klass)
                                                         G_MAXUINT,
                                                         10101,
                                                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_HANDOFF_PATH,
+                                     g_param_spec_string ("handoff-path",
+                                                          "Hot Restart Socket",
+                                                          "Unix socket path used to hand the sockets to a new instance",
+                                                          NULL,
+                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_DRAIN_TIMEOUT,
+                                     g_param_spec_uint ("drain-timeout",
+                                                        "Drain Timeout",
+                                                        "Seconds to keep serving old connections after a handoff",
+                                                        0,
+                                                        G_MAXUINT,
+                                                        10,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_MCAST_INTERFACES,
+                                     g_param_spec_string ("mcast-interfaces",
+                                                          "Multicast Interfaces",
+                                                          "Comma separated interfaces the fault beacon is sent on",
+                                                          "eth0",
+                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_OCCLUSION_ON_DELAY,
+                                     g_param_spec_uint ("occlusion-on-delay",
+                                                        "Occlusion On Delay",
+                                                        "Milliseconds a region must stay occluded before it is reported",
+                                                        0,
+                                                        G_MAXUINT,
+                                                        500,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_OCCLUSION_OFF_DELAY,
+                                     g_param_spec_uint ("occlusion-off-delay",
+                                                        "Occlusion Off Delay",
+                                                        "Milliseconds a region must stay clear before it is reported",
+                                                        0,
+                                                        G_MAXUINT,
+                                                        2000,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_VIDEO_LOSS_TIMEOUT,
+                                     g_param_spec_uint ("video-loss-timeout",
+                                                        "Video Loss Timeout",
+                                                        "Milliseconds without stream liveness before video loss is reported, 0 to disable",
+                                                        0,
+                                                        G_MAXUINT,
+                                                        0,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_IO_BACKEND,
+                                     g_param_spec_string ("io-backend",
+                                                          "I/O Backend",
+                                                          "epoll or io_uring",
+                                                          "epoll",
+                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_BACKLOG,
+                                     g_param_spec_uint ("backlog",
+                                                        "Backlog",
+                                                        "Listen backlog of the server sockets",
+                                                        1,
+                                                        G_MAXINT,
+                                                        64,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_MAX_CONNECTIONS,
+                                     g_param_spec_uint ("max-connections",
+                                                        "Max Connections",
+                                                        "Maximum number of client connections, 0 for no limit",
+                                                        0,
+                                                        G_MAXUINT,
+                                                        0,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_MAX_PER_IP,
+                                     g_param_spec_uint ("max-per-ip",
+                                                        "Max Connections Per IP",
+                                                        "Maximum number of connections from one address, 0 for no limit",
+                                                        0,
+                                                        G_MAXUINT,
+                                                        0,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_OVERLOAD_POLICY,
+                                     g_param_spec_string ("overload-policy",
+                                                          "Overload Policy",
+                                                          "refuse or evict-idle when max-connections is reached",
+                                                          "refuse",
+                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_THROTTLE_INTERVAL,
+                                     g_param_spec_uint ("throttle-interval",
+                                                        "Throttle Interval",
+                                                        "Milliseconds per configuration request of one type on a connection, 0 to disable",
+                                                        0,
+                                                        G_MAXUINT,
+                                                        0,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_THROTTLE_BURST,
+                                     g_param_spec_uint ("throttle-burst",
+                                                        "Throttle Burst",
+                                                        "Requests accepted back to back before throttling",
+                                                        1,
+                                                        G_MAXUINT,
+                                                        4,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_THROTTLE_POLICY,
+                                     g_param_spec_string ("throttle-policy",
+                                                          "Throttle Policy",
+                                                          "drop or defer excess requests, a deferred request is replaced by a newer one",
+                                                          "drop",
+                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_OSD_QUEUE_DEPTH,
+                                     g_param_spec_uint ("osd-queue-depth",
+                                                        "OSD Queue Depth",
+                                                        "OSD updates waiting to be published before the oldest is dropped",
+                                                        1,
+                                                        G_MAXUINT,
+                                                        8,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_OSD_FEED_INTERVAL,
+                                     g_param_spec_uint ("osd-feed-interval",
+                                                        "OSD Feed Interval",
+                                                        "minimal milliseconds between live speed/datetime overlay updates",
+                                                        0,
+                                                        G_MAXUINT,
+                                                        200,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_LOCAL_SOCKET,
+                                     g_param_spec_string ("local-socket",
+                                                          "Local Socket",
+                                                          "Unix seqpacket socket path serving state and identity events to local processes",
+                                                          NULL,
+                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_LOCAL_UIDS,
+                                     g_param_spec_string ("local-uids",
+                                                          "Local Trusted UIDs",
+                                                          "Comma separated uids besides root and our own allowed on the local socket",
+                                                          NULL,
+                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_SIMULATED,
+                                     g_param_spec_boolean ("simulated",
+                                                           "Simulated",
+                                                           "No server thread, in-memory clients and the caller drives the virtual clock",
+                                                           FALSE,
+                                                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_SERVER_CPUS,
+                                     g_param_spec_string ("server-cpus",
+                                                          "Server CPUs",
+                                                          "CPU list the server thread is bound to, like \"0\" or \"0,2-3\"",
+                                                          NULL,
+                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_OSD_CPUS,
+                                     g_param_spec_string ("osd-cpus",
+                                                          "OSD CPUs",
+                                                          "CPU list the OSD ingest thread is bound to",
+                                                          NULL,
+                                                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_FIFO_PRIORITY,
+                                     g_param_spec_uint ("fifo-priority",
+                                                        "FIFO Priority",
+                                                        "SCHED_FIFO priority of the server thread, 0 keeps the default policy",
+                                                        0,
+                                                        99,
+                                                        0,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_BUSY_POLL,
+                                     g_param_spec_uint ("busy-poll",
+                                                        "Busy Poll",
+                                                        "SO_BUSY_POLL of the client sockets in usec, 0 to disable",
+                                                        0,
+                                                        G_MAXINT,
+                                                        0,
+                                                        G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_TCP_NODELAY,
+                                     g_param_spec_boolean ("tcp-nodelay",
+                                                           "TCP No Delay",
+                                                           "Disable Nagle on the client sockets",
+                                                           FALSE,
+                                                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+    g_object_class_install_property (object_class,
+                                     PROP_TCP_QUICKACK,
+                                     g_param_spec_boolean ("tcp-quickack",
+                                                           "TCP Quick ACK",
+                                                           "Acknowledge client requests at once instead of delaying the ACK",
+                                                           FALSE,
+                                                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
 }
 
 IpcamITrain *ipcam_itrain_server_get_itrain(IpcamITrainServer *itrain_server)
@@ -297,541 +1012,2105 @@ int ipcam_itrain_server_send_notify(IpcamITrainServer *itrain_server,
                                     guint length)
 {
     IpcamITrainServerPrivate *priv = itrain_server->priv;
+    gint64 idle = 0;
 
     g_return_val_if_fail(notify != NULL, -1);
 
+    /* latency.wakeup is measured from the oldest notice still unread */
+    __atomic_compare_exchange_n(&priv->notify_at, &idle, ipcam_itrain_clock_now(),
+                                FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
     return write(priv->pipe_write_fd, notify, length);
 }
 
+void ipcam_itrain_server_set_accepting(IpcamITrainServer *itrain_server,
+                                       gboolean accepting)
+{
+    gchar *cmd = accepting ? "ACCEPT 1\n" : "ACCEPT 0\n";
+
+    ipcam_itrain_server_send_notify(itrain_server, cmd, strlen(cmd));
+}
+
+/*
+ * Called from the main loop for every stream liveness notice.  Only the
+ * timestamp is stored; the pipe is used to wake the server up when the
+ * video recovers or the media service reports the loss explicitly.
+ * camera is the index in the gateway camera table, 0 otherwise.
+ */
+void ipcam_itrain_server_video_alive(IpcamITrainServer *itrain_server,
+                                     guint camera,
+                                     gboolean alive)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    IpcamITrainContext *ctx;
+    gchar cmd[32];
+
+    g_return_if_fail(camera < priv->nr_contexts);
+
+    ctx = &priv->contexts[camera];
+    if (alive) {
+        __atomic_store_n(&ctx->video_alive_at, ipcam_itrain_clock_now(), __ATOMIC_RELAXED);
+        if (!g_atomic_int_get(&ctx->loss_stat))
+            return;
+    }
+    snprintf(cmd, sizeof(cmd), "VIDEO %d %u\n", !!alive, camera);
+    ipcam_itrain_server_send_notify(itrain_server, cmd, strlen(cmd));
+}
+
+void ipcam_itrain_server_update_identity(IpcamITrainServer *itrain_server)
+{
+    gchar *cmd = "IDENTITY\n";
+
+    ipcam_itrain_server_send_notify(itrain_server, cmd, strlen(cmd));
+}
+
 #define container_of(ptr, type, member) ({                      \
         const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
         (type *)( (char *)__mptr - offsetof(type,member) );})
 
-typedef struct EpollEventHandler
+/*
+ * Token bucket kept as the time the next request would conform (GCRA),
+ * a request conforms while that is at most burst - 1 intervals ahead.
+ */
+typedef struct IpcamThrottle
 {
-    void (*event_handler)(struct epoll_event *event);
-    gpointer data;
-} EpollEventHandler;
+    guint8          type;
+    gint64          next_at;
+    IpcamTrainPDU   *deferred;  /* latest excess request, replayed later */
+} IpcamThrottle;
 
 typedef struct IpcamEpollConnection
 {
-    IpcamConnection     connection;
-    EpollEventHandler   epoll_handler;
-    IpcamITrainServer   *itrain_server;
-    char                data[0];
+    IpcamConnection         connection;
+    EpollEventHandler       epoll_handler;
+    IpcamITrainServer       *itrain_server;
+    IpcamTrainProtocolType  *protocol;
+    IpcamITrainContext      *context;   /* the camera the client talks to */
+    gboolean                probing;    /* protocol not confirmed by a request yet */
+    struct in_addr          peer;
+    IpcamITrainTraceFlow    flow;
+    GList                   conn_link;  /* in conn_list */
+    IpcamThrottle           throttle[THROTTLE_MAX_TYPES];
+    guint                   nr_throttle;
+    gboolean                replaying;
+    GList                   timer_link;
+    GQueue                  *timer_slot;    /* NULL while nothing is due */
+    gint64                  timer_due;
+    GByteArray              *output;    /* unsent tail, EPOLLOUT is watched while set */
+    gboolean                output_failed;
+    char                    data[0];
 } IpcamEpollConnection;
 
+static guint32 itrain_protocol_max_data_size(void)
+{
+    guint32 size = 0;
+    int i;
 
-static void itrain_connection_epoll_handler(struct epoll_event *event);
+    for (i = 0; i < G_N_ELEMENTS(itrain_protocols); i++)
+        size = MAX(size, itrain_protocols[i]->user_data_size);
 
-/* IpcamConnection member functions */
+    return size;
+}
 
-static IpcamConnection *ipcam_connection_new(IpcamITrainServer *itrain_server,
-                                             int sock)
+static gsize itrain_connection_size(void)
 {
-    IpcamEpollConnection *epconn;
-    IpcamITrainServerPrivate *priv = itrain_server->priv;
-    IpcamTrainProtocolType *protocol = priv->protocol;
+    return sizeof(IpcamEpollConnection) + itrain_protocol_max_data_size();
+}
 
-    epconn = g_malloc0(sizeof(IpcamEpollConnection) + protocol->user_data_size);
+static void itrain_connection_epoll_handler(struct epoll_event *event);
 
-    if (!epconn) {
-        g_print("No memory for new connection\n");
-        return NULL;
+/*
+ * Connection timers live on a wheel of TIMER_WHEEL_SLOTS ticks, filed
+ * under the slot of their earliest timeout or deferred replay, so a tick
+ * only looks at the connections due in it.  Resetting a timeout moves it
+ * later and is left alone; the connection is refiled when its old slot
+ * comes up.
+ */
+static gint64
+itrain_connection_next_due(IpcamEpollConnection *epconn)
+{
+    IpcamITrainServerPrivate *priv = epconn->itrain_server->priv;
+    IpcamConnection *conn = &epconn->connection;
+    gint64 due = G_MAXINT64;
+    guint i;
+
+    for (i = 0; i < NR_TIMEOUTS; i++) {
+        if (conn->timeouts[i].enabled)
+            due = MIN(due, conn->timeouts[i].expire);
+    }
+    for (i = 0; i < epconn->nr_throttle; i++) {
+        if (epconn->throttle[i].deferred)
+            due = MIN(due, epconn->throttle[i].next_at -
+                           (priv->throttle_burst - 1) * priv->throttle_interval);
     }
 
-    epconn->connection.sock = sock;
-    epconn->connection.itrain = priv->itrain;
-    epconn->connection.priv = epconn->data;
+    return due;
+}
 
-    if (!protocol->init_connection(&epconn->connection)) {
-        g_free(epconn);
-        close(sock);
-        return NULL;
+static void
+itrain_connection_unschedule(IpcamEpollConnection *epconn)
+{
+    if (epconn->timer_slot) {
+        g_queue_unlink(epconn->timer_slot, &epconn->timer_link);
+        epconn->timer_slot = NULL;
     }
+}
 
-    epconn->epoll_handler.event_handler = itrain_connection_epoll_handler;
-    epconn->epoll_handler.data = epconn;
-    epconn->itrain_server = itrain_server;
+static void
+itrain_connection_schedule(IpcamEpollConnection *epconn)
+{
+    IpcamITrainServerPrivate *priv = epconn->itrain_server->priv;
+    gint64 due = itrain_connection_next_due(epconn);
+    gint64 tick;
+
+    itrain_connection_unschedule(epconn);
+    epconn->timer_due = due;
+    if (due == G_MAXINT64)
+        return;
+
+    /* round up to the tick handling it, overdue ones go to the next one */
+    tick = MAX((due + SERVER_TICK_INTERVAL - 1) / SERVER_TICK_INTERVAL,
+               priv->timer_tick / SERVER_TICK_INTERVAL);
+    epconn->timer_link.data = epconn;
+    epconn->timer_slot = &priv->timer_wheel[tick % TIMER_WHEEL_SLOTS];
+    g_queue_push_tail_link(epconn->timer_slot, &epconn->timer_link);
+}
+
+/*
+ * Client sockets are non-blocking.  What a slow client does not take
+ * right away is kept in order and sent once the socket is writable; a
+ * client more than CONN_MAX_OUTPUT behind is hung up on, the reactor
+ * reports that as EPOLLRDHUP so the connection is freed from its own
+ * handler and never in the middle of a fan-out.
+ */
+static void
+itrain_connection_drop_output(IpcamEpollConnection *epconn)
+{
+    if (!epconn->output)
+        return;
+
+    ipcam_itrain_mem_uncharge(ITRAIN_MEM_BUFFER, epconn->output->len);
+    g_byte_array_unref(epconn->output);
+    epconn->output = NULL;
+}
+
+static void
+itrain_connection_watch_output(IpcamEpollConnection *epconn, gboolean enabled)
+{
+    IpcamITrainServerPrivate *priv = epconn->itrain_server->priv;
+
+    ipcam_reactor_modify(priv->reactor, epconn->connection.sock,
+                         EPOLLIN | EPOLLRDHUP | (enabled ? EPOLLOUT : 0),
+                         &epconn->epoll_handler);
+}
+
+static void
+itrain_connection_fail_output(IpcamEpollConnection *epconn)
+{
+    IpcamITrainServerPrivate *priv = epconn->itrain_server->priv;
+
+    itrain_connection_drop_output(epconn);
+    epconn->output_failed = TRUE;
+    ipcam_reactor_shutdown(priv->reactor, epconn->connection.sock);
+}
+
+static gboolean
+itrain_connection_queue_output(IpcamEpollConnection *epconn, const guint8 *data, gsize size)
+{
+    gsize queued = epconn->output ? epconn->output->len : 0;
+
+    if (queued + size > CONN_MAX_OUTPUT) {
+        ipcam_itrain_stats_inc(ITRAIN_STAT_CONN_OUTPUT_OVERFLOW);
+        itrain_connection_fail_output(epconn);
+        return FALSE;
+    }
+
+    if (!epconn->output) {
+        epconn->output = g_byte_array_sized_new(size);
+        ipcam_itrain_stats_inc(ITRAIN_STAT_CONN_OUTPUT_QUEUED);
+        itrain_connection_watch_output(epconn, TRUE);
+    }
+    g_byte_array_append(epconn->output, data, size);
+    ipcam_itrain_mem_charge(ITRAIN_MEM_BUFFER, size);
+
+    return TRUE;
+}
+
+/* the socket is writable again */
+static void
+itrain_connection_flush_output(IpcamEpollConnection *epconn)
+{
+    IpcamITrainServerPrivate *priv = epconn->itrain_server->priv;
+    gssize ret;
+
+    if (!epconn->output)
+        return;
+
+    ret = ipcam_reactor_send(priv->reactor, epconn->connection.sock,
+                             epconn->output->data, epconn->output->len);
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            itrain_connection_fail_output(epconn);
+        return;
+    }
+
+    g_byte_array_remove_range(epconn->output, 0, ret);
+    ipcam_itrain_mem_uncharge(ITRAIN_MEM_BUFFER, ret);
+    if (epconn->output->len == 0) {
+        itrain_connection_drop_output(epconn);
+        itrain_connection_watch_output(epconn, FALSE);
+    }
+}
+
+/* IpcamConnection member functions */
+
+static void ipcam_connection_clear_throttle(IpcamEpollConnection *epconn)
+{
+    guint i;
+
+    for (i = 0; i < epconn->nr_throttle; i++) {
+        if (epconn->throttle[i].deferred)
+            ipcam_train_pdu_free(epconn->throttle[i].deferred);
+    }
+    epconn->nr_throttle = 0;
+}
+
+/* (re)bind the connection to a protocol, the private data is reinitialized */
+static gboolean ipcam_connection_bind_protocol(IpcamEpollConnection *epconn,
+                                               IpcamTrainProtocolType *protocol)
+{
+    IpcamConnection *conn = &epconn->connection;
+
+    itrain_connection_unschedule(epconn);
+    if (epconn->protocol)
+        epconn->protocol->deinit_connection(conn);
+    ipcam_connection_clear_throttle(epconn);
+
+    memset(epconn->data, 0, itrain_protocol_max_data_size());
+    memset(conn->timeouts, 0, sizeof(conn->timeouts));
+    epconn->protocol = protocol;
+
+    if (!protocol->init_connection(conn))
+        return FALSE;
+    itrain_connection_schedule(epconn);
+
+    return TRUE;
+}
+
+/* connections per peer address, for max-per-ip */
+static void
+itrain_server_count_peer(IpcamITrainServer *itrain_server, struct in_addr peer, gint delta)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    gpointer key = GUINT_TO_POINTER(peer.s_addr);
+    guint count = GPOINTER_TO_UINT(g_hash_table_lookup(priv->peer_conns, key)) + delta;
+
+    if (count)
+        g_hash_table_insert(priv->peer_conns, key, GUINT_TO_POINTER(count));
+    else
+        g_hash_table_remove(priv->peer_conns, key);
+}
+
+/* the client sent something, it is the last one evict-idle picks */
+static void
+itrain_connection_touch(IpcamEpollConnection *epconn)
+{
+    IpcamITrainServerPrivate *priv = epconn->itrain_server->priv;
+
+    g_queue_unlink(&priv->conn_list, &epconn->conn_link);
+    g_queue_push_tail_link(&priv->conn_list, &epconn->conn_link);
+}
+
+static IpcamConnection *ipcam_connection_new(IpcamITrainServer *itrain_server,
+                                             int sock,
+                                             const struct sockaddr_in *peer_addr,
+                                             IpcamITrainContext *context,
+                                             IpcamTrainProtocolType *protocol,
+                                             gboolean auto_detect)
+{
+    IpcamEpollConnection *epconn;
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+
+    epconn = ipcam_itrain_mem_alloc0(ITRAIN_MEM_CONN, itrain_connection_size());
+
+    if (!epconn) {
+        g_print("No memory for new connection\n");
+        return NULL;
+    }
+
+    epconn->connection.sock = sock;
+    epconn->connection.itrain = priv->itrain;
+    epconn->connection.camera = context->camera;
+    epconn->connection.priv = epconn->data;
+    epconn->itrain_server = itrain_server;
+    epconn->context = context;
+    epconn->probing = auto_detect;
+    epconn->peer = peer_addr->sin_addr;
+    epconn->flow.conn_id = ++priv->last_conn_id;
+    epconn->flow.peer_addr = peer_addr->sin_addr.s_addr;
+    epconn->flow.peer_port = peer_addr->sin_port;
+    if (!priv->simulated)
+        ipcam_itrain_rt_tune_socket(sock, priv->busy_poll, priv->tcp_nodelay);
+    if (ipcam_itrain_trace_enabled()) {
+        struct sockaddr_in local_addr;
+        socklen_t local_len = sizeof(local_addr);
+
+        if (getsockname(sock, (struct sockaddr *)&local_addr, &local_len) == 0) {
+            epconn->flow.local_addr = local_addr.sin_addr.s_addr;
+            epconn->flow.local_port = local_addr.sin_port;
+        }
+    }
+
+    if (!ipcam_connection_bind_protocol(epconn, protocol)) {
+        ipcam_itrain_mem_free(ITRAIN_MEM_CONN, epconn, itrain_connection_size());
+        ipcam_reactor_close(priv->reactor, sock);
+        return NULL;
+    }
+
+    epconn->epoll_handler.event_handler = itrain_connection_epoll_handler;
+    epconn->epoll_handler.data = epconn;
+
+    /* add new connection fd to epoll */
+    ipcam_reactor_add(priv->reactor, sock, EPOLLIN | EPOLLRDHUP, &epconn->epoll_handler);
+
+    /* add to the list */
+    epconn->conn_link.data = epconn;
+    g_queue_push_tail_link(&priv->conn_list, &epconn->conn_link);
+    itrain_server_count_peer(itrain_server, epconn->peer, 1);
+    priv->nr_connections++;
+    ipcam_itrain_stats_set(ITRAIN_STAT_CONN_ACTIVE, priv->nr_connections);
+    ipcam_itrain_status_set_connections(priv->nr_connections);
+
+    return &epconn->connection;
+}
+
+void ipcam_connection_free(IpcamConnection *conn)
+{
+    IpcamEpollConnection *epconn = container_of(conn, IpcamEpollConnection, connection);
+    IpcamITrainServer *itrain_server = epconn->itrain_server;
+    IpcamITrainServerPrivate *priv = itrain_server->priv; 
+    IpcamTrainProtocolType *protocol = epconn->protocol;
+
+    if (priv->timeout_conn == epconn)
+        priv->timeout_conn = NULL;
+    itrain_connection_unschedule(epconn);
+    g_queue_unlink(&priv->conn_list, &epconn->conn_link);
+    itrain_server_count_peer(itrain_server, epconn->peer, -1);
+    priv->nr_connections--;
+    ipcam_itrain_stats_set(ITRAIN_STAT_CONN_ACTIVE, priv->nr_connections);
+    ipcam_itrain_status_set_connections(priv->nr_connections);
+    ipcam_reactor_close(priv->reactor, conn->sock);
+    protocol->deinit_connection(conn);
+    ipcam_connection_clear_throttle(epconn);
+    itrain_connection_drop_output(epconn);
+    ipcam_itrain_mem_free(ITRAIN_MEM_CONN, epconn, itrain_connection_size());
+}
+
+/* timeouts set up by init_connection are filed once it returns */
+static void ipcam_connection_timeouts_changed(IpcamConnection *conn)
+{
+    IpcamEpollConnection *epconn = container_of(conn, IpcamEpollConnection, connection);
+
+    if (epconn->timer_slot)
+        itrain_connection_schedule(epconn);
+}
+
+void ipcam_connection_enable_timeout(IpcamConnection *conn, guint32 id, gboolean enabled)
+{
+    g_return_if_fail(id < NR_TIMEOUTS);
+    conn->timeouts[id].enabled = enabled;
+    ipcam_connection_timeouts_changed(conn);
+}
+
+void ipcam_connection_set_timeout(IpcamConnection *conn, guint32 id, gint32 timeout_sec)
+{
+    IpcamTimeout *timeout;
+
+    g_return_if_fail(id < NR_TIMEOUTS);
+
+    timeout = &conn->timeouts[id];
+    timeout->timeout_sec = timeout_sec;
+    timeout->expire = ipcam_itrain_clock_now() + (gint64)timeout->timeout_sec * G_USEC_PER_SEC;
+    ipcam_connection_timeouts_changed(conn);
+}
+
+void ipcam_connection_reset_timeout(IpcamConnection *conn, guint32 id)
+{
+    IpcamTimeout *timeout;
+
+    g_return_if_fail(id < NR_TIMEOUTS);
+
+    timeout = &conn->timeouts[id];
+    timeout->expire = ipcam_itrain_clock_now() + (gint64)timeout->timeout_sec * G_USEC_PER_SEC;
+}
+
+/*
+ * Move the first expiry to a point within the period picked from the
+ * connection id, so connections accepted on the same tick do not expire
+ * on the same tick forever after.  Consecutive ids step by the golden
+ * ratio of the period.
+ */
+void ipcam_connection_spread_timeout(IpcamConnection *conn, guint32 id)
+{
+    IpcamEpollConnection *epconn = container_of(conn, IpcamEpollConnection, connection);
+    IpcamTimeout *timeout;
+    gint64 period;
+    guint32 hash;
+
+    g_return_if_fail(id < NR_TIMEOUTS);
+
+    timeout = &conn->timeouts[id];
+    period = (gint64)timeout->timeout_sec * G_USEC_PER_SEC;
+    hash = epconn->flow.conn_id * 2654435761u;
+    timeout->expire = ipcam_itrain_clock_now() + 1 + (gint64)(((guint64)hash * period) >> 32);
+    ipcam_connection_timeouts_changed(conn);
+}
+
+/* heartbeats go out this way, they do not count as traffic */
+gssize ipcam_connection_send_packet(IpcamConnection *conn, gconstpointer packet, gsize size)
+{
+    IpcamEpollConnection *epconn = container_of(conn, IpcamEpollConnection, connection);
+    gssize ret = 0;
+
+    if (epconn->output_failed) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (ipcam_itrain_trace_enabled())
+        ipcam_itrain_trace_pdu(&epconn->flow, ITRAIN_TRACE_OUT, packet, size);
+
+    /* behind queued output the packet has to wait its turn */
+    if (!epconn->output) {
+        ret = ipcam_reactor_send(epconn->itrain_server->priv->reactor,
+                                 conn->sock, packet, size);
+        if (ret == size)
+            return ret;
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return -1;
+            ret = 0;
+        }
+    }
+
+    if (!itrain_connection_queue_output(epconn, (const guint8 *)packet + ret, size - ret)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    return size;
+}
+
+gssize ipcam_connection_send_pdu(IpcamConnection *conn, IpcamTrainPDU *pdu)
+{
+    gssize ret;
+
+    ret = ipcam_connection_send_packet(conn,
+                                       ipcam_train_pdu_get_packet_buffer(pdu),
+                                       ipcam_train_pdu_get_packet_size(pdu));
+    if (ret > 0)
+        conn->last_sent = ipcam_itrain_clock_now();
+
+    return ret;
+}
+
+gssize ipcam_connection_recv(IpcamConnection *conn, gpointer buf, gsize len)
+{
+    IpcamEpollConnection *epconn = container_of(conn, IpcamEpollConnection, connection);
+    IpcamITrainServerPrivate *priv = epconn->itrain_server->priv;
+    gssize ret;
+
+    ret = ipcam_reactor_recv(priv->reactor, conn->sock, buf, len, 0);
+    if (ret > 0 && priv->tcp_quickack && !priv->simulated)
+        ipcam_itrain_rt_quickack(conn->sock);
+
+    return ret;
+}
+
+/* called by the protocols for every PDU received, valid or not */
+void ipcam_connection_trace_pdu(IpcamConnection *conn, IpcamTrainPDU *pdu)
+{
+    IpcamEpollConnection *epconn = container_of(conn, IpcamEpollConnection, connection);
+
+    if (ipcam_itrain_trace_enabled())
+        ipcam_itrain_trace_pdu(&epconn->flow, ITRAIN_TRACE_IN,
+                               ipcam_train_pdu_get_packet_buffer(pdu),
+                               ipcam_train_pdu_get_packet_size(pdu));
+}
+
+/* find or claim the bucket of a type, NULL when all slots are taken */
+static IpcamThrottle *
+itrain_connection_get_throttle(IpcamEpollConnection *epconn, guint8 type)
+{
+    IpcamThrottle *throttle;
+    guint i;
+
+    for (i = 0; i < epconn->nr_throttle; i++) {
+        if (epconn->throttle[i].type == type)
+            return &epconn->throttle[i];
+    }
+    if (epconn->nr_throttle == THROTTLE_MAX_TYPES)
+        return NULL;
+    throttle = &epconn->throttle[epconn->nr_throttle++];
+    throttle->type = type;
+    throttle->next_at = 0;
+    throttle->deferred = NULL;
+
+    return throttle;
+}
+
+/* take a token from the bucket, FALSE when it is empty */
+static gboolean
+itrain_throttle_take(IpcamITrainServerPrivate *priv, IpcamThrottle *throttle)
+{
+    gint64 now = ipcam_itrain_clock_now();
+
+    throttle->next_at = MAX(throttle->next_at, now);
+    if (throttle->next_at - now > (priv->throttle_burst - 1) * priv->throttle_interval)
+        return FALSE;
+    throttle->next_at += priv->throttle_interval;
+
+    return TRUE;
+}
+
+/*
+ * Rate limit configuration requests per connection and type, each one
+ * costs a synchronous round trip to iconfig.  Returns TRUE when the
+ * request must not be handled now; it was dropped or kept for replay.
+ */
+gboolean ipcam_connection_throttle_pdu(IpcamConnection *conn, IpcamTrainPDU *pdu)
+{
+    IpcamEpollConnection *epconn = container_of(conn, IpcamEpollConnection, connection);
+    IpcamITrainServerPrivate *priv = epconn->itrain_server->priv;
+    IpcamTrainProtocolType *protocol = epconn->protocol;
+    guint8 type = ipcam_train_pdu_get_type(pdu);
+    IpcamThrottle *throttle;
+
+    /* replayed requests already paid */
+    if (!priv->throttle_interval || epconn->replaying)
+        return FALSE;
+    if (!protocol->throttle_pdu_type || !protocol->throttle_pdu_type(type))
+        return FALSE;
+
+    throttle = itrain_connection_get_throttle(epconn, type);
+    if (!throttle || itrain_throttle_take(priv, throttle))
+        return FALSE;
+
+    if (!priv->throttle_defer) {
+        ipcam_itrain_stats_inc(ITRAIN_STAT_THROTTLE_DROPPED);
+        return TRUE;
+    }
+
+    /* latest wins, an older setting is of no use any more */
+    if (throttle->deferred) {
+        ipcam_train_pdu_free(throttle->deferred);
+        ipcam_itrain_stats_inc(ITRAIN_STAT_THROTTLE_REPLACED);
+    }
+    throttle->deferred = ipcam_train_pdu_new_from_buffer(ipcam_train_pdu_get_packet_buffer(pdu),
+                                                         ipcam_train_pdu_get_packet_size(pdu));
+    ipcam_itrain_stats_inc(ITRAIN_STAT_THROTTLE_DEFERRED);
+    itrain_connection_schedule(epconn);
+
+    return TRUE;
+}
+
+/*
+ * For requests that only sometimes reach iconfig: charge the bucket of
+ * the type when a write is about to be issued.  Nothing is deferred, a
+ * dropped write is retried by the next request that still differs.
+ */
+gboolean ipcam_connection_throttle_write(IpcamConnection *conn, guint8 type)
+{
+    IpcamEpollConnection *epconn = container_of(conn, IpcamEpollConnection, connection);
+    IpcamITrainServerPrivate *priv = epconn->itrain_server->priv;
+    IpcamThrottle *throttle;
+
+    if (!priv->throttle_interval)
+        return FALSE;
+
+    throttle = itrain_connection_get_throttle(epconn, type);
+    if (!throttle || itrain_throttle_take(priv, throttle))
+        return FALSE;
+
+    ipcam_itrain_stats_inc(ITRAIN_STAT_THROTTLE_DROPPED);
+    return TRUE;
+}
+
+/* handle deferred requests whose turn has come */
+static void
+itrain_connection_replay_deferred(IpcamEpollConnection *epconn, gint64 now)
+{
+    IpcamITrainServerPrivate *priv = epconn->itrain_server->priv;
+    guint i;
+
+    for (i = 0; i < epconn->nr_throttle; i++) {
+        IpcamThrottle *throttle = &epconn->throttle[i];
+        IpcamTrainPDU *pdu = throttle->deferred;
+
+        if (!pdu || throttle->next_at - now > (priv->throttle_burst - 1) * priv->throttle_interval)
+            continue;
+
+        throttle->deferred = NULL;
+        throttle->next_at = MAX(throttle->next_at, now) + priv->throttle_interval;
+        ipcam_itrain_stats_inc(ITRAIN_STAT_THROTTLE_REPLAYED);
+
+        epconn->replaying = TRUE;
+        epconn->protocol->dispatch_pdu(&epconn->connection, pdu);
+        epconn->replaying = FALSE;
+        ipcam_train_pdu_free(pdu);
+    }
+}
+
+/*
+ * Peek at the type of the first pending PDU and switch the connection to
+ * the protocol owning that request type.  Types shared by all protocols
+ * (e.g. heartbeat responses) leave the connection in probing state.
+ */
+static gboolean
+itrain_connection_probe_protocol(IpcamEpollConnection *epconn)
+{
+    IpcamConnection *conn = &epconn->connection;
+    IpcamTrainProtocolType *protocol = NULL;
+    guint8 header[2];
+    int i;
+
+    if (ipcam_reactor_recv(epconn->itrain_server->priv->reactor, conn->sock,
+                           header, sizeof(header), MSG_PEEK) != sizeof(header) ||
+        header[0] != PACKET_START)
+        return TRUE;
+
+    for (i = 0; i < G_N_ELEMENTS(itrain_protocols); i++) {
+        if (itrain_protocols[i]->match_pdu_type &&
+            itrain_protocols[i]->match_pdu_type(header[1])) {
+            protocol = itrain_protocols[i];
+            break;
+        }
+    }
+    if (!protocol)
+        return TRUE;
+
+    epconn->probing = FALSE;
+    if (protocol == epconn->protocol)
+        return TRUE;
+
+    ITRAIN_LOG(CONN_DETECTED, conn->sock, header[1]);
+
+    return ipcam_connection_bind_protocol(epconn, protocol);
+}
+
+static void
+itrain_connection_epoll_handler(struct epoll_event *event)
+{
+    EpollEventHandler *handler = event->data.ptr;
+    IpcamEpollConnection *epconn = handler->data;
+    IpcamConnection *conn = &epconn->connection;
+    IpcamTrainProtocolType *protocol;
+
+    if (event->events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        /* release connection */
+        ipcam_connection_free(conn);
+        return;
+    }
+
+    if (event->events & EPOLLOUT)
+        itrain_connection_flush_output(epconn);
+
+    if (event->events & EPOLLIN) {
+        itrain_connection_touch(epconn);
+        if (epconn->probing && !itrain_connection_probe_protocol(epconn)) {
+            ipcam_connection_free(conn);
+            return;
+        }
+
+        protocol = epconn->protocol;
+        if (protocol->on_data_arrive) {
+            protocol->on_data_arrive(conn);
+        }
+    }
+}
+
+/*
+ * Decide whether a new client from peer may stay, evicting the idlest
+ * connection when the policy allows it.
+ */
+static gboolean
+itrain_server_admit(IpcamITrainServer *itrain_server, struct in_addr peer)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    IpcamEpollConnection *idlest = NULL;
+    guint from_peer;
+
+    from_peer = GPOINTER_TO_UINT(g_hash_table_lookup(priv->peer_conns,
+                                                     GUINT_TO_POINTER(peer.s_addr)));
+    if (priv->conn_list.head)
+        idlest = priv->conn_list.head->data;
+
+    if (priv->max_per_ip && from_peer >= priv->max_per_ip) {
+        ITRAIN_LOG(CONN_REFUSED, ITRAIN_LOG_INADDR(peer));
+        ipcam_itrain_stats_inc(ITRAIN_STAT_CONN_REFUSED_PER_IP);
+        return FALSE;
+    }
+
+    if (priv->max_connections && priv->nr_connections >= priv->max_connections) {
+        if (!priv->evict_idle || !idlest) {
+            ITRAIN_LOG(CONN_REFUSED, ITRAIN_LOG_INADDR(peer));
+            ipcam_itrain_stats_inc(ITRAIN_STAT_CONN_REFUSED);
+            return FALSE;
+        }
+        ITRAIN_LOG(CONN_EVICTED, ITRAIN_LOG_INADDR(idlest->peer));
+        ipcam_itrain_stats_inc(ITRAIN_STAT_CONN_EVICTED);
+        ipcam_connection_free(&idlest->connection);
+    }
+
+    return TRUE;
+}
+
+/*
+ * Out of file descriptors: the pending connection would keep the listener
+ * readable forever, so accept it on the reserved fd and drop it.
+ */
+static void
+itrain_server_shed_connection(IpcamITrainServer *itrain_server, int sock)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    int cli_sock;
+
+    if (priv->reserve_fd < 0)
+        return;
+
+    close(priv->reserve_fd);
+    cli_sock = accept(sock, NULL, NULL);
+    if (cli_sock >= 0)
+        close(cli_sock);
+    priv->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+static IpcamTrainProtocolType *
+itrain_server_find_protocol(const gchar *name)
+{
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(itrain_protocols); i++) {
+        if (strcasecmp(itrain_protocols[i]->name, name) == 0)
+            return itrain_protocols[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Gateway mode: the client talks to the camera whose address it connected
+ * to, NULL if that is none of them.  On a listener without a protocol of
+ * its own the camera's protocol replaces the default.
+ */
+static IpcamITrainContext *
+itrain_server_route(IpcamITrainServer *itrain_server, int sock,
+                    IpcamITrainListener *listener,
+                    IpcamTrainProtocolType **protocol)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    struct sockaddr_in local_addr;
+    socklen_t local_len = sizeof(local_addr);
+    IpcamITrainCamera *camera;
+
+    if (!priv->cameras)
+        return &priv->contexts[0];
+
+    if (getsockname(sock, (struct sockaddr *)&local_addr, &local_len) < 0)
+        return NULL;
+    camera = ipcam_itrain_cameras_route(priv->cameras, local_addr.sin_addr);
+    if (!camera)
+        return NULL;
+
+    if (!listener->protocol && camera->protocol) {
+        IpcamTrainProtocolType *camera_protocol = itrain_server_find_protocol(camera->protocol);
+
+        if (camera_protocol)
+            *protocol = camera_protocol;
+    }
+
+    return &priv->contexts[camera->index];
+}
+
+/* drain the accept queue, it may hold a whole train reconnecting at once */
+static void
+itrain_server_epoll_handler(struct epoll_event *event)
+{
+    EpollEventHandler *handler = event->data.ptr;
+    IpcamITrainListener *listener = (IpcamITrainListener *)handler->data;
+    IpcamITrainServer *itrain_server = listener->itrain_server;
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    IpcamTrainProtocolType *protocol = listener->protocol ? listener->protocol : priv->protocol;
+
+    if (!(event->events & EPOLLIN))
+        return;
 
-    struct epoll_event conn_event = {
-        .events = EPOLLIN | EPOLLRDHUP,
-        .data = {
-            .ptr = &epconn->epoll_handler
+    for (;;) {
+        struct sockaddr_in peer_addr;
+        socklen_t peer_len = sizeof(peer_addr);
+        IpcamTrainProtocolType *conn_protocol = protocol;
+        IpcamITrainContext *context;
+        int cli_sock = accept4(listener->sock,
+                               (struct sockaddr *)&peer_addr,
+                               &peer_len,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (cli_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            ipcam_itrain_stats_inc(ITRAIN_STAT_CONN_ACCEPT_ERRORS);
+            if (errno == EMFILE || errno == ENFILE)
+                itrain_server_shed_connection(itrain_server, listener->sock);
+            else
+                ITRAIN_LOG(ACCEPT_FAILED, errno);
+            break;
         }
-    };
 
-    /* add new connection fd to epoll */
-    epoll_ctl(priv->epoll_fd, EPOLL_CTL_ADD, sock, &conn_event);
+        context = itrain_server_route(itrain_server, cli_sock, listener, &conn_protocol);
+        if (!context) {
+            ipcam_itrain_stats_inc(ITRAIN_STAT_GATEWAY_UNROUTED);
+            close(cli_sock);
+            continue;
+        }
+
+        if (!conn_protocol) {
+            g_print("No protocol selected, disconnect client.\n");
+
+            close(cli_sock);
+
+            continue;
+        }
+
+        if (!itrain_server_admit(itrain_server, peer_addr.sin_addr)) {
+            close(cli_sock);
+            continue;
+        }
+
+        ipcam_itrain_stats_inc(ITRAIN_STAT_CONN_ACCEPTED);
+        ipcam_connection_new(itrain_server, cli_sock, &peer_addr,
+                             context, conn_protocol, listener->auto_detect);
+    }
+}
+
+void ipcam_itrain_server_report_status(IpcamITrainServer *itrain_server,
+                                       gboolean occlusion_stat, 
+                                       gboolean loss_stat)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    IpcamEpollConnection *epconn;
+    GList *l;
+
+    for (l = priv->conn_list.head; l != NULL; l = l->next) {
+        epconn = l->data;
+        IpcamConnection *conn = &epconn->connection;
+        IpcamTrainProtocolType *protocol = epconn->protocol;
+
+        if (protocol && protocol->on_report_status) {
+            protocol->on_report_status(conn, occlusion_stat, loss_stat);
+        }
+    }
+}
+
+/* the fault state of a camera changed, tell its clients */
+static void
+itrain_server_report_context(IpcamITrainServer *itrain_server, IpcamITrainContext *ctx)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    gint64 start = ipcam_itrain_clock_now();
+    gboolean reported = FALSE;
+    GList *l;
+
+    for (l = priv->conn_list.head; l != NULL; l = l->next) {
+        IpcamEpollConnection *epconn = l->data;
+        IpcamTrainProtocolType *protocol = epconn->protocol;
+
+        if (epconn->context != ctx || !protocol || !protocol->on_report_status)
+            continue;
+        protocol->on_report_status(&epconn->connection, ctx->occlusion_stat, ctx->loss_stat);
+        reported = TRUE;
+    }
+    if (reported)
+        ipcam_itrain_stats_latency(ITRAIN_LATENCY_FANOUT,
+                                   ipcam_itrain_clock_now() - start);
+}
+
+/*
+ * Listening sockets are bound at startup but only polled while accepting,
+ * clients connecting before that wait in the listen backlog.
+ */
+static void
+itrain_server_enable_listeners(IpcamITrainServer *itrain_server, gboolean enabled)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    int i;
+
+    if (priv->accepting == enabled || (enabled && priv->draining))
+        return;
+    priv->accepting = enabled;
+
+    for (i = 0; i < NR_LISTENERS; i++) {
+        IpcamITrainListener *listener = &priv->listeners[i];
+
+        if (listener->sock < 0)
+            continue;
+
+        if (enabled)
+            ipcam_reactor_add(priv->reactor, listener->sock,
+                              EPOLLIN | EPOLLRDHUP, &listener->epoll_handler);
+        else
+            ipcam_reactor_del(priv->reactor, listener->sock);
+    }
+    g_print("ITrain: %s connections.\n", enabled ? "accepting" : "holding");
+}
+
+static void
+itrain_server_handle_command(IpcamITrainServer *itrain_server, gchar *command)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    IpcamITrainContext *ctx;
+    char cmd[16];
+    int  arg1, arg2;
+    guint camera = 0;   /* optional last argument, the gateway camera index */
+    guint i;
+
+    if (strncmp(command, "OCCLUSION", 9) == 0) {
+        if (sscanf(command, "%15s %d %d %u", cmd, &arg1, &arg2, &camera) >= 3 &&
+            arg1 >= 0 && arg1 < OCCLUSION_MAX_REGIONS && camera < priv->nr_contexts) {
+            ctx = &priv->contexts[camera];
+            ITRAIN_LOG(CMD_OCCLUSION, arg1, arg2);
+            ipcam_itrain_stats_inc(ITRAIN_STAT_OCCLUSION_NOTICES);
+            if (ipcam_occlusion_table_update(&ctx->occlusion, arg1, arg2,
+                                             ipcam_itrain_clock_now()))
+                itrain_server_occlusion_changed(itrain_server, ctx);
+        }
+    }
+    else if (strncmp(command, "VIDEO", 5) == 0) {
+        if (sscanf(command, "%15s %d %u", cmd, &arg1, &camera) >= 2 &&
+            camera < priv->nr_contexts) {
+            ctx = &priv->contexts[camera];
+            ITRAIN_LOG(CMD_VIDEO, arg1);
+            if (!arg1)
+                __atomic_store_n(&ctx->video_alive_at, 0, __ATOMIC_RELAXED);
+            itrain_server_video_timeout(itrain_server, ctx, ipcam_itrain_clock_now());
+        }
+    }
+    else if (strncmp(command, "IDENTITY", 8) == 0) {
+        ITRAIN_LOG(CMD_IDENTITY);
+        itrain_server_local_notify(itrain_server, ITRAIN_LOCAL_EVENT_IDENTITY);
+        for (i = 0; i < priv->nr_contexts; i++)
+            itrain_server_beacon_changed(itrain_server, &priv->contexts[i]);
+    }
+    else if (strncmp(command, "ACCEPT", 6) == 0) {
+        if (sscanf(command, "%15s %d", cmd, &arg1) == 2) {
+            ITRAIN_LOG(CMD_ACCEPT, arg1);
+            itrain_server_enable_listeners(itrain_server, !!arg1);
+        }
+    }
+}
+
+static void
+itrain_pipe_epoll_handler(struct epoll_event *event)
+{
+    EpollEventHandler *handler = event->data.ptr;
+    IpcamITrainServer *itrain_server = (IpcamITrainServer *)handler->data;
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    gchar *buffer = priv->pipe_buffer;
+
+    if (event->events & EPOLLIN) {
+        int bytes;
+        gchar *line, *eol;
+        gint64 notify_at;
+
+        notify_at = __atomic_exchange_n(&priv->notify_at, 0, __ATOMIC_RELAXED);
+        if (notify_at)
+            ipcam_itrain_stats_latency(ITRAIN_LATENCY_WAKEUP,
+                                       ipcam_itrain_clock_now() - notify_at);
+
+        bytes = read(priv->pipe_read_fd, &buffer[priv->pipe_data_size],
+                     sizeof(priv->pipe_buffer) - priv->pipe_data_size - 1);
+        if (bytes <= 0)
+            return;
+
+        priv->pipe_data_size += bytes;
+        buffer[priv->pipe_data_size] = 0;
+
+        /* commands are newline terminated, keep any partial line */
+        line = buffer;
+        while ((eol = strchr(line, '\n')) != NULL) {
+            *eol = 0;
+            itrain_server_handle_command(itrain_server, line);
+            line = eol + 1;
+        }
+        priv->pipe_data_size -= line - buffer;
+        if (priv->pipe_data_size == sizeof(priv->pipe_buffer) - 1)
+            priv->pipe_data_size = 0;   /* overlong line, drop it */
+        memmove(buffer, line, priv->pipe_data_size);
+    }
+}
+
+/* fire what is due on one connection, FALSE if it was released */
+static gboolean
+itrain_connection_run_timers(IpcamEpollConnection *epconn, gint64 now, guint *fired)
+{
+    IpcamITrainServerPrivate *priv = epconn->itrain_server->priv;
+    IpcamConnection *conn = &epconn->connection;
+    IpcamTrainProtocolType *protocol = epconn->protocol;
+    int i;
+
+    priv->timeout_conn = epconn;
+
+    for (i = 0; i < NR_TIMEOUTS; i++) {
+        IpcamTimeout *timeout = &conn->timeouts[i];
+        gint64 period = (gint64)timeout->timeout_sec * G_USEC_PER_SEC;
+
+        if (!timeout->enabled || now < timeout->expire)
+            continue;
+
+        /* keeps the phase, a late tick does not shift it */
+        if (period > 0) {
+            while (timeout->expire <= now)
+                timeout->expire += period;
+        }
+
+        (*fired)++;
+        protocol->on_timeout(conn, i);
+        /* the connection has been released by the handler */
+        if (priv->timeout_conn == NULL)
+            return FALSE;
+    }
+
+    if (epconn->nr_throttle && protocol->dispatch_pdu)
+        itrain_connection_replay_deferred(epconn, now);
+    if (priv->timeout_conn == NULL)
+        return FALSE;
+
+    priv->timeout_conn = NULL;
+    itrain_connection_schedule(epconn);
+
+    return TRUE;
+}
+
+static void
+itrain_server_timeout_handler(IpcamITrainServer *itrain_server)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    gint64 now = ipcam_itrain_clock_now();
+    guint checked = 0, fired = 0, turn = 0;
+
+    /* every slot since the last tick, one turn at most */
+    while (priv->timer_tick <= now && turn++ < TIMER_WHEEL_SLOTS) {
+        GQueue *slot = &priv->timer_wheel[(priv->timer_tick / SERVER_TICK_INTERVAL) % TIMER_WHEEL_SLOTS];
+        GList *l, *next;
+
+        /* refiled overdue connections go to the next slot, not this one */
+        priv->timer_tick += SERVER_TICK_INTERVAL;
+
+        for (l = slot->head; l != NULL; l = next) {
+            IpcamEpollConnection *epconn = l->data;
+
+            next = l->next;
+            checked++;
+            /* due on a later turn of the wheel */
+            if (epconn->timer_due > now)
+                continue;
+            itrain_connection_run_timers(epconn, now, &fired);
+        }
+    }
+    if (priv->timer_tick <= now)
+        priv->timer_tick = now - now % SERVER_TICK_INTERVAL + SERVER_TICK_INTERVAL;
+
+    ipcam_itrain_stats_add(ITRAIN_STAT_TIMER_CHECKED, checked);
+    ipcam_itrain_stats_add(ITRAIN_STAT_TIMER_FIRED, fired);
+}
+
+static void
+itrain_server_send_beacon(IpcamITrainServer *itrain_server, IpcamITrainContext *ctx)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    int i;
+
+    if (!ctx->beacon_valid)
+        return;
+
+    ctx->beacon.seq = htons(ntohs(ctx->beacon.seq) + 1);
+    for (i = 0; i < priv->nr_mcast_socks; i++) {
+        ipcam_reactor_sendto(priv->reactor, priv->mcast_socks[i],
+                             &ctx->beacon, sizeof(ctx->beacon),
+                             (struct sockaddr*)&priv->mcast_addr, sizeof(priv->mcast_addr));
+    }
+}
+
+/* re-encode the beacon, only called when identity or fault state changed */
+static void
+itrain_server_build_beacon(IpcamITrainServer *itrain_server, IpcamITrainContext *ctx)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    gchar *train_num, *position_num;
+
+    train_num = ipcam_itrain_camera_dup_string_property(ctx->camera, priv->itrain,
+                                                        "szyc:train_num");
+    position_num = ipcam_itrain_camera_dup_string_property(ctx->camera, priv->itrain,
+                                                           "szyc:position_num");
+
+    ctx->beacon_valid = train_num && position_num;
+    if (ctx->beacon_valid) {
+        ctx->beacon.train_num = htonl(strtoul(train_num, NULL, 0));
+        ctx->beacon.position_num = strtoul(position_num, NULL, 0);
+        ctx->beacon.occlusion_stat = ctx->occlusion_stat;
+        ctx->beacon.loss_stat = ctx->loss_stat;
+    }
+    g_free(train_num);
+    g_free(position_num);
+}
+
+/* the status page and the local socket follow the first camera */
+static void
+itrain_server_state_changed(IpcamITrainServer *itrain_server, IpcamITrainContext *ctx)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+
+    if (ctx == &priv->contexts[0]) {
+        ipcam_itrain_status_set_state(ctx->occlusion_stat, ctx->loss_stat,
+                                      ctx->occlusion.stable, ctx->state_time);
+        itrain_server_local_notify(itrain_server, ITRAIN_LOCAL_EVENT_STATE);
+    }
+    itrain_server_report_context(itrain_server, ctx);
+    itrain_server_beacon_changed(itrain_server, ctx);
+}
+
+/* the aggregated occlusion state changed, tell every client */
+static void
+itrain_server_occlusion_changed(IpcamITrainServer *itrain_server, IpcamITrainContext *ctx)
+{
+    ctx->occlusion_stat = ipcam_occlusion_table_aggregate(&ctx->occlusion);
+    ipcam_itrain_stats_inc(ITRAIN_STAT_OCCLUSION_REPORTS);
+    ctx->state_time = ipcam_itrain_clock_now();
+    itrain_server_state_changed(itrain_server, ctx);
+}
+
+static gint64
+itrain_server_video_deadline(IpcamITrainServer *itrain_server, IpcamITrainContext *ctx)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+
+    if (!priv->video_loss_timeout || ctx->loss_stat)
+        return G_MAXINT64;
+
+    return __atomic_load_n(&ctx->video_alive_at, __ATOMIC_RELAXED) +
+        (gint64)priv->video_loss_timeout * 1000;
+}
+
+static gint64
+itrain_server_osd_feed_deadline(IpcamITrainServer *itrain_server)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+
+    return priv->osd_feed_pending ? priv->osd_feed_next : G_MAXINT64;
+}
+
+static void
+itrain_server_osd_feed_push(IpcamITrainServer *itrain_server, JsonNode *notice_body, gint64 now)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+
+    ipcam_osd_queue_push(priv->osd_queue, priv->osd_queue_depth, notice_body);
+    priv->osd_feed_next = now + priv->osd_feed_interval;
+}
+
+/* send the latest update held back by the rate limit */
+static void
+itrain_server_osd_feed_timeout(IpcamITrainServer *itrain_server, gint64 now)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+
+    if (priv->osd_feed_pending && now >= priv->osd_feed_next) {
+        itrain_server_osd_feed_push(itrain_server, priv->osd_feed_pending, now);
+        priv->osd_feed_pending = NULL;
+    }
+}
+
+/*
+ * Live speed/datetime from the train controller, published by the main
+ * loop at most once per osd-feed-interval.  Updates in between replace
+ * each other, the latest one goes out when the interval is over.
+ */
+void ipcam_connection_feed_osd(IpcamConnection *conn, const gchar *speed, const gchar *datetime)
+{
+    IpcamEpollConnection *epconn = container_of(conn, IpcamEpollConnection, connection);
+    IpcamITrainServer *itrain_server = epconn->itrain_server;
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    JsonNode *notice_body = ipcam_osd_live_notice(speed, datetime);
+    gint64 now = ipcam_itrain_clock_now();
+
+    if (priv->osd_feed_pending) {
+        ipcam_osd_notice_free(priv->osd_feed_pending);
+        priv->osd_feed_pending = NULL;
+        ipcam_itrain_stats_inc(ITRAIN_STAT_OSD_FEED_COALESCED);
+    }
+
+    if (now >= priv->osd_feed_next)
+        itrain_server_osd_feed_push(itrain_server, notice_body, now);
+    else
+        priv->osd_feed_pending = notice_body;
+}
+
+/* video loss watchdog */
+static void
+itrain_server_video_timeout(IpcamITrainServer *itrain_server,
+                            IpcamITrainContext *ctx, gint64 now)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    gint64 alive_at;
+    gboolean loss_stat;
+
+    if (!priv->video_loss_timeout)
+        return;
+
+    alive_at = __atomic_load_n(&ctx->video_alive_at, __ATOMIC_RELAXED);
+    loss_stat = (now - alive_at) >= (gint64)priv->video_loss_timeout * 1000;
+    if (loss_stat == ctx->loss_stat)
+        return;
+
+    g_atomic_int_set(&ctx->loss_stat, loss_stat);
+    ipcam_itrain_stats_inc(loss_stat ? ITRAIN_STAT_VIDEO_LOSS : ITRAIN_STAT_VIDEO_RECOVER);
+    ITRAIN_LOG(VIDEO_STATE, loss_stat);
+    ctx->state_time = now;
+    itrain_server_state_changed(itrain_server, ctx);
+}
+
+/* send the new state right away and repeat it a few times */
+static void
+itrain_server_beacon_changed(IpcamITrainServer *itrain_server, IpcamITrainContext *ctx)
+{
+    itrain_server_build_beacon(itrain_server, ctx);
+    itrain_server_send_beacon(itrain_server, ctx);
+    ctx->beacon_burst = BEACON_BURST_COUNT;
+    ctx->beacon_next = ipcam_itrain_clock_now() + BEACON_BURST_INTERVAL;
+}
+
+static void
+itrain_server_beacon_timeout(IpcamITrainServer *itrain_server,
+                             IpcamITrainContext *ctx, gint64 now)
+{
+    if (now < ctx->beacon_next)
+        return;
+
+    itrain_server_send_beacon(itrain_server, ctx);
+    if (ctx->beacon_burst > 0) {
+        ctx->beacon_burst--;
+        ctx->beacon_next = now + BEACON_BURST_INTERVAL;
+    }
+    else {
+        ctx->beacon_next = now + BEACON_KEEPALIVE_INTERVAL;
+    }
+}
+
+static void
+itrain_server_setup_mcast(IpcamITrainServer *itrain_server)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    gchar **interfaces;
+    int i;
+
+    priv->mcast_addr.sin_family = AF_INET;
+    priv->mcast_addr.sin_addr.s_addr = inet_addr(MULTICAST_GROUP);
+    priv->mcast_addr.sin_port = htons(MULTICAST_PORT);
+
+    interfaces = g_strsplit(priv->mcast_interfaces ? priv->mcast_interfaces : "eth0", ",", -1);
+    for (i = 0; interfaces[i] && priv->nr_mcast_socks < MULTICAST_MAX_INTERFACES; i++) {
+        struct ifreq ifr;
+        struct ip_mreqn mreqn;
+        int sock;
+
+        g_strstrip(interfaces[i]);
+        if (interfaces[i][0] == 0)
+            continue;
+
+        sock = itrain_server_take_inherited(itrain_server, HANDOFF_ROLE_MCAST);
+        if (sock < 0)
+            sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock < 0)
+            continue;
+
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, interfaces[i], IFNAMSIZ - 1);
+        if (ioctl(sock, SIOCGIFINDEX, &ifr) == 0) {
+            mreqn.imr_multiaddr.s_addr = inet_addr(MULTICAST_GROUP);
+            mreqn.imr_address.s_addr = htonl(INADDR_ANY);
+            mreqn.imr_ifindex = ifr.ifr_ifindex;
+            if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF,
+                           &mreqn, sizeof(mreqn)) < 0) {
+                perror("setsockopt():IP_MULTICAST_IF");
+            }
+        }
+        else {
+            g_print("ITrain: multicast interface %s not found.\n", interfaces[i]);
+        }
+        priv->mcast_socks[priv->nr_mcast_socks++] = sock;
+    }
+    g_strfreev(interfaces);
+
+    for (i = 0; i < priv->nr_contexts; i++) {
+        itrain_server_build_beacon(itrain_server, &priv->contexts[i]);
+        priv->contexts[i].beacon_next = ipcam_itrain_clock_now();
+    }
+}
+
+
+/* publish the OSD updates queued by the ingestion thread, main loop only */
+void ipcam_itrain_server_publish_osd(IpcamITrainServer *itrain_server)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    JsonNode *notice_body;
+
+    while ((notice_body = g_async_queue_try_pop(priv->osd_queue)) != NULL) {
+        IpcamMessage *notice_msg;
+
+        notice_msg = g_object_new(IPCAM_NOTICE_MESSAGE_TYPE,
+                                  "event", "set_osd",
+                                  "body", notice_body, NULL);
+        ipcam_base_app_send_message(IPCAM_BASE_APP(priv->itrain),
+                                    notice_msg,
+                                    "itrain_pub",
+                                    "itrain_token",
+                                    NULL,
+                                    0);
+
+        g_object_unref(notice_msg);
+        /* the notice body belongs to the message now */
+        ipcam_itrain_mem_uncharge(ITRAIN_MEM_JSON, ipcam_itrain_mem_json_size(notice_body));
+        ipcam_itrain_stats_inc(ITRAIN_STAT_OSD_PUBLISHED);
+    }
+    ipcam_itrain_stats_set(ITRAIN_STAT_OSD_QUEUE_DEPTH, g_async_queue_length(priv->osd_queue));
+}
+
+/* take a socket handed over by the previous instance, -1 if none */
+static int
+itrain_server_take_inherited(IpcamITrainServer *itrain_server, guint8 role)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    int i, fd;
+
+    for (i = 0; i < priv->nr_inherited; i++) {
+        if (priv->inherited[i].role == role && priv->inherited[i].fd >= 0) {
+            fd = priv->inherited[i].fd;
+            priv->inherited[i].fd = -1;
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+static void
+itrain_server_setup_listener(IpcamITrainServer *itrain_server,
+                             IpcamITrainListener *listener,
+                             guint8 role,
+                             const gchar *address,
+                             guint port)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    struct sockaddr_in server_addr;
+    int reuse_addr = 1;
+
+    listener->epoll_handler.event_handler = itrain_server_epoll_handler;
+    listener->epoll_handler.data = listener;
+
+    listener->sock = itrain_server_take_inherited(itrain_server, role);
+    if (listener->sock >= 0) {
+        fcntl(listener->sock, F_SETFL, O_NONBLOCK);
+        /* listen again to apply our backlog */
+        listen(listener->sock, priv->backlog);
+        return;
+    }
+
+    server_addr.sin_family = AF_INET;
+    g_assert(inet_aton(address, &server_addr.sin_addr));
+    server_addr.sin_port = (in_port_t)htons(port);
+
+    listener->sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    g_assert(listener->sock != -1);
+
+    setsockopt(listener->sock, SOL_SOCKET, SO_REUSEADDR,
+               &reuse_addr, sizeof(reuse_addr));
+    fcntl(listener->sock, F_SETFL, O_NONBLOCK);
 
-    /* add to the list */
-    priv->conn_list = g_list_append(priv->conn_list, (gpointer)epconn);
+    g_assert(bind(listener->sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0);
+    g_assert(listen(listener->sock, priv->backlog) == 0);
 
-    return &epconn->connection;
+    /* added to epoll by itrain_server_enable_listeners() */
 }
 
-void ipcam_connection_free(IpcamConnection *conn)
+static void
+itrain_local_client_free(IpcamITrainServer *itrain_server, IpcamLocalClient *client)
 {
-    IpcamEpollConnection *epconn = container_of(conn, IpcamEpollConnection, connection);
-    IpcamITrainServer *itrain_server = epconn->itrain_server;
-    IpcamITrainServerPrivate *priv = itrain_server->priv; 
-    IpcamTrainProtocolType *protocol = priv->protocol;
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
 
-    priv->conn_list = g_list_remove(priv->conn_list, epconn);
-    epoll_ctl(priv->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
-    close(conn->sock);
-    protocol->deinit_connection(conn);
-    g_free(epconn);
+    ipcam_reactor_del(priv->reactor, client->sock);
+    close(client->sock);
+    priv->local_clients = g_list_remove(priv->local_clients, client);
+    priv->nr_local_clients--;
+    ipcam_itrain_stats_set(ITRAIN_STAT_LOCAL_CLIENTS, priv->nr_local_clients);
+    ipcam_itrain_mem_free(ITRAIN_MEM_CONN, client, sizeof(IpcamLocalClient));
 }
 
-void ipcam_connection_enable_timeout(IpcamConnection *conn, guint32 id, gboolean enabled)
+/* a client too slow to read misses the event, FALSE if the socket is gone */
+static gboolean
+itrain_local_send(IpcamLocalClient *client, gconstpointer msg, gsize size)
 {
-    g_return_if_fail(id < NR_TIMEOUTS);
-    conn->timeouts[id].enabled = enabled;
+    if (send(client->sock, msg, size, MSG_DONTWAIT | MSG_NOSIGNAL) == size)
+        return TRUE;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        ipcam_itrain_stats_inc(ITRAIN_STAT_LOCAL_DROPPED);
+        return TRUE;
+    }
+
+    return FALSE;
 }
 
-void ipcam_connection_set_timeout(IpcamConnection *conn, guint32 id, gint32 timeout_sec)
+static void
+itrain_local_build_state(IpcamITrainServer *itrain_server, IpcamLocalState *state)
 {
-    IpcamTimeout *timeout;
+    IpcamITrainContext *ctx = &itrain_server->priv->contexts[0];
 
-    g_return_if_fail(id < NR_TIMEOUTS);
+    memset(state, 0, sizeof(*state));
+    state->header.type = ITRAIN_LOCAL_STATE;
+    state->occlusion_stat = ctx->occlusion_stat;
+    state->loss_stat = ctx->loss_stat;
+    state->time = ctx->state_time;
+}
 
-    timeout = &conn->timeouts[id];
-    timeout->timeout_sec = timeout_sec;
-    timeout->expire = time(NULL) + timeout->timeout_sec;
+static void
+itrain_local_build_identity(IpcamITrainServer *itrain_server, IpcamLocalIdentity *identity)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    IpcamITrainCamera *camera = priv->contexts[0].camera;
+    gchar *value;
+
+    memset(identity, 0, sizeof(*identity));
+    identity->header.type = ITRAIN_LOCAL_IDENTITY;
+    if ((value = ipcam_itrain_camera_dup_string_property(camera, priv->itrain, "szyc:train_num")))
+        g_strlcpy(identity->train_num, value, sizeof(identity->train_num));
+    g_free(value);
+    if ((value = ipcam_itrain_camera_dup_string_property(camera, priv->itrain, "szyc:carriage_num")))
+        g_strlcpy(identity->carriage_num, value, sizeof(identity->carriage_num));
+    g_free(value);
+    if ((value = ipcam_itrain_camera_dup_string_property(camera, priv->itrain, "szyc:position_num")))
+        g_strlcpy(identity->position_num, value, sizeof(identity->position_num));
+    g_free(value);
 }
 
-void ipcam_connection_reset_timeout(IpcamConnection *conn, guint32 id)
+/* the current value of each event in the mask */
+static gboolean
+itrain_local_send_current(IpcamITrainServer *itrain_server,
+                          IpcamLocalClient *client, guint32 events)
 {
-    IpcamTimeout *timeout;
+    if (events & ITRAIN_LOCAL_EVENT_STATE) {
+        IpcamLocalState state;
 
-    g_return_if_fail(id < NR_TIMEOUTS);
+        itrain_local_build_state(itrain_server, &state);
+        if (!itrain_local_send(client, &state, sizeof(state)))
+            return FALSE;
+    }
+    if (events & ITRAIN_LOCAL_EVENT_IDENTITY) {
+        IpcamLocalIdentity identity;
 
-    timeout = &conn->timeouts[id];
-    timeout->expire = time(NULL) + timeout->timeout_sec;
+        itrain_local_build_identity(itrain_server, &identity);
+        if (!itrain_local_send(client, &identity, sizeof(identity)))
+            return FALSE;
+    }
+
+    return TRUE;
 }
 
-gssize ipcam_connection_send_pdu(IpcamConnection *conn, IpcamTrainPDU *pdu)
+static gboolean
+itrain_local_send_error(IpcamLocalClient *client, guint32 error)
 {
-    guint8 *pkt_buffer = ipcam_train_pdu_get_packet_buffer(pdu);
-    guint16 pkt_size = ipcam_train_pdu_get_packet_size(pdu);
+    IpcamLocalError msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.header.type = ITRAIN_LOCAL_ERROR;
+    msg.error = error;
 
-    return send(conn->sock, (gchar *)pkt_buffer, pkt_size, 0);
+    return itrain_local_send(client, &msg, sizeof(msg));
 }
 
+/* called right where the state changes, ahead of the TCP clients */
 static void
-itrain_connection_epoll_handler(struct epoll_event *event)
+itrain_server_local_notify(IpcamITrainServer *itrain_server, guint32 events)
 {
-    EpollEventHandler *handler = event->data.ptr;
-    IpcamEpollConnection *epconn = handler->data;
-    IpcamConnection *conn = &epconn->connection;
-    IpcamITrainServer *itrain_server = epconn->itrain_server;
     IpcamITrainServerPrivate *priv = itrain_server->priv;
-    IpcamTrainProtocolType *protocol = priv->protocol;
+    GList *l, *next;
 
-    if (event->events & EPOLLRDHUP) {
-        /* release connection */
-        ipcam_connection_free(conn);
-        return;
+    for (l = priv->local_clients; l != NULL; l = next) {
+        IpcamLocalClient *client = l->data;
+
+        next = l->next;
+        if ((client->events & events) &&
+            !itrain_local_send_current(itrain_server, client, client->events & events))
+            itrain_local_client_free(itrain_server, client);
     }
+}
+
+static void
+itrain_local_client_handler(struct epoll_event *event)
+{
+    EpollEventHandler *handler = event->data.ptr;
+    IpcamLocalClient *client = (IpcamLocalClient *)handler->data;
+    IpcamITrainServer *itrain_server = client->itrain_server;
+    IpcamLocalRequest request;
+    gboolean alive = TRUE;
+    ssize_t len;
 
     if (event->events & EPOLLIN) {
-        if (protocol->on_data_arrive) {
-            protocol->on_data_arrive(conn);
+        /* one request per packet, a longer one is truncated and refused */
+        len = recv(client->sock, &request, sizeof(request), MSG_DONTWAIT | MSG_TRUNC);
+        if (len < 0) {
+            alive = errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        else if (len == 0) {
+            alive = FALSE;
+        }
+        else if (len != sizeof(request) ||
+                 (request.header.type != ITRAIN_LOCAL_SUBSCRIBE &&
+                  request.header.type != ITRAIN_LOCAL_QUERY)) {
+            alive = itrain_local_send_error(client, EINVAL);
         }
+        else if (!client->trusted) {
+            ipcam_itrain_stats_inc(ITRAIN_STAT_LOCAL_REFUSED);
+            alive = itrain_local_send_error(client, EACCES);
+        }
+        else {
+            if (request.header.type == ITRAIN_LOCAL_SUBSCRIBE)
+                client->events = request.events & ITRAIN_LOCAL_EVENT_ALL;
+            alive = itrain_local_send_current(itrain_server, client,
+                                              request.events & ITRAIN_LOCAL_EVENT_ALL);
+        }
+    }
+    else if (event->events & (EPOLLHUP | EPOLLERR)) {
+        alive = FALSE;
     }
+
+    if (!alive)
+        itrain_local_client_free(itrain_server, client);
 }
 
+/* credentials are taken once, at connect time */
 static void
-itrain_server_epoll_handler(struct epoll_event *event)
+itrain_local_accept_handler(struct epoll_event *event)
 {
     EpollEventHandler *handler = event->data.ptr;
     IpcamITrainServer *itrain_server = (IpcamITrainServer *)handler->data;
     IpcamITrainServerPrivate *priv = itrain_server->priv;
-    IpcamTrainProtocolType *protocol = priv->protocol;
-    struct sockaddr_in peer_addr;
-    socklen_t peer_len = sizeof(peer_addr);
+    IpcamLocalClient *client;
+    int sock;
 
-    if (event->events & EPOLLIN) {
-        IpcamConnection *conn;
-        int cli_sock = accept(priv->server_sock,
-                              (struct sockaddr *)&peer_addr,
-                              &peer_len);
+    sock = accept4(priv->local_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock < 0)
+        return;
 
-        if (!protocol) {
-            g_print("No protocol selected, disconnect client.\n");
+    if (priv->nr_local_clients >= LOCAL_MAX_CLIENTS) {
+        ipcam_itrain_stats_inc(ITRAIN_STAT_LOCAL_REFUSED);
+        close(sock);
+        return;
+    }
 
-            close(cli_sock);
+    client = ipcam_itrain_mem_alloc0(ITRAIN_MEM_CONN, sizeof(IpcamLocalClient));
+    client->itrain_server = itrain_server;
+    client->handler.event_handler = itrain_local_client_handler;
+    client->handler.data = client;
+    client->sock = sock;
+    client->trusted = ipcam_itrain_local_peer_trusted(sock, priv->trusted_uids,
+                                                      priv->nr_trusted_uids);
+    priv->local_clients = g_list_prepend(priv->local_clients, client);
+    priv->nr_local_clients++;
+    ipcam_itrain_stats_set(ITRAIN_STAT_LOCAL_CLIENTS, priv->nr_local_clients);
+    ipcam_reactor_add(priv->reactor, sock, EPOLLIN, &client->handler);
+}
 
-            return;
-        }
+static void
+itrain_handoff_drop_peer(IpcamITrainServer *itrain_server)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
 
-        conn = ipcam_connection_new(itrain_server, cli_sock);
-    }
+    ipcam_reactor_close(priv->reactor, priv->handoff_peer);
+    priv->handoff_peer = -1;
 }
 
-void ipcam_itrain_server_report_status(IpcamITrainServer *itrain_server,
-                                       gboolean occlusion_stat, 
-                                       gboolean loss_stat)
+/*
+ * Hand the listening and datagram sockets over to a new instance, then
+ * keep serving the established connections until they are gone or the
+ * drain timeout expires.
+ */
+static void
+itrain_handoff_peer_handler(struct epoll_event *event)
 {
+    EpollEventHandler *handler = event->data.ptr;
+    IpcamITrainServer *itrain_server = (IpcamITrainServer *)handler->data;
     IpcamITrainServerPrivate *priv = itrain_server->priv;
-    IpcamTrainProtocolType *protocol = priv->protocol;
-    IpcamEpollConnection *epconn;
-    GList *l;
+    IpcamHandoffSocket sockets[HANDOFF_MAX_SOCKETS];
+    static const guint8 listener_roles[NR_LISTENERS] = {
+        [LISTENER_MAIN] = HANDOFF_ROLE_LISTEN_MAIN,
+        [LISTENER_DCTX] = HANDOFF_ROLE_LISTEN_DCTX,
+        [LISTENER_DTTX] = HANDOFF_ROLE_LISTEN_DTTX,
+    };
+    guint nr_sockets = 0;
+    gint ret;
+    int i;
 
-    for (l = priv->conn_list; l != NULL; l = l->next) {
-        epconn = l->data;
-        IpcamConnection *conn = &epconn->connection;
+    ret = ipcam_itrain_handoff_read_request(priv->handoff_peer);
+    if (ret == 0)
+        return;
+    if (ret < 0) {
+        g_print("ITrain: handoff request failed.\n");
+        itrain_handoff_drop_peer(itrain_server);
+        return;
+    }
 
-        if (protocol && protocol->on_report_status) {
-            protocol->on_report_status(conn, occlusion_stat, loss_stat);
+    for (i = 0; i < NR_LISTENERS; i++) {
+        if (priv->listeners[i].sock >= 0) {
+            sockets[nr_sockets].role = listener_roles[i];
+            sockets[nr_sockets++].fd = priv->listeners[i].sock;
+        }
+    }
+    if (priv->osd_server_sock >= 0) {
+        sockets[nr_sockets].role = HANDOFF_ROLE_OSD;
+        sockets[nr_sockets++].fd = priv->osd_server_sock;
+    }
+    for (i = 0; i < priv->nr_mcast_socks && nr_sockets < HANDOFF_MAX_SOCKETS; i++) {
+        sockets[nr_sockets].role = HANDOFF_ROLE_MCAST;
+        sockets[nr_sockets++].fd = priv->mcast_socks[i];
+    }
+
+    /* nothing queued may go out on a socket we no longer own */
+    ipcam_reactor_flush(priv->reactor);
+
+    ret = nr_sockets > 0 && ipcam_itrain_handoff_send(priv->handoff_peer, sockets, nr_sockets);
+    itrain_handoff_drop_peer(itrain_server);
+    if (!ret) {
+        g_print("ITrain: handoff request failed.\n");
+        return;
+    }
+
+    /* the new instance owns the sockets now, drop our references */
+    itrain_server_enable_listeners(itrain_server, FALSE);
+    priv->draining = TRUE;
+    priv->drain_deadline = ipcam_itrain_clock_seconds() + priv->drain_timeout;
+    for (i = 0; i < NR_LISTENERS; i++) {
+        if (priv->listeners[i].sock >= 0) {
+            close(priv->listeners[i].sock);
+            priv->listeners[i].sock = -1;
         }
     }
+    if (priv->osd_server_sock >= 0) {
+        ipcam_osd_ingest_stop(priv->osd);
+        priv->osd = NULL;
+        close(priv->osd_server_sock);
+        priv->osd_server_sock = -1;
+    }
+    for (i = 0; i < priv->nr_mcast_socks; i++)
+        close(priv->mcast_socks[i]);
+    priv->nr_mcast_socks = 0;
+    ipcam_reactor_del(priv->reactor, priv->handoff_sock);
+    close(priv->handoff_sock);
+    priv->handoff_sock = -1;
+
+    g_print("ITrain: sockets handed over, draining %u connections.\n",
+            priv->conn_list.length);
 }
 
+/* the request is read from the loop, one new instance at a time */
 static void
-itrain_pipe_epoll_handler(struct epoll_event *event)
+itrain_handoff_accept_handler(struct epoll_event *event)
 {
     EpollEventHandler *handler = event->data.ptr;
     IpcamITrainServer *itrain_server = (IpcamITrainServer *)handler->data;
     IpcamITrainServerPrivate *priv = itrain_server->priv;
-    gchar buffer[256];
-
-    if (event->events & EPOLLIN) {
-        int bytes;
+    int sock;
 
-        bytes = read(priv->pipe_read_fd, buffer, sizeof(buffer) - 1);
-        if (bytes > 0) {
-            buffer[bytes] = 0;
+    sock = accept4(priv->handoff_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock < 0)
+        return;
+    if (priv->handoff_peer >= 0) {
+        close(sock);
+        return;
+    }
 
-            g_print(buffer);
+    priv->handoff_peer = sock;
+    priv->handoff_peer_deadline = ipcam_itrain_clock_seconds() + HANDOFF_TIMEOUT;
+    priv->handoff_peer_handler.event_handler = itrain_handoff_peer_handler;
+    priv->handoff_peer_handler.data = itrain_server;
+    ipcam_reactor_add(priv->reactor, sock, EPOLLIN, &priv->handoff_peer_handler);
+}
 
-            if (strncmp(buffer, "OCCLUSION", 9) == 0) {
-                char cmd[16];
-                int  region;
-                int  state;
+static void
+itrain_server_check_drained(IpcamITrainServer *itrain_server)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
 
-                if (sscanf(buffer, "%s %d %d", cmd, &region, &state) == 3) {
-                    priv->occlusion_stat = !!state;
-                    ipcam_itrain_server_report_status(itrain_server, state, 0);
-                }
-            }
-        }
+    if (g_queue_is_empty(&priv->conn_list) || ipcam_itrain_clock_seconds() >= priv->drain_deadline) {
+        g_print("ITrain: drained, %u connections left.\n",
+                priv->conn_list.length);
+        priv->terminated = TRUE;
+        g_atomic_int_set(&priv->drained, TRUE);
     }
 }
 
-#define MULTICAST_GROUP     ("224.0.0.88")
-#define MULTICAST_PORT      (10100)
+gboolean ipcam_itrain_server_is_drained(IpcamITrainServer *itrain_server)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+
+    return g_atomic_int_get(&priv->drained);
+}
 
 static void
-itrain_server_timeout_handler(IpcamITrainServer *itrain_server)
+itrain_server_setup(IpcamITrainServer *itrain_server)
 {
+    IpcamITrain *itrain;
     IpcamITrainServerPrivate *priv = itrain_server->priv;
-    IpcamTrainProtocolType *protocol = priv->protocol;
-    time_t now = time(NULL);
-    GList *l;
+    gchar *address;
+    gchar *osd_address;
+    guint port;
+    guint osd_port;
+    int reuse_addr = 1;
+    int i;
 
-    for (l = priv->conn_list; l != NULL; l = l->next) {
-        IpcamEpollConnection *epconn = l->data;
-        IpcamConnection *conn = &epconn->connection;
-        int i;
+    g_object_get(itrain_server, "itrain", &itrain, NULL);
+    g_assert(IPCAM_IS_ITRAIN(itrain));
 
-        for (i = 0; i < NR_TIMEOUTS; i++) {
-            IpcamTimeout *timeout = &conn->timeouts[i];
-            if (!timeout->enabled)
-                continue;
+    for (i = 0; i < priv->nr_contexts; i++) {
+        IpcamITrainContext *ctx = &priv->contexts[i];
 
-            if (now >= timeout->expire) {
-                guint32 timeout_sec = timeout->timeout_sec;
-                if (timeout_sec > 0) {
-                    while(timeout->expire <= now)
-                        timeout->expire += timeout_sec;
-                }
+        ipcam_occlusion_table_init(&ctx->occlusion,
+                                   priv->occlusion_on_delay,
+                                   priv->occlusion_off_delay);
+        /* the media service gets one timeout period to show up */
+        ctx->video_alive_at = ipcam_itrain_clock_now();
+    }
+    priv->timer_tick = ipcam_itrain_clock_now();
+    priv->timer_tick -= priv->timer_tick % SERVER_TICK_INTERVAL;
+
+    /* create epoll fd, simulated clients live in memory */
+    priv->reactor = ipcam_reactor_new(priv->simulated ? "sim" : priv->io_backend);
+    g_assert(priv->reactor != NULL);
+    g_print("ITrain: using %s I/O backend.\n", ipcam_reactor_backend_name(priv->reactor));
+
+    /* take over the sockets of a running instance, before the loop runs */
+    if (priv->handoff_path) {
+        priv->nr_inherited = ipcam_itrain_handoff_receive(priv->handoff_path,
+                                                          priv->inherited,
+                                                          HANDOFF_MAX_SOCKETS);
+        if (priv->nr_inherited > 0)
+            g_print("ITrain: %d sockets taken over from the previous instance.\n",
+                    priv->nr_inherited);
+    }
 
-                protocol->on_timeout(conn, i);
-            }
+    /* setup server sockets */
+    g_object_get(itrain_server, "address", &address, "port", &port, NULL);
+    if (address) {
+        /* the main port follows the default protocol unless auto detection is on */
+        if (port) {
+            priv->listeners[LISTENER_MAIN].auto_detect = priv->auto_detect;
+            itrain_server_setup_listener(itrain_server,
+                                         &priv->listeners[LISTENER_MAIN],
+                                         HANDOFF_ROLE_LISTEN_MAIN,
+                                         address, port);
+        }
+        if (priv->dctx_port) {
+            priv->listeners[LISTENER_DCTX].protocol = &ipcam_dctx_protocol_type;
+            itrain_server_setup_listener(itrain_server,
+                                         &priv->listeners[LISTENER_DCTX],
+                                         HANDOFF_ROLE_LISTEN_DCTX,
+                                         address, priv->dctx_port);
+        }
+        if (priv->dttx_port) {
+            priv->listeners[LISTENER_DTTX].protocol = &ipcam_dttx_protocol_type;
+            itrain_server_setup_listener(itrain_server,
+                                         &priv->listeners[LISTENER_DTTX],
+                                         HANDOFF_ROLE_LISTEN_DTTX,
+                                         address, priv->dttx_port);
+        }
+    }
+    g_free(address);
+
+    /* setup osd server socket */
+    g_object_get(itrain_server, "osd-address", &osd_address, "osd-port", &osd_port, NULL);
+    if (osd_address && osd_port) {
+        priv->osd_server_sock = itrain_server_take_inherited(itrain_server, HANDOFF_ROLE_OSD);
+        if (priv->osd_server_sock < 0) {
+            struct sockaddr_in osd_server_addr;
+            osd_server_addr.sin_family = AF_INET;
+            g_assert(inet_aton(osd_address, &osd_server_addr.sin_addr));
+            osd_server_addr.sin_port = (in_port_t)htons(osd_port);
+
+            priv->osd_server_sock = socket(PF_INET, SOCK_DGRAM, 0);
+            g_assert(priv->osd_server_sock != -1);
+            setsockopt(priv->osd_server_sock, SOL_SOCKET, SO_REUSEADDR,
+                       &reuse_addr, sizeof(reuse_addr));
+
+            g_assert(bind(priv->osd_server_sock, (struct sockaddr*)&osd_server_addr,
+                          sizeof(osd_server_addr)) == 0);
         }
+        fcntl(priv->osd_server_sock, F_SETFL, O_NONBLOCK);
+
+        /* a busy overlay feed must not delay the protocol traffic */
+        priv->osd = ipcam_osd_ingest_start(priv->osd_server_sock,
+                                           priv->osd_queue,
+                                           priv->osd_queue_depth,
+                                           priv->osd_cpus);
+    }
+    g_free(osd_address);
+
+    /* add pipe to epoll */
+    priv->pipe_handler.event_handler = itrain_pipe_epoll_handler;
+    priv->pipe_handler.data = itrain_server;
+
+    ipcam_reactor_add(priv->reactor, priv->pipe_read_fd, EPOLLIN, &priv->pipe_handler);
+
+    /* setup multi-cast sockets */
+    itrain_server_setup_mcast(itrain_server);
+
+    /* close anything handed over that we have no use for */
+    for (i = 0; i < priv->nr_inherited; i++) {
+        if (priv->inherited[i].fd >= 0)
+            close(priv->inherited[i].fd);
     }
 
-    if (priv->mcast_timer_count == 0) {
-        priv->mcast_timer_count = 10 * 5;
+    /* spare fd to shed connections with when we run out */
+    priv->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-        const char *train_num, *position_num;
-        train_num = ipcam_itrain_get_string_property(priv->itrain, "szyc:train_num");
-        position_num = ipcam_itrain_get_string_property(priv->itrain, "szyc:position_num");
+    /* serve hot restart requests */
+    if (priv->handoff_path) {
+        priv->handoff_sock = ipcam_itrain_handoff_listen(priv->handoff_path);
+        if (priv->handoff_sock >= 0) {
+            priv->handoff_handler.event_handler = itrain_handoff_accept_handler;
+            priv->handoff_handler.data = itrain_server;
+            ipcam_reactor_add(priv->reactor, priv->handoff_sock, EPOLLIN, &priv->handoff_handler);
+        }
+    }
 
-        if (train_num && position_num) {
-            struct sockaddr_in mcast_addr;
-            mcast_addr.sin_family = AF_INET;
-            mcast_addr.sin_addr.s_addr = inet_addr(MULTICAST_GROUP);
-            mcast_addr.sin_port = htons(MULTICAST_PORT);
-            struct {
-                guint32 train_num;
-                guint8  position_num;
-                guint8  occlusion_stat;
-              guint8  loss_stat;
-            } __attribute__((packed)) mcast_event;
-            mcast_event.train_num = htonl(strtoul(train_num, NULL, 0));
-            mcast_event.position_num = strtoul(position_num, NULL, 0);
-            mcast_event.occlusion_stat = priv->occlusion_stat;
-            mcast_event.loss_stat = 0;
-            sendto(priv->mcast_sock, &mcast_event, sizeof(mcast_event), 0,
-                   (struct sockaddr*)&mcast_addr, sizeof(mcast_addr));
+    /* state and identity events for processes on the camera */
+    if (priv->local_path) {
+        priv->nr_trusted_uids = ipcam_itrain_local_parse_uids(priv->local_uids,
+                                                              priv->trusted_uids,
+                                                              ITRAIN_LOCAL_MAX_UIDS);
+        priv->local_sock = ipcam_itrain_local_listen(priv->local_path);
+        if (priv->local_sock >= 0) {
+            priv->local_handler.event_handler = itrain_local_accept_handler;
+            priv->local_handler.data = itrain_server;
+            ipcam_reactor_add(priv->reactor, priv->local_sock, EPOLLIN, &priv->local_handler);
         }
     }
-    else {
-        --priv->mcast_timer_count;
+
+}
+
+static gint64
+itrain_server_next_deadline(IpcamITrainServer *itrain_server)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    gint64 deadline;
+    guint i;
+
+    deadline = MIN(priv->next_tick, itrain_server_osd_feed_deadline(itrain_server));
+    for (i = 0; i < priv->nr_contexts; i++) {
+        IpcamITrainContext *ctx = &priv->contexts[i];
+
+        deadline = MIN(deadline, ctx->beacon_next);
+        deadline = MIN(deadline, ipcam_occlusion_table_next_deadline(&ctx->occlusion));
+        deadline = MIN(deadline, itrain_server_video_deadline(itrain_server, ctx));
     }
+
+    return deadline;
 }
 
-typedef struct SetOSDRequest
+/* handle at most one event, returns 1 if there was one */
+static int
+itrain_server_dispatch(IpcamITrainServer *itrain_server, int timeout_ms)
 {
-    guint8 head;    /* 0xff */
-    guint8 code;    /* function code */
-    guint8 keeptime;   /* time to keep on screen */
-    guint16 x;       /* X position */
-    guint16 y;       /* Y position */
-    guint16 fontsize;
-    guint16 length;  /* max to 1024 */
-    guint8 data[1024];
-    guint8 csum;
-} __attribute__((packed)) SetOSDRequest;
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    struct epoll_event ep_event;
+    int ret;
+
+    ret = ipcam_reactor_wait(priv->reactor, &ep_event, timeout_ms);
+    if (ret > 0) {
+        EpollEventHandler *handler = ep_event.data.ptr;
+        g_assert(handler);
+        handler->event_handler(&ep_event);
+    }
+    else if (ret < 0) {
+        /* error occured */
+        g_print("%s:error\n", __func__);
+    }
+
+    return ret;
+}
 
 static void
-itrain_osd_server_epoll_handler(struct epoll_event *event)
+itrain_server_run_timers(IpcamITrainServer *itrain_server, gint64 now)
 {
-    IpcamITrain *itrain;
-    EpollEventHandler *handler = event->data.ptr;
-    IpcamITrainServer *itrain_server = (IpcamITrainServer *)handler->data;
     IpcamITrainServerPrivate *priv = itrain_server->priv;
-    struct sockaddr_in peer_addr;
-    socklen_t peer_len = sizeof(peer_addr);
+    gint64 deadline;
+    guint i;
 
-    g_object_get(itrain_server, "itrain", &itrain, NULL);
-    g_assert(IPCAM_IS_ITRAIN(itrain));
+    if (now >= priv->next_tick) {
+        priv->next_tick = now + SERVER_TICK_INTERVAL;
+        itrain_server_timeout_handler(itrain_server);
+    }
+    for (i = 0; i < priv->nr_contexts; i++) {
+        IpcamITrainContext *ctx = &priv->contexts[i];
 
-    if (event->events & EPOLLIN) {
-        SetOSDRequest req;
-        int n = recvfrom(priv->osd_server_sock, &req, sizeof(req), 0,
-                         (struct sockaddr*)&peer_addr, &peer_len);
-        if (n < sizeof(req)) {
-            g_print("invalid set osd request\n");
-            return;
-        }
-        if ((req.head != 0xff) || (req.code != 0x09)) {
-            g_print("invalid request %02x %02x\n", (int)req.head, (int)req.code);
-            return;
+        deadline = ipcam_occlusion_table_next_deadline(&ctx->occlusion);
+        if (ipcam_occlusion_table_poll(&ctx->occlusion, now)) {
+            ipcam_itrain_stats_latency(ITRAIN_LATENCY_TIMER, now - deadline);
+            itrain_server_occlusion_changed(itrain_server, ctx);
         }
+        itrain_server_video_timeout(itrain_server, ctx, now);
+        itrain_server_beacon_timeout(itrain_server, ctx, now);
+    }
+    itrain_server_osd_feed_timeout(itrain_server, now);
 
-        IpcamMessage *notice_msg;
-        JsonBuilder *builder;
-        JsonNode *notice_body;
-
-        builder = json_builder_new();
-        json_builder_begin_object(builder);
-        json_builder_set_member_name(builder, "items");
-        json_builder_begin_object(builder);
-        json_builder_set_member_name(builder, "master");
-        json_builder_begin_object(builder);
-        json_builder_set_member_name(builder, "speed_gps");
-        json_builder_begin_object(builder);
-        json_builder_set_member_name(builder, "isshow");
-        json_builder_add_boolean_value(builder, TRUE);
-        json_builder_set_member_name(builder, "size");
-        json_builder_add_int_value(builder, (guint64)ntohs(req.fontsize));
-        json_builder_set_member_name(builder, "left");
-        json_builder_add_int_value(builder, (guint64)ntohs(req.x));
-        json_builder_set_member_name(builder, "top");
-        json_builder_add_int_value(builder, (guint64)ntohs(req.y));
-        json_builder_set_member_name(builder, "color");
-        json_builder_begin_object(builder);
-        json_builder_set_member_name(builder, "red");
-        json_builder_add_int_value(builder, 0);
-        json_builder_set_member_name(builder, "green");
-        json_builder_add_int_value(builder, 0);
-        json_builder_set_member_name(builder, "blue");
-        json_builder_add_int_value(builder, 0);
-        json_builder_set_member_name(builder, "alpha");
-        json_builder_add_int_value(builder, 0);
-        json_builder_end_object(builder); // color
-        json_builder_set_member_name(builder, "text");
-        json_builder_add_string_value(builder, req.data);
-        json_builder_end_object(builder); // speed_gps
-        json_builder_end_object(builder); // master
-        json_builder_end_object(builder); // items
-        json_builder_end_object(builder); // root
-
-        notice_body = json_builder_get_root(builder);
-        g_object_unref(builder);
+    if (priv->handoff_peer >= 0 && ipcam_itrain_clock_seconds() >= priv->handoff_peer_deadline) {
+        g_print("ITrain: handoff request timed out.\n");
+        itrain_handoff_drop_peer(itrain_server);
+    }
 
-        notice_msg = g_object_new(IPCAM_NOTICE_MESSAGE_TYPE,
-                                  "event", "set_osd",
-                                  "body", notice_body, NULL);
-        ipcam_base_app_send_message(IPCAM_BASE_APP(itrain),
-                                    notice_msg,
-                                    "itrain_pub",
-                                    "itrain_token",
-                                    NULL,
-                                    0);
+    if (priv->draining)
+        itrain_server_check_drained(itrain_server);
+}
 
-        g_object_unref(notice_msg);
+static void
+itrain_server_cleanup(IpcamITrainServer *itrain_server)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    int i;
+
+    /* free all connections */
+    while (!g_queue_is_empty(&priv->conn_list)) {
+        IpcamEpollConnection *epconn = priv->conn_list.head->data;
+
+        ipcam_connection_free(&epconn->connection);
     }
+
+    itrain_server_enable_listeners(itrain_server, FALSE);
+    for (i = 0; i < NR_LISTENERS; i++) {
+        if (priv->listeners[i].sock >= 0)
+            close(priv->listeners[i].sock);
+    }
+    if (priv->handoff_sock >= 0)
+        close(priv->handoff_sock);
+    if (priv->handoff_peer >= 0)
+        close(priv->handoff_peer);
+    while (priv->local_clients)
+        itrain_local_client_free(itrain_server, priv->local_clients->data);
+    if (priv->local_sock >= 0)
+        close(priv->local_sock);
+    if (priv->reserve_fd >= 0)
+        close(priv->reserve_fd);
+    if (priv->osd) {
+        ipcam_osd_ingest_stop(priv->osd);
+        priv->osd = NULL;
+    }
+    if (priv->osd_server_sock >= 0)
+        close(priv->osd_server_sock);
+    if (priv->osd_feed_pending) {
+        ipcam_osd_notice_free(priv->osd_feed_pending);
+        priv->osd_feed_pending = NULL;
+    }
+    for (i = 0; i < priv->nr_mcast_socks; i++)
+        close(priv->mcast_socks[i]);
+    ipcam_reactor_free(priv->reactor);
+    priv->reactor = NULL;
 }
 
 static gpointer
 itrain_server_thread_proc(gpointer data)
 {
-    IpcamITrain *itrain;
     IpcamITrainServer *itrain_server = IPCAM_ITRAIN_SERVER(data);
     IpcamITrainServerPrivate *priv = itrain_server->priv;
-    gchar *address;
-    gchar *osd_address;
-    guint port;
-    guint osd_port;
-    struct epoll_event server_event;
-    struct epoll_event osd_server_event;
-    struct epoll_event pipe_event;
-    EpollEventHandler server_handler;
-    EpollEventHandler osd_server_handler;
-    EpollEventHandler pipe_handler;
-    int reuse_addr = 1;
-
-    g_object_get(itrain_server, "itrain", &itrain, NULL);
-    g_assert(IPCAM_IS_ITRAIN(itrain));
 
-    /* create epoll fd */
-    priv->epoll_fd = epoll_create(10);
-    g_assert(priv->epoll_fd != -1);
+    ipcam_itrain_rt_tune_thread("itrain-server", priv->server_cpus, priv->fifo_priority);
+    itrain_server_setup(itrain_server);
 
-    /* setup server socket */
-    g_object_get(itrain_server, "address", &address, "port", &port, NULL);
-    if (address && port) {
-        struct sockaddr_in server_addr;
-        server_addr.sin_family = AF_INET;
-        g_assert(inet_aton(address, &server_addr.sin_addr));
-        server_addr.sin_port = (in_port_t)htons(port);
+    while (!priv->terminated) {
+        gint64 now, deadline;
 
-        priv->server_sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-        g_assert(priv->server_sock != -1);
+        /* wake up for the next deadline even when events keep arriving */
+        now = ipcam_itrain_clock_now();
+        deadline = itrain_server_next_deadline(itrain_server);
+        itrain_server_dispatch(itrain_server, MAX(0, (deadline - now + 999) / 1000));
+        itrain_server_run_timers(itrain_server, ipcam_itrain_clock_now());
+    }
 
-        setsockopt(priv->server_sock, SOL_SOCKET, SO_REUSEADDR,
-                   &reuse_addr, sizeof(reuse_addr));
-        fcntl(priv->server_sock, F_SETFL, O_NONBLOCK);
+    itrain_server_cleanup(itrain_server);
 
-        g_assert(bind(priv->server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0);
-        g_assert(listen(priv->server_sock, 10) == 0);
+    return NULL;
+}
 
-        /* add server socket to epoll */
-        server_handler.event_handler = itrain_server_epoll_handler;
-        server_handler.data = itrain_server;
+/*
+ * Simulation mode, see tools/itrain-sim.c.  The caller owns the virtual
+ * clock and plays the clients on in-memory sockets.
+ */
+IpcamReactor *ipcam_itrain_server_sim_reactor(IpcamITrainServer *itrain_server)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
 
-        server_event.events = EPOLLIN | EPOLLRDHUP;
-        server_event.data.ptr = &server_handler;
+    g_return_val_if_fail(priv->simulated, NULL);
 
-        epoll_ctl(priv->epoll_fd,
-                  EPOLL_CTL_ADD,
-                  priv->server_sock,
-                  &server_event);
-    }
-    g_free(address);
+    return priv->reactor;
+}
 
-    /* setup osd server socket */
-    g_object_get(itrain_server, "osd-address", &osd_address, "osd-port", &osd_port, NULL);
-    if (osd_address && osd_port) {
-        struct sockaddr_in osd_server_addr;
-        osd_server_addr.sin_family = AF_INET;
-        g_assert(inet_aton(osd_address, &osd_server_addr.sin_addr));
-        osd_server_addr.sin_port = (in_port_t)htons(osd_port);
-
-        priv->osd_server_sock = socket(PF_INET, SOCK_DGRAM, 0);
-        g_assert(priv->osd_server_sock != -1);
-        setsockopt(priv->osd_server_sock, SOL_SOCKET, SO_REUSEADDR,
-                   &reuse_addr, sizeof(reuse_addr));
-        fcntl(priv->osd_server_sock, F_SETFL, O_NONBLOCK);
+/* a client connecting from peer, returns its end of the socket or -1 if refused */
+int ipcam_itrain_server_sim_connect(IpcamITrainServer *itrain_server, guint32 peer)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
+    struct sockaddr_in peer_addr;
+    int sock;
 
-        g_assert(bind(priv->osd_server_sock, (struct sockaddr*)&osd_server_addr,
-                      sizeof(osd_server_addr)) == 0);
+    g_return_val_if_fail(priv->simulated, -1);
 
-        /* add osd server socket to epoll */
-        osd_server_handler.event_handler = itrain_osd_server_epoll_handler;
-        osd_server_handler.data = itrain_server;
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_addr.s_addr = htonl(peer);
+    peer_addr.sin_port = htons(10000 + priv->last_conn_id % 50000);
 
-        osd_server_event.events = EPOLLIN | EPOLLRDHUP;
-        osd_server_event.data.ptr = &osd_server_handler;
+    if (!itrain_server_admit(itrain_server, peer_addr.sin_addr))
+        return -1;
 
-        epoll_ctl(priv->epoll_fd,
-                  EPOLL_CTL_ADD,
-                  priv->osd_server_sock,
-                  &osd_server_event);
+    sock = ipcam_reactor_sim_socket(priv->reactor);
+    if (!ipcam_connection_new(itrain_server, sock, &peer_addr, &priv->contexts[0],
+                              priv->protocol, priv->auto_detect)) {
+        ipcam_reactor_sim_hangup(priv->reactor, sock);
+        return -1;
     }
-    g_free(osd_address);
-
-    /* create pipe and add it to epoll */
-    g_assert(pipe(priv->pipe_fds) == 0);
 
-    pipe_handler.event_handler = itrain_pipe_epoll_handler;
-    pipe_handler.data = itrain_server;
-
-    pipe_event.events = EPOLLIN;
-    pipe_event.data.ptr = &pipe_handler;
+    return sock;
+}
 
-    epoll_ctl(priv->epoll_fd,
-              EPOLL_CTL_ADD,
-              priv->pipe_read_fd,
-              &pipe_event);
+/*
+ * Handle everything the clients sent, then move the clock from deadline
+ * to deadline up to until.  The server only acts at the instants it
+ * would have woken up at, so a run is repeatable to the microsecond.
+ */
+void ipcam_itrain_server_sim_run(IpcamITrainServer *itrain_server, gint64 until)
+{
+    IpcamITrainServerPrivate *priv = itrain_server->priv;
 
-    /* setup multi-cast socket */
-    priv->mcast_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    /* default interface to eth0 */
-    struct ifreq ifr;
-    strncpy(ifr.ifr_name, "eth0", IFNAMSIZ);
-    if (ioctl(priv->mcast_sock, SIOCGIFINDEX, &ifr) == 0) {
-        struct ip_mreqn mreqn;
-        mreqn.imr_multiaddr.s_addr = inet_addr(MULTICAST_GROUP);
-        mreqn.imr_address.s_addr = htonl(INADDR_ANY);
-        mreqn.imr_ifindex = ifr.ifr_ifindex;
-        if (setsockopt(priv->mcast_sock, IPPROTO_IP, IP_MULTICAST_IF,
-                       &mreqn, sizeof(mreqn)) < 0) {
-            perror("setsockopt():IP_MULTICAST_IF");
-        }
-    }
+    g_return_if_fail(priv->simulated && ipcam_itrain_clock_is_virtual());
 
     while (!priv->terminated) {
-        struct epoll_event ep_event;
-        int ret;
+        gint64 now = ipcam_itrain_clock_now();
 
-        ret = epoll_wait(priv->epoll_fd, &ep_event, 1, 100);
-        if (ret > 0) {
-            EpollEventHandler *handler = ep_event.data.ptr;
-            g_assert(handler);
-            handler->event_handler(&ep_event);
-        }
-        else if (ret == 0) {
-            /* epoll timeout */
-            itrain_server_timeout_handler(itrain_server);
-        }
-        else {
-            /* error occured */
-            g_print("%s:error\n", __func__);
+        if (itrain_server_dispatch(itrain_server, 0) > 0) {
+            itrain_server_run_timers(itrain_server, now);
+            continue;
         }
-    }
-
-    /* free all connections */
-    GList *list = priv->conn_list;
-    while (list) {
-        GList *next = list->next;
-        IpcamEpollConnection *epconn = list->data;
-
-        ipcam_connection_free(&epconn->connection);
+        if (now >= until)
+            break;
 
-        list = next;
+        ipcam_itrain_clock_advance(CLAMP(itrain_server_next_deadline(itrain_server), now + 1, until));
+        itrain_server_run_timers(itrain_server, ipcam_itrain_clock_now());
     }
-    g_list_free(priv->conn_list);
-
-    epoll_ctl(priv->epoll_fd, EPOLL_CTL_DEL,
-              priv->server_sock, NULL);
-    close(priv->server_sock);
-    close(priv->epoll_fd);
-
-    return NULL;
 }
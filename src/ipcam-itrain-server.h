@@ -9,6 +9,7 @@
 #define _IPCAM_ITRAIN_SERVER_H_
 
 #include <glib-object.h>
+#include "ipcam-itrain-reactor.h"
 
 G_BEGIN_DECLS
 
@@ -40,10 +41,23 @@ GType ipcam_itrain_server_get_type (void) G_GNUC_CONST;
 int ipcam_itrain_server_send_notify(IpcamITrainServer *itrain_server,
                                     gpointer notify,
                                     guint length);
+void ipcam_itrain_server_set_accepting(IpcamITrainServer *itrain_server,
+                                       gboolean accepting);
+void ipcam_itrain_server_video_alive(IpcamITrainServer *itrain_server,
+                                     guint camera,
+                                     gboolean alive);
+void ipcam_itrain_server_publish_osd(IpcamITrainServer *itrain_server);
+void ipcam_itrain_server_update_identity(IpcamITrainServer *itrain_server);
+gboolean ipcam_itrain_server_is_drained(IpcamITrainServer *itrain_server);
 void ipcam_itrain_server_report_status(IpcamITrainServer *ipcam_itrain_server,
                                        gboolean occlusion_stat, 
                                        gboolean loss_stat);
 
+/* with the "simulated" property set */
+IpcamReactor *ipcam_itrain_server_sim_reactor(IpcamITrainServer *itrain_server);
+int  ipcam_itrain_server_sim_connect(IpcamITrainServer *itrain_server, guint32 peer);
+void ipcam_itrain_server_sim_run(IpcamITrainServer *itrain_server, gint64 until);
+
 G_END_DECLS
 
 #endif /* _IPCAM_ITRAIN_SERVER_H_ */
@@ -0,0 +1,200 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-snapshot.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "ipcam-itrain-snapshot.h"
+
+#define SNAPSHOT_MAGIC      "ITSS"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_MAX_SIZE   (64 * 1024)
+
+typedef struct SnapshotHeader
+{
+    guint8  magic[4];
+    guint16 version;
+    guint16 count;
+    guint32 length;     /* size of the entries following the header */
+    guint32 crc;        /* crc32 of the entries */
+} __attribute__((packed)) SnapshotHeader;
+
+/*
+ * Entry layout:
+ *   guint8  key_len
+ *   gchar   key[key_len]
+ *   guint16 value_len
+ *   gchar   value[value_len]
+ */
+
+static gboolean write_all(int fd, const guint8 *buf, gsize len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+static void sync_parent_dir(const gchar *path)
+{
+    gchar *dir = g_path_get_dirname(path);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    g_free(dir);
+}
+
+gboolean ipcam_itrain_snapshot_save(const gchar *path, GHashTable *items)
+{
+    SnapshotHeader header;
+    GString *entries = g_string_sized_new(512);
+    GHashTableIter iter;
+    gpointer key, value;
+    gchar *tmp_path;
+    guint16 count = 0;
+    gboolean ret = FALSE;
+    int fd;
+
+    g_return_val_if_fail(path != NULL, FALSE);
+
+    g_hash_table_iter_init(&iter, items);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        gsize key_len = strlen(key);
+        gsize value_len = value ? strlen(value) : 0;
+        guint8 klen;
+        guint16 vlen;
+
+        if (key_len > G_MAXUINT8 || value_len > G_MAXUINT16)
+            continue;
+
+        klen = key_len;
+        vlen = htons(value_len);
+        g_string_append_len(entries, (gchar *)&klen, sizeof(klen));
+        g_string_append_len(entries, key, key_len);
+        g_string_append_len(entries, (gchar *)&vlen, sizeof(vlen));
+        g_string_append_len(entries, value, value_len);
+        count++;
+    }
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = htons(SNAPSHOT_VERSION);
+    header.count = htons(count);
+    header.length = htonl(entries->len);
+    header.crc = htonl(crc32(0, (const Bytef *)entries->str, entries->len));
+
+    tmp_path = g_strdup_printf("%s.tmp", path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        g_print("ITrain: snapshot: can not create %s: %s\n", tmp_path, strerror(errno));
+        goto out;
+    }
+
+    if (!write_all(fd, (guint8 *)&header, sizeof(header)) ||
+        !write_all(fd, (guint8 *)entries->str, entries->len) ||
+        fsync(fd) != 0) {
+        g_print("ITrain: snapshot: write %s failed: %s\n", tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        goto out;
+    }
+    close(fd);
+
+    if (rename(tmp_path, path) != 0) {
+        g_print("ITrain: snapshot: rename to %s failed: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        goto out;
+    }
+    sync_parent_dir(path);
+    ret = TRUE;
+
+out:
+    g_free(tmp_path);
+    g_string_free(entries, TRUE);
+
+    return ret;
+}
+
+GHashTable *ipcam_itrain_snapshot_load(const gchar *path)
+{
+    GHashTable *items = NULL;
+    SnapshotHeader *header;
+    gchar *contents = NULL;
+    gsize size = 0;
+    const guint8 *p, *end;
+    guint16 count;
+
+    g_return_val_if_fail(path != NULL, NULL);
+
+    if (!g_file_get_contents(path, &contents, &size, NULL))
+        return NULL;
+
+    if (size < sizeof(*header) || size > SNAPSHOT_MAX_SIZE)
+        goto invalid;
+
+    header = (SnapshotHeader *)contents;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        ntohs(header->version) != SNAPSHOT_VERSION ||
+        ntohl(header->length) != size - sizeof(*header))
+        goto invalid;
+
+    p = (const guint8 *)contents + sizeof(*header);
+    end = (const guint8 *)contents + size;
+    if (crc32(0, p, end - p) != ntohl(header->crc))
+        goto invalid;
+
+    items = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    for (count = ntohs(header->count); count > 0; count--) {
+        guint8 klen;
+        guint16 vlen;
+        gchar *key;
+
+        if (end - p < sizeof(klen))
+            goto invalid;
+        klen = *p++;
+        if (end - p < klen + sizeof(vlen))
+            goto invalid;
+        key = g_strndup((const gchar *)p, klen);
+        p += klen;
+        memcpy(&vlen, p, sizeof(vlen));
+        vlen = ntohs(vlen);
+        p += sizeof(vlen);
+        if (end - p < vlen) {
+            g_free(key);
+            goto invalid;
+        }
+        g_hash_table_insert(items, key, g_strndup((const gchar *)p, vlen));
+        p += vlen;
+    }
+
+    g_free(contents);
+
+    return items;
+
+invalid:
+    g_print("ITrain: snapshot: %s is corrupted, ignored.\n", path);
+    if (items)
+        g_hash_table_destroy(items);
+    g_free(contents);
+
+    return NULL;
+}
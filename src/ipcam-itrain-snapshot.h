@@ -0,0 +1,21 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-snapshot.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_SNAPSHOT_H_
+#define _IPCAM_ITRAIN_SNAPSHOT_H_
+
+#include <glib.h>
+
+/*
+ * The snapshot keeps the last known identity properties (string keys and
+ * string values) so the server can be fully functional before iconfig
+ * answers.  The file is replaced atomically on every save.
+ */
+gboolean    ipcam_itrain_snapshot_save(const gchar *path, GHashTable *items);
+GHashTable *ipcam_itrain_snapshot_load(const gchar *path);
+
+#endif /* _IPCAM_ITRAIN_SNAPSHOT_H_ */
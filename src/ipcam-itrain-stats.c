@@ -0,0 +1,170 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-stats.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#include "ipcam-itrain-stats.h"
+#include "ipcam-itrain-mem.h"
+
+static const gchar *stat_names[NR_ITRAIN_STATS] = {
+#define ITRAIN_STAT_NAME(id, name) name,
+    ITRAIN_STATS(ITRAIN_STAT_NAME)
+#undef ITRAIN_STAT_NAME
+};
+
+/* updated from the server thread and the main loop */
+static gint64 stat_values[NR_ITRAIN_STATS];
+
+static const gchar *latency_names[NR_ITRAIN_LATENCIES] = {
+#define ITRAIN_LATENCY_NAME(id, name) name,
+    ITRAIN_LATENCIES(ITRAIN_LATENCY_NAME)
+#undef ITRAIN_LATENCY_NAME
+};
+
+/* four buckets per power of two, exact below 4 usec */
+#define LATENCY_MAX_BITS        40
+#define NR_LATENCY_BUCKETS      (LATENCY_MAX_BITS * 4)
+
+typedef struct IpcamITrainLatency
+{
+    gint64 count;
+    gint64 max;
+    gint64 buckets[NR_LATENCY_BUCKETS];
+} IpcamITrainLatency;
+
+static IpcamITrainLatency latencies[NR_ITRAIN_LATENCIES];
+
+static guint
+latency_bucket(guint64 usec)
+{
+    guint msb;
+
+    if (usec < 4)
+        return usec;
+    msb = 63 - __builtin_clzll(usec);
+    if (msb >= LATENCY_MAX_BITS)
+        return NR_LATENCY_BUCKETS - 1;
+
+    return (msb - 1) * 4 + ((usec >> (msb - 2)) & 3);
+}
+
+/* the largest value falling into the bucket */
+static gint64
+latency_bucket_limit(guint bucket)
+{
+    guint msb = bucket / 4 + 1;
+
+    if (bucket < 4)
+        return bucket;
+
+    return ((gint64)(4 + bucket % 4 + 1) << (msb - 2)) - 1;
+}
+
+void ipcam_itrain_stats_add(IpcamITrainStatId id, gint64 value)
+{
+    g_return_if_fail(id < NR_ITRAIN_STATS);
+
+    __atomic_add_fetch(&stat_values[id], value, __ATOMIC_RELAXED);
+}
+
+void ipcam_itrain_stats_set(IpcamITrainStatId id, gint64 value)
+{
+    g_return_if_fail(id < NR_ITRAIN_STATS);
+
+    __atomic_store_n(&stat_values[id], value, __ATOMIC_RELAXED);
+}
+
+gint64 ipcam_itrain_stats_get(IpcamITrainStatId id)
+{
+    g_return_val_if_fail(id < NR_ITRAIN_STATS, 0);
+
+    return __atomic_load_n(&stat_values[id], __ATOMIC_RELAXED);
+}
+
+void ipcam_itrain_stats_latency(IpcamITrainLatencyId id, gint64 usec)
+{
+    IpcamITrainLatency *latency;
+    gint64 max;
+
+    g_return_if_fail(id < NR_ITRAIN_LATENCIES);
+
+    latency = &latencies[id];
+    usec = MAX(usec, 0);
+    __atomic_add_fetch(&latency->buckets[latency_bucket(usec)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&latency->count, 1, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&latency->max, __ATOMIC_RELAXED);
+    while (usec > max &&
+           !__atomic_compare_exchange_n(&latency->max, &max, usec, TRUE,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+gint64 ipcam_itrain_stats_latency_count(IpcamITrainLatencyId id)
+{
+    g_return_val_if_fail(id < NR_ITRAIN_LATENCIES, 0);
+
+    return __atomic_load_n(&latencies[id].count, __ATOMIC_RELAXED);
+}
+
+/* 1000 permille is the exact maximum */
+gint64 ipcam_itrain_stats_latency_percentile(IpcamITrainLatencyId id, guint permille)
+{
+    IpcamITrainLatency *latency;
+    gint64 count, rank, seen = 0;
+    guint i;
+
+    g_return_val_if_fail(id < NR_ITRAIN_LATENCIES, 0);
+
+    latency = &latencies[id];
+    count = __atomic_load_n(&latency->count, __ATOMIC_RELAXED);
+    if (count == 0)
+        return 0;
+    if (permille >= 1000)
+        return __atomic_load_n(&latency->max, __ATOMIC_RELAXED);
+
+    rank = (count * permille + 999) / 1000;
+    for (i = 0; i < NR_LATENCY_BUCKETS; i++) {
+        seen += __atomic_load_n(&latency->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= MAX(rank, 1))
+            return MIN(latency_bucket_limit(i), __atomic_load_n(&latency->max, __ATOMIC_RELAXED));
+    }
+
+    return __atomic_load_n(&latency->max, __ATOMIC_RELAXED);
+}
+
+void ipcam_itrain_stats_dump(GString *out)
+{
+    int i;
+
+    for (i = 0; i < NR_ITRAIN_STATS; i++)
+        g_string_append_printf(out, "%s %lld\n", stat_names[i],
+                               (long long)ipcam_itrain_stats_get(i));
+    for (i = 0; i < NR_ITRAIN_LATENCIES; i++) {
+        g_string_append_printf(out, "%s.count %lld\n", latency_names[i],
+                               (long long)ipcam_itrain_stats_latency_count(i));
+        g_string_append_printf(out, "%s.p50_us %lld\n", latency_names[i],
+                               (long long)ipcam_itrain_stats_latency_percentile(i, 500));
+        g_string_append_printf(out, "%s.p99_us %lld\n", latency_names[i],
+                               (long long)ipcam_itrain_stats_latency_percentile(i, 990));
+        g_string_append_printf(out, "%s.p999_us %lld\n", latency_names[i],
+                               (long long)ipcam_itrain_stats_latency_percentile(i, 999));
+        g_string_append_printf(out, "%s.max_us %lld\n", latency_names[i],
+                               (long long)ipcam_itrain_stats_latency_percentile(i, 1000));
+    }
+    ipcam_itrain_mem_dump(out);
+}
+
+gboolean ipcam_itrain_stats_write(const gchar *path)
+{
+    GString *out = g_string_sized_new(1024);
+    gboolean ret;
+
+    ipcam_itrain_stats_dump(out);
+    ret = g_file_set_contents(path, out->str, out->len, NULL);
+    g_string_free(out, TRUE);
+
+    return ret;
+}
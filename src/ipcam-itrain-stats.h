@@ -0,0 +1,106 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-stats.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_STATS_H_
+#define _IPCAM_ITRAIN_STATS_H_
+
+#include <glib.h>
+
+/* X(id, name) */
+#define ITRAIN_STATS(X)                                         \
+    X(STARTUP_STATE,            "startup.state")                \
+    X(STARTUP_RETRIES,          "startup.retries")              \
+    X(STARTUP_TIME_TO_ACCEPT,   "startup.time_to_accept_ms")    \
+    X(STARTUP_TIME_TO_READY,    "startup.time_to_ready_ms")     \
+    X(OCCLUSION_NOTICES,        "occlusion.notices")            \
+    X(OCCLUSION_REPORTS,        "occlusion.reports")            \
+    X(VIDEO_LOSS,               "video.loss")                   \
+    X(VIDEO_RECOVER,            "video.recover")                \
+    X(IO_SYSCALLS,              "io.syscalls")                  \
+    X(TIMER_CHECKED,            "timer.checked")                \
+    X(TIMER_FIRED,              "timer.fired")                  \
+    X(HEARTBEAT_SENT,           "heartbeat.sent")               \
+    X(HEARTBEAT_SKIPPED,        "heartbeat.skipped")            \
+    X(CONN_ACTIVE,              "conn.active")                  \
+    X(CONN_ACCEPTED,            "conn.accepted")                \
+    X(CONN_REFUSED,             "conn.refused")                 \
+    X(CONN_REFUSED_PER_IP,      "conn.refused_per_ip")          \
+    X(CONN_EVICTED,             "conn.evicted")                 \
+    X(CONN_ACCEPT_ERRORS,       "conn.accept_errors")           \
+    X(CONN_OUTPUT_QUEUED,       "conn.output_queued")           \
+    X(CONN_OUTPUT_OVERFLOW,     "conn.output_overflow")         \
+    X(GATEWAY_UNROUTED,         "gateway.unrouted")             \
+    X(GATEWAY_REJECTED,         "gateway.rejected")             \
+    X(THROTTLE_DROPPED,         "throttle.dropped")             \
+    X(THROTTLE_DEFERRED,        "throttle.deferred")            \
+    X(THROTTLE_REPLACED,        "throttle.replaced")            \
+    X(THROTTLE_REPLAYED,        "throttle.replayed")            \
+    X(OSD_RECEIVED,             "osd.received")                 \
+    X(OSD_INVALID,              "osd.invalid")                  \
+    X(OSD_OVERLAYS,             "osd.overlays")                 \
+    X(OSD_DROPPED,              "osd.dropped")                  \
+    X(OSD_PUBLISHED,            "osd.published")                \
+    X(OSD_QUEUE_DEPTH,          "osd.queue_depth")              \
+    X(OSD_FEED_COALESCED,       "osd.feed_coalesced")           \
+    X(SZYC_WRITES,              "szyc.writes")                  \
+    X(SZYC_UNCHANGED,           "szyc.unchanged")               \
+    X(LOCAL_CLIENTS,            "local.clients")                \
+    X(LOCAL_REFUSED,            "local.refused")                \
+    X(LOCAL_DROPPED,            "local.dropped")                \
+    X(LOG_LOST,                 "log.lost")
+
+typedef enum
+{
+#define ITRAIN_STAT_ENUM(id, name) ITRAIN_STAT_##id,
+    ITRAIN_STATS(ITRAIN_STAT_ENUM)
+#undef ITRAIN_STAT_ENUM
+    NR_ITRAIN_STATS
+} IpcamITrainStatId;
+
+/*
+ * Latency distributions of the fault path, usec.  Dumped as count,
+ * p50, p99, p999 and max; the percentiles are bucket upper bounds,
+ * within 25% of the real value.
+ *
+ *   wakeup: notice written to the pipe until the server thread reads it
+ *   timer:  debounce deadline until the transition is handled
+ *   fanout: first until last fault event written to the clients
+ */
+/* X(id, name) */
+#define ITRAIN_LATENCIES(X)                                     \
+    X(WAKEUP,                   "latency.wakeup")               \
+    X(TIMER,                    "latency.timer")                \
+    X(FANOUT,                   "latency.fanout")
+
+typedef enum
+{
+#define ITRAIN_LATENCY_ENUM(id, name) ITRAIN_LATENCY_##id,
+    ITRAIN_LATENCIES(ITRAIN_LATENCY_ENUM)
+#undef ITRAIN_LATENCY_ENUM
+    NR_ITRAIN_LATENCIES
+} IpcamITrainLatencyId;
+
+void     ipcam_itrain_stats_add(IpcamITrainStatId id, gint64 value);
+void     ipcam_itrain_stats_set(IpcamITrainStatId id, gint64 value);
+gint64   ipcam_itrain_stats_get(IpcamITrainStatId id);
+void     ipcam_itrain_stats_latency(IpcamITrainLatencyId id, gint64 usec);
+gint64   ipcam_itrain_stats_latency_count(IpcamITrainLatencyId id);
+gint64   ipcam_itrain_stats_latency_percentile(IpcamITrainLatencyId id, guint permille);
+void     ipcam_itrain_stats_dump(GString *out);
+gboolean ipcam_itrain_stats_write(const gchar *path);
+
+static inline void ipcam_itrain_stats_inc(IpcamITrainStatId id)
+{
+    ipcam_itrain_stats_add(id, 1);
+}
+
+static inline void ipcam_itrain_stats_dec(IpcamITrainStatId id)
+{
+    ipcam_itrain_stats_add(id, -1);
+}
+
+#endif /* _IPCAM_ITRAIN_STATS_H_ */
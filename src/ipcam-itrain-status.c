@@ -0,0 +1,149 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-status.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ipcam-itrain-status.h"
+
+#define STATUS_MAP_SIZE     4096
+
+static IpcamITrainStatusPage *status_page;
+
+/* the server thread and the main loop both update the page */
+static GMutex status_mutex;
+
+static void status_write_begin(void)
+{
+    g_mutex_lock(&status_mutex);
+    __atomic_store_n(&status_page->seq, status_page->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void status_write_end(void)
+{
+    __atomic_store_n(&status_page->seq, status_page->seq + 1, __ATOMIC_RELEASE);
+    g_mutex_unlock(&status_mutex);
+}
+
+/*
+ * The page is built in a temporary file and renamed into place, readers
+ * never see it half initialized and a previous instance still draining
+ * keeps writing to its own copy.
+ */
+gboolean ipcam_itrain_status_start(const gchar *path)
+{
+    IpcamITrainStatusPage *page;
+    gchar *tmp_path;
+    int fd;
+
+    g_return_val_if_fail(path != NULL, FALSE);
+    g_return_val_if_fail(status_page == NULL, FALSE);
+
+    /* a fresh name, never a file or link someone placed there */
+    tmp_path = g_strdup_printf("%s.XXXXXX", path);
+    fd = g_mkstemp_full(tmp_path, O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        g_print("ITrain: failed to create status page %s: %s\n", tmp_path, strerror(errno));
+        g_free(tmp_path);
+        return FALSE;
+    }
+    if (ftruncate(fd, STATUS_MAP_SIZE) != 0) {
+        g_print("ITrain: failed to size status page %s\n", tmp_path);
+        close(fd);
+        unlink(tmp_path);
+        g_free(tmp_path);
+        return FALSE;
+    }
+
+    page = mmap(NULL, STATUS_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        g_print("ITrain: failed to map status page %s: %s\n", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        g_free(tmp_path);
+        return FALSE;
+    }
+
+    page->version = ITRAIN_STATUS_VERSION;
+    page->size = sizeof(IpcamITrainStatusPage);
+    page->pid = getpid();
+    memcpy(page->magic, ITRAIN_STATUS_MAGIC, sizeof(page->magic));
+
+    if (rename(tmp_path, path) != 0) {
+        g_print("ITrain: failed to publish status page %s: %s\n", path, strerror(errno));
+        munmap(page, STATUS_MAP_SIZE);
+        unlink(tmp_path);
+        g_free(tmp_path);
+        return FALSE;
+    }
+    g_free(tmp_path);
+
+    status_page = page;
+
+    return TRUE;
+}
+
+void ipcam_itrain_status_stop(void)
+{
+    if (!status_page)
+        return;
+
+    status_write_begin();
+    status_page->pid = 0;
+    status_write_end();
+
+    munmap(status_page, STATUS_MAP_SIZE);
+    status_page = NULL;
+}
+
+void ipcam_itrain_status_set_state(gboolean occlusion_stat, gboolean loss_stat,
+                                   guint32 regions, gint64 time)
+{
+    if (!status_page)
+        return;
+
+    status_write_begin();
+    status_page->occlusion_stat = occlusion_stat;
+    status_page->loss_stat = loss_stat;
+    status_page->regions = regions;
+    status_page->event_time = time;
+    status_write_end();
+}
+
+void ipcam_itrain_status_set_identity(const gchar *train_num,
+                                      const gchar *carriage_num,
+                                      const gchar *position_num,
+                                      gint64 time)
+{
+    if (!status_page)
+        return;
+
+    status_write_begin();
+    strncpy(status_page->train_num, train_num ? train_num : "",
+            sizeof(status_page->train_num) - 1);
+    strncpy(status_page->carriage_num, carriage_num ? carriage_num : "",
+            sizeof(status_page->carriage_num) - 1);
+    strncpy(status_page->position_num, position_num ? position_num : "",
+            sizeof(status_page->position_num) - 1);
+    status_page->event_time = time;
+    status_write_end();
+}
+
+void ipcam_itrain_status_set_connections(guint connections)
+{
+    if (!status_page)
+        return;
+
+    status_write_begin();
+    status_page->connections = connections;
+    status_write_end();
+}
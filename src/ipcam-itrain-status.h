@@ -0,0 +1,70 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-status.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_STATUS_H_
+#define _IPCAM_ITRAIN_STATUS_H_
+
+#include <string.h>
+#include <glib.h>
+
+/*
+ * Status page for local watchdogs: a small shared file mapping, usually
+ * under /dev/shm, holding the fault state and the identity.  Every
+ * update is wrapped in a seqlock so readers poll it with plain loads,
+ * see ipcam_itrain_status_read().  A restarted itrain replaces the file,
+ * the old instance clears pid when it stops so readers know to reopen.
+ */
+
+#define ITRAIN_STATUS_MAGIC     "ITST"
+#define ITRAIN_STATUS_VERSION   1
+
+typedef struct IpcamITrainStatusPage
+{
+    gchar   magic[4];
+    guint16 version;
+    guint16 size;           /* of this structure */
+    guint32 seq;            /* odd while an update is in progress */
+    guint32 pid;            /* of the writer, 0 once it stopped */
+    guint8  occlusion_stat;
+    guint8  loss_stat;
+    guint8  reserved[2];
+    guint32 regions;        /* debounced occlusion, bit n is region n */
+    guint32 connections;
+    guint32 reserved2;
+    gint64  event_time;     /* CLOCK_MONOTONIC usec of the last state or identity change */
+    gchar   train_num[16];
+    gchar   carriage_num[16];
+    gchar   position_num[16];
+} IpcamITrainStatusPage;
+
+gboolean ipcam_itrain_status_start(const gchar *path);
+void     ipcam_itrain_status_stop(void);
+void     ipcam_itrain_status_set_state(gboolean occlusion_stat, gboolean loss_stat,
+                                       guint32 regions, gint64 time);
+void     ipcam_itrain_status_set_identity(const gchar *train_num,
+                                          const gchar *carriage_num,
+                                          const gchar *position_num,
+                                          gint64 time);
+void     ipcam_itrain_status_set_connections(guint connections);
+
+/* consistent copy of a mapped page, FALSE once its writer is gone */
+static inline gboolean ipcam_itrain_status_read(const IpcamITrainStatusPage *page,
+                                                IpcamITrainStatusPage *copy)
+{
+    guint32 seq;
+
+    do {
+        while ((seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        memcpy(copy, page, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq);
+
+    return copy->pid != 0;
+}
+
+#endif /* _IPCAM_ITRAIN_STATUS_H_ */
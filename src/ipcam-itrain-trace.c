@@ -0,0 +1,118 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-trace.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ipcam-itrain-trace.h"
+
+IpcamITrainTraceHeader *ipcam_itrain_trace;
+
+static gsize trace_map_size;
+static IpcamITrainTraceRecord *trace_records;
+
+/*
+ * Map size bytes of path as the trace ring.  An existing trace of the
+ * same geometry is continued, anything else is started over.
+ */
+gboolean ipcam_itrain_trace_start(const gchar *path, gsize size)
+{
+    IpcamITrainTraceHeader *header;
+    guint32 nr_records;
+    struct stat st;
+    int fd;
+
+    g_return_val_if_fail(path != NULL, FALSE);
+    g_return_val_if_fail(ipcam_itrain_trace == NULL, FALSE);
+
+    nr_records = (size - ITRAIN_TRACE_HEADER_SIZE) / sizeof(IpcamITrainTraceRecord);
+    if (size <= ITRAIN_TRACE_HEADER_SIZE || nr_records == 0) {
+        g_print("ITrain: trace size %" G_GSIZE_FORMAT " too small\n", size);
+        return FALSE;
+    }
+    size = ITRAIN_TRACE_HEADER_SIZE + nr_records * sizeof(IpcamITrainTraceRecord);
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        g_print("ITrain: failed to open trace file %s: %s\n", path, strerror(errno));
+        return FALSE;
+    }
+    /* allocate the blocks now, a full disk must not SIGBUS us later */
+    if (fstat(fd, &st) != 0 || (st.st_size != size &&
+        (ftruncate(fd, 0) != 0 || posix_fallocate(fd, 0, size) != 0))) {
+        g_print("ITrain: failed to size trace file %s\n", path);
+        close(fd);
+        return FALSE;
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        g_print("ITrain: failed to map trace file %s: %s\n", path, strerror(errno));
+        return FALSE;
+    }
+
+    if (memcmp(header->magic, ITRAIN_TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != ITRAIN_TRACE_VERSION ||
+        header->record_size != sizeof(IpcamITrainTraceRecord) ||
+        header->nr_records != nr_records) {
+        memset(header, 0, size);
+        header->version = ITRAIN_TRACE_VERSION;
+        header->record_size = sizeof(IpcamITrainTraceRecord);
+        header->nr_records = nr_records;
+        memcpy(header->magic, ITRAIN_TRACE_MAGIC, sizeof(header->magic));
+    }
+
+    trace_map_size = size;
+    trace_records = (IpcamITrainTraceRecord *)((guint8 *)header + ITRAIN_TRACE_HEADER_SIZE);
+    __atomic_store_n(&ipcam_itrain_trace, header, __ATOMIC_RELEASE);
+
+    return TRUE;
+}
+
+void ipcam_itrain_trace_stop(void)
+{
+    IpcamITrainTraceHeader *header = ipcam_itrain_trace;
+
+    if (!header)
+        return;
+
+    ipcam_itrain_trace = NULL;
+    munmap(header, trace_map_size);
+    trace_records = NULL;
+}
+
+void ipcam_itrain_trace_pdu(const IpcamITrainTraceFlow *flow,
+                            IpcamITrainTraceDirection direction,
+                            gconstpointer data, gsize length)
+{
+    IpcamITrainTraceHeader *header = ipcam_itrain_trace;
+    IpcamITrainTraceRecord *record;
+    guint64 index;
+
+    if (!header)
+        return;
+
+    index = __atomic_fetch_add(&header->head, 1, __ATOMIC_RELAXED);
+    record = &trace_records[index % header->nr_records];
+
+    /* readers skip the record while it is rewritten */
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    record->time = g_get_real_time();
+    record->flow = *flow;
+    record->direction = direction;
+    record->length = MIN(length, G_MAXUINT16);
+    memcpy(record->data, data, MIN(length, ITRAIN_TRACE_SNAPLEN));
+
+    __atomic_store_n(&record->seq, index + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,76 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-itrain-trace.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_ITRAIN_TRACE_H_
+#define _IPCAM_ITRAIN_TRACE_H_
+
+#include <glib.h>
+
+/*
+ * Opt-in capture of the PDUs exchanged with each client into a ring of
+ * fixed size slots in a shared file mapping.  Recording is a memcpy into
+ * the page cache, so the last few minutes of traffic survive a crash of
+ * the process.  itrain-tracedump turns the file into pcapng.
+ */
+
+#define ITRAIN_TRACE_MAGIC          "ITTR"
+#define ITRAIN_TRACE_VERSION        1
+#define ITRAIN_TRACE_SNAPLEN        476     /* PDU bytes kept per record */
+#define ITRAIN_TRACE_HEADER_SIZE    64      /* records start here */
+
+typedef enum
+{
+    ITRAIN_TRACE_IN,
+    ITRAIN_TRACE_OUT
+} IpcamITrainTraceDirection;
+
+/* what identifies a connection in the trace, addresses in network order */
+typedef struct IpcamITrainTraceFlow
+{
+    guint32 conn_id;
+    guint32 peer_addr;
+    guint32 local_addr;
+    guint16 peer_port;
+    guint16 local_port;
+} IpcamITrainTraceFlow;
+
+/* seq is index + 1 once the record is complete, 0 while it is written */
+typedef struct IpcamITrainTraceRecord
+{
+    guint64 seq;
+    gint64  time;       /* usec since the epoch */
+    IpcamITrainTraceFlow flow;
+    guint8  direction;
+    guint8  reserved;
+    guint16 length;     /* of the PDU, only SNAPLEN bytes are kept */
+    guint8  data[ITRAIN_TRACE_SNAPLEN];
+} IpcamITrainTraceRecord;
+
+typedef struct IpcamITrainTraceHeader
+{
+    gchar   magic[4];
+    guint16 version;
+    guint16 record_size;
+    guint32 nr_records;
+    guint32 reserved;
+    guint64 head;       /* records written so far */
+} IpcamITrainTraceHeader;
+
+extern IpcamITrainTraceHeader *ipcam_itrain_trace;
+
+gboolean ipcam_itrain_trace_start(const gchar *path, gsize size);
+void     ipcam_itrain_trace_stop(void);
+void     ipcam_itrain_trace_pdu(const IpcamITrainTraceFlow *flow,
+                                IpcamITrainTraceDirection direction,
+                                gconstpointer data, gsize length);
+
+static inline gboolean ipcam_itrain_trace_enabled(void)
+{
+    return ipcam_itrain_trace != NULL;
+}
+
+#endif /* _IPCAM_ITRAIN_TRACE_H_ */
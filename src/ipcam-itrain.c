@@ -2,18 +2,60 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <malloc.h>
 #include <json-glib/json-glib.h>
 #include <request_message.h>
 #include "ipcam-itrain.h"
 
 #include "ipcam-itrain-server.h"
 #include "ipcam-itrain-event-handler.h"
+#include "ipcam-itrain-snapshot.h"
+#include "ipcam-itrain-stats.h"
+#include "ipcam-itrain-log.h"
+#include "ipcam-itrain-trace.h"
+#include "ipcam-itrain-mem.h"
+#include "ipcam-itrain-status.h"
+#include "ipcam-itrain-rt.h"
+#include "ipcam-itrain-camera.h"
+
+#define STARTUP_REQUEST_TIMEOUT     3                       /* seconds */
+#define STARTUP_DEFAULT_DEADLINE    30                      /* seconds */
+#define STARTUP_BACKOFF_MIN         (500 * 1000)            /* usec */
+#define STARTUP_BACKOFF_MAX         (30 * G_USEC_PER_SEC)
+#define STATS_WRITE_INTERVAL        (5 * G_USEC_PER_SEC)
+
+enum
+{
+    STARTUP_BASE_INFO,
+    STARTUP_SZYC,
+    NR_STARTUP_REQUESTS
+};
+
+typedef struct StartupRequest
+{
+    gboolean done;
+    gboolean in_flight;
+    guint    attempts;
+    gint64   next_attempt;
+} StartupRequest;
 
 typedef struct _IpcamITrainPrivate
 {
     IpcamITrainServer       *itrain_server;
     GMutex                  prop_mutex;
     GHashTable              *cached_properties;
+    const gchar             *snapshot_path;
+    const gchar             *stats_path;
+    gint64                  next_stats_write;
+    IpcamITrainReadiness    readiness;
+    StartupRequest          startup[NR_STARTUP_REQUESTS];
+    gint64                  start_time;
+    gint64                  startup_deadline;
+    const gchar             *video_liveness_event;
+    gint64                  video_frames;
+    IpcamITrainCameras      *cameras;       /* gateway mode */
+    IpcamITrainCamera       *local_camera;  /* the one our media service is about */
+    gboolean                handed_over;
 } IpcamITrainPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE(IpcamITrain, ipcam_itrain, IPCAM_BASE_APP_TYPE);
@@ -22,14 +64,59 @@ static void ipcam_itrain_before_start(IpcamBaseService *base_service);
 static void ipcam_itrain_in_loop(IpcamBaseService *base_service);
 static void base_info_message_handler(GObject *obj, IpcamMessage *msg, gboolean timeout);
 static void szyc_message_handler(GObject *obj, IpcamMessage *msg, gboolean timeout);
+static void ipcam_itrain_load_snapshot(IpcamITrain *itrain);
+static void ipcam_itrain_save_snapshot(IpcamITrain *itrain);
+static void ipcam_itrain_apply_protocol(IpcamITrain *itrain);
+static void ipcam_itrain_send_startup_request(IpcamITrain *itrain, guint id);
+static void ipcam_itrain_startup_request_done(IpcamITrain *itrain, guint id, gboolean success);
+static void ipcam_itrain_update_readiness(IpcamITrain *itrain);
+
+static const gchar *base_info_items[] = {
+    "device_name", "comment", "location", "hardware", "firmware",
+    "manufacturer", "model", "serial", "device_type", NULL
+};
+
+static const gchar *szyc_items[] = {
+    "train_num", "carriage_num", "position_num", NULL
+};
+
+static const struct {
+    const gchar *action;
+    const gchar **items;
+    void (*callback)(GObject *obj, IpcamMessage *msg, gboolean timeout);
+} startup_requests[NR_STARTUP_REQUESTS] = {
+    [STARTUP_BASE_INFO] = { "get_base_info", base_info_items, base_info_message_handler },
+    [STARTUP_SZYC]      = { "get_szyc",      szyc_items,      szyc_message_handler },
+};
+
+/* keys and values are heap blocks of any type, charge what they really take */
+static gsize ipcam_itrain_property_size(gpointer key, gpointer value)
+{
+    return malloc_usable_size(key) + malloc_usable_size(value);
+}
+
+static void ipcam_itrain_uncharge_properties(GHashTable *properties)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, properties);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        ipcam_itrain_mem_uncharge(ITRAIN_MEM_PROPERTY, ipcam_itrain_property_size(key, value));
+}
 
 static void ipcam_itrain_finalize(GObject *object)
 {
     IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(IPCAM_ITRAIN(object));
 
     g_object_unref(priv->itrain_server);
+    if (priv->cameras)
+        ipcam_itrain_cameras_free(priv->cameras);
+    ipcam_itrain_trace_stop();
+    ipcam_itrain_status_stop();
 
     g_mutex_lock(&priv->prop_mutex);
+    ipcam_itrain_uncharge_properties(priv->cached_properties);
     g_hash_table_destroy(priv->cached_properties);
     g_mutex_unlock(&priv->prop_mutex);
     g_mutex_clear(&priv->prop_mutex);
@@ -43,6 +130,7 @@ static void ipcam_itrain_init(IpcamITrain *self)
 
     priv->cached_properties = g_hash_table_new_full(g_str_hash, g_str_equal,
                                                     g_free, g_free);
+    priv->readiness = IPCAM_ITRAIN_STARTING;
 }
 
 static void ipcam_itrain_class_init(IpcamITrainClass *klass)
@@ -62,75 +150,334 @@ static void ipcam_itrain_before_start(IpcamBaseService *base_service)
     const gchar *addr = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:address");
     const gchar *port = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:port");
 	const gchar *osd_port = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:osd-port");
-	JsonBuilder *builder;
-	const gchar *token = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "token");
-	IpcamRequestMessage *req_msg;
+    const gchar *dctx_port = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:dctx-port");
+    const gchar *dttx_port = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:dttx-port");
+    const gchar *auto_detect = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:auto-detect");
+    const gchar *startup_timeout = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:startup-timeout");
+    const gchar *handoff_path = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:handoff-socket");
+    const gchar *handoff_drain = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:handoff-drain");
+    const gchar *mcast_interfaces = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:mcast-interfaces");
+    const gchar *occlusion_on_delay = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:occlusion-on-delay");
+    const gchar *occlusion_off_delay = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:occlusion-off-delay");
+    const gchar *video_loss_timeout = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:video-loss-timeout");
+    const gchar *video_loss_event = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:video-loss-event");
+    const gchar *io_backend = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:io-backend");
+    const gchar *backlog = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:backlog");
+    const gchar *max_connections = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:max-connections");
+    const gchar *max_per_ip = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:max-per-ip");
+    const gchar *overload_policy = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:overload-policy");
+    const gchar *throttle_interval = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:throttle-interval");
+    const gchar *throttle_burst = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:throttle-burst");
+    const gchar *throttle_policy = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:throttle-policy");
+    const gchar *osd_queue_depth = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:osd-queue-depth");
+    const gchar *osd_feed_interval = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:osd-feed-interval");
+    const gchar *local_socket = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:local-socket");
+    const gchar *local_uids = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:local-uids");
+    const gchar *status_page = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:status-page");
+    const gchar *log_file = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:log-file");
+    const gchar *log_crash_file = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:log-crash-file");
+    const gchar *log_levels = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:log-levels");
+    const gchar *trace_file = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:trace-file");
+    const gchar *trace_size = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:trace-size");
+    const gchar *server_cpus = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:low_latency:server-cpus");
+    const gchar *osd_cpus = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:low_latency:osd-cpus");
+    const gchar *fifo_priority = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:low_latency:fifo-priority");
+    const gchar *lock_memory = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:low_latency:mlockall");
+    const gchar *busy_poll = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:low_latency:busy-poll");
+    const gchar *tcp_nodelay = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:low_latency:tcp-nodelay");
+    const gchar *tcp_quickack = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:low_latency:tcp-quickack");
+    const gchar *gateway_cameras = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:gateway-cameras");
+    const gchar *gateway_local = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:gateway-local-camera");
+    guint loss_timeout;
+    int i;
+
+    priv->start_time = g_get_monotonic_time();
+    priv->startup_deadline = priv->start_time +
+        (startup_timeout ? strtoul(startup_timeout, NULL, 0) : STARTUP_DEFAULT_DEADLINE) * G_USEC_PER_SEC;
+    priv->stats_path = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:stats-file");
+
+    if (log_levels && !ipcam_itrain_log_set_levels(log_levels))
+        g_print("ITrain: invalid log levels: %s\n", log_levels);
+    ipcam_itrain_log_start(log_file, log_crash_file);
+    if (trace_file)
+        ipcam_itrain_trace_start(trace_file,
+                                 (trace_size ? strtoul(trace_size, NULL, 0) : 1024) * 1024);
+
+    if (status_page)
+        ipcam_itrain_status_start(status_page);
 
     if (!addr || !port)
     {
         g_critical("address and port must be specified.\n");
         return;
     }
+
+    /* before the threads are created, their stacks are locked as well */
+    if (g_strcmp0(lock_memory, "true") == 0)
+        ipcam_itrain_rt_lock_memory();
+
+    /* restore the last known identity before the server starts */
+    priv->snapshot_path = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:snapshot");
+    ipcam_itrain_load_snapshot(itrain);
+
+    /* the server sets up one context per camera */
+    if (gateway_cameras) {
+        priv->cameras = ipcam_itrain_cameras_load(gateway_cameras);
+        if (priv->cameras)
+            g_print("ITrain: gateway for %u cameras from %s.\n",
+                    priv->cameras->nr_cameras, gateway_cameras);
+        else
+            g_print("ITrain: no camera in %s, serving our own identity.\n", gateway_cameras);
+    }
+    if (priv->cameras && gateway_local) {
+        priv->local_camera = ipcam_itrain_cameras_lookup(priv->cameras, gateway_local);
+        if (!priv->local_camera)
+            g_print("ITrain: no camera %s in %s.\n", gateway_local, gateway_cameras);
+    }
+
+    /* nothing would feed the watchdog without the event */
+    loss_timeout = video_loss_event && video_loss_timeout ? strtoul(video_loss_timeout, NULL, 0) : 0;
+    /* nor, in gateway mode, with the stream notices attributed to no camera */
+    if (priv->cameras && !priv->local_camera && loss_timeout) {
+        g_print("ITrain: no gateway-local-camera, video loss watchdog disabled.\n");
+        loss_timeout = 0;
+    }
+
     priv->itrain_server = g_object_new(IPCAM_TYPE_ITRAIN_SERVER,
                                        "itrain", itrain,
                                        "address", addr,
                                        "port", strtoul(port, NULL, 0),
+                                       "dctx-port", dctx_port ? strtoul(dctx_port, NULL, 0) : 0,
+                                       "dttx-port", dttx_port ? strtoul(dttx_port, NULL, 0) : 0,
+                                       "auto-detect", g_strcmp0(auto_detect, "true") == 0,
                                        "osd-port", strtoul(osd_port, NULL, 0),
+                                       "handoff-path", handoff_path,
+                                       "mcast-interfaces", mcast_interfaces ? mcast_interfaces : "eth0",
+                                       "occlusion-on-delay", occlusion_on_delay ? strtoul(occlusion_on_delay, NULL, 0) : 500,
+                                       "occlusion-off-delay", occlusion_off_delay ? strtoul(occlusion_off_delay, NULL, 0) : 2000,
+                                       "video-loss-timeout", loss_timeout,
+                                       "io-backend", io_backend ? io_backend : "epoll",
+                                       "backlog", backlog ? strtoul(backlog, NULL, 0) : 64,
+                                       "max-connections", max_connections ? strtoul(max_connections, NULL, 0) : 0,
+                                       "max-per-ip", max_per_ip ? strtoul(max_per_ip, NULL, 0) : 0,
+                                       "overload-policy", overload_policy ? overload_policy : "refuse",
+                                       "throttle-interval", throttle_interval ? strtoul(throttle_interval, NULL, 0) : 0,
+                                       "throttle-burst", throttle_burst ? strtoul(throttle_burst, NULL, 0) : 4,
+                                       "throttle-policy", throttle_policy ? throttle_policy : "drop",
+                                       "osd-queue-depth", osd_queue_depth ? strtoul(osd_queue_depth, NULL, 0) : 8,
+                                       "osd-feed-interval", osd_feed_interval ? strtoul(osd_feed_interval, NULL, 0) : 200,
+                                       "drain-timeout", handoff_drain ? strtoul(handoff_drain, NULL, 0) : 10,
+                                       "local-socket", local_socket,
+                                       "local-uids", local_uids,
+                                       "server-cpus", server_cpus,
+                                       "osd-cpus", osd_cpus,
+                                       "fifo-priority", fifo_priority ? strtoul(fifo_priority, NULL, 0) : 0,
+                                       "busy-poll", busy_poll ? strtoul(busy_poll, NULL, 0) : 0,
+                                       "tcp-nodelay", g_strcmp0(tcp_nodelay, "true") == 0,
+                                       "tcp-quickack", g_strcmp0(tcp_quickack, "true") == 0,
                                        NULL);
+    ipcam_itrain_apply_protocol(itrain);
 
     ipcam_base_app_register_notice_handler(IPCAM_BASE_APP(itrain), "video_occlusion_event", IPCAM_TYPE_ITRAIN_EVENT_HANDLER);
     ipcam_base_app_register_notice_handler(IPCAM_BASE_APP(itrain), "set_base_info", IPCAM_TYPE_ITRAIN_EVENT_HANDLER);
     ipcam_base_app_register_notice_handler(IPCAM_BASE_APP(itrain), "set_szyc", IPCAM_TYPE_ITRAIN_EVENT_HANDLER);
 
-	/* Request the Base Information */
-	builder = json_builder_new();
-	json_builder_begin_object(builder);
-	json_builder_set_member_name(builder, "items");
-	json_builder_begin_array(builder);
-	json_builder_add_string_value(builder, "device_name");
-	json_builder_add_string_value(builder, "comment");
-	json_builder_add_string_value(builder, "location");
-	json_builder_add_string_value(builder, "hardware");
-	json_builder_add_string_value(builder, "firmware");
-	json_builder_add_string_value(builder, "manufacturer");
-	json_builder_add_string_value(builder, "model");
-	json_builder_add_string_value(builder, "serial");
-    json_builder_add_string_value(builder, "device_type");
-	json_builder_end_array(builder);
-	json_builder_end_object(builder);
-	req_msg = g_object_new(IPCAM_REQUEST_MESSAGE_TYPE,
-	                       "action", "get_base_info",
-	                       "body", json_builder_get_root(builder),
-	                       NULL);
-	ipcam_base_app_send_message(IPCAM_BASE_APP(itrain), IPCAM_MESSAGE(req_msg),
-	                            "iconfig", token,
-	                            base_info_message_handler, 60);
-	g_object_unref(req_msg);
-	g_object_unref(builder);
+    /* stream liveness notices from imedia_rtsp_pub feed the video loss watchdog */
+    priv->video_liveness_event = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "itrain:video-loss-event");
+    priv->video_frames = -1;
+    if (priv->video_liveness_event)
+        ipcam_base_app_register_notice_handler(IPCAM_BASE_APP(itrain), priv->video_liveness_event, IPCAM_TYPE_ITRAIN_EVENT_HANDLER);
+
+    /* issue all startup requests in parallel */
+    for (i = 0; i < NR_STARTUP_REQUESTS; i++)
+        ipcam_itrain_send_startup_request(itrain, i);
+
+    ipcam_itrain_update_readiness(itrain);
+}
+
+static void ipcam_itrain_in_loop(IpcamBaseService *base_service)
+{
+    IpcamITrain *itrain = IPCAM_ITRAIN(base_service);
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+    gint64 now = g_get_monotonic_time();
+    int i;
+
+    if (!priv->itrain_server)
+        return;
+
+    /*
+     * A new instance took over our sockets and the connections are gone,
+     * main tears us down once the service loop returns.
+     */
+    if (ipcam_itrain_server_is_drained(priv->itrain_server)) {
+        if (!priv->handed_over) {
+            g_print("ITrain: handed over to the new instance, exit.\n");
+            priv->handed_over = TRUE;
+            ipcam_base_service_stop(base_service);
+        }
+        return;
+    }
+
+    for (i = 0; i < NR_STARTUP_REQUESTS; i++) {
+        StartupRequest *req = &priv->startup[i];
+
+        if (!req->done && !req->in_flight && now >= req->next_attempt)
+            ipcam_itrain_send_startup_request(itrain, i);
+    }
+
+    /* OSD datagrams are decoded on their own thread, we only publish */
+    ipcam_itrain_server_publish_osd(priv->itrain_server);
+
+    /* gateway identities changed by a notice or by a client's set_szyc */
+    if (priv->cameras && ipcam_itrain_cameras_sync(priv->cameras))
+        ipcam_itrain_server_update_identity(priv->itrain_server);
+
+    if (priv->readiness == IPCAM_ITRAIN_STARTING)
+        ipcam_itrain_update_readiness(itrain);
+
+    if (priv->stats_path && now >= priv->next_stats_write) {
+        priv->next_stats_write = now + STATS_WRITE_INTERVAL;
+        ipcam_itrain_stats_write(priv->stats_path);
+    }
+}
+
+static void ipcam_itrain_send_startup_request(IpcamITrain *itrain, guint id)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+    StartupRequest *req = &priv->startup[id];
+	const gchar *token = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "token");
+	const gchar **item;
+	JsonBuilder *builder;
+	IpcamRequestMessage *req_msg;
 
-    /* Request the SZYC Information */
 	builder = json_builder_new();
 	json_builder_begin_object(builder);
 	json_builder_set_member_name(builder, "items");
 	json_builder_begin_array(builder);
-	json_builder_add_string_value(builder, "train_num");
-	json_builder_add_string_value(builder, "carriage_num");
-	json_builder_add_string_value(builder, "position_num");
+	for (item = startup_requests[id].items; *item; item++)
+		json_builder_add_string_value(builder, *item);
 	json_builder_end_array(builder);
 	json_builder_end_object(builder);
 	req_msg = g_object_new(IPCAM_REQUEST_MESSAGE_TYPE,
-	                       "action", "get_szyc",
+	                       "action", startup_requests[id].action,
 	                       "body", json_builder_get_root(builder),
 	                       NULL);
 	ipcam_base_app_send_message(IPCAM_BASE_APP(itrain), IPCAM_MESSAGE(req_msg),
 	                            "iconfig", token,
-	                            szyc_message_handler, 60);
+	                            startup_requests[id].callback,
+	                            STARTUP_REQUEST_TIMEOUT);
 	g_object_unref(req_msg);
 	g_object_unref(builder);
+
+    req->in_flight = TRUE;
+    if (req->attempts++ > 0)
+        ipcam_itrain_stats_inc(ITRAIN_STAT_STARTUP_RETRIES);
 }
 
-static void ipcam_itrain_in_loop(IpcamBaseService *base_service)
+static void ipcam_itrain_startup_request_done(IpcamITrain *itrain, guint id, gboolean success)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+    StartupRequest *req = &priv->startup[id];
+
+    req->in_flight = FALSE;
+    if (success) {
+        req->done = TRUE;
+    }
+    else {
+        /* exponential backoff with jitter in [backoff / 2, backoff) */
+        gint64 backoff = STARTUP_BACKOFF_MIN << MIN(req->attempts - 1, 8);
+        backoff = MIN(backoff, STARTUP_BACKOFF_MAX);
+        backoff = backoff / 2 + g_random_int_range(0, backoff / 2);
+        req->next_attempt = g_get_monotonic_time() + backoff;
+        g_print("ITrain: %s timeout, retry in %d ms.\n",
+                startup_requests[id].action, (int)(backoff / 1000));
+    }
+
+    ipcam_itrain_update_readiness(itrain);
+}
+
+static void ipcam_itrain_update_readiness(IpcamITrain *itrain)
+{
+    static const gchar *readiness_names[] = {
+        "starting", "provisional", "ready", "degraded"
+    };
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+    gint64 now = g_get_monotonic_time();
+    IpcamITrainReadiness readiness;
+    gboolean protocol_known, identity_known;
+
+    protocol_known = priv->startup[STARTUP_BASE_INFO].done ||
+        ipcam_itrain_get_string_property(itrain, "base_info:model");
+    identity_known = priv->startup[STARTUP_SZYC].done ||
+        (ipcam_itrain_get_string_property(itrain, "szyc:train_num") &&
+         ipcam_itrain_get_string_property(itrain, "szyc:position_num"));
+
+    if (priv->startup[STARTUP_BASE_INFO].done && priv->startup[STARTUP_SZYC].done)
+        readiness = IPCAM_ITRAIN_READY;
+    else if (protocol_known && identity_known)
+        readiness = IPCAM_ITRAIN_PROVISIONAL;
+    else if (priv->readiness == IPCAM_ITRAIN_DEGRADED || now >= priv->startup_deadline)
+        readiness = IPCAM_ITRAIN_DEGRADED;
+    else
+        readiness = IPCAM_ITRAIN_STARTING;
+
+    if (readiness == priv->readiness)
+        return;
+
+    if (priv->readiness == IPCAM_ITRAIN_STARTING) {
+        ipcam_itrain_stats_set(ITRAIN_STAT_STARTUP_TIME_TO_ACCEPT,
+                               (now - priv->start_time) / 1000);
+        ipcam_itrain_server_set_accepting(priv->itrain_server, TRUE);
+    }
+    if (readiness == IPCAM_ITRAIN_READY)
+        ipcam_itrain_stats_set(ITRAIN_STAT_STARTUP_TIME_TO_READY,
+                               (now - priv->start_time) / 1000);
+
+    priv->readiness = readiness;
+    ipcam_itrain_stats_set(ITRAIN_STAT_STARTUP_STATE, readiness);
+    g_print("ITrain: startup state %s after %d ms.\n",
+            readiness_names[readiness], (int)((now - priv->start_time) / 1000));
+}
+
+IpcamITrainReadiness ipcam_itrain_get_readiness(IpcamITrain *itrain)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+
+    return priv->readiness;
+}
+
+/* NULL unless in gateway mode */
+IpcamITrainCameras *ipcam_itrain_get_cameras(IpcamITrain *itrain)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+
+    return priv->cameras;
+}
+
+/* the camera a notice names in gateway mode, NULL if it is about us */
+static IpcamITrainCamera *ipcam_itrain_notice_camera(IpcamITrain *itrain, JsonObject *obj)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+
+    if (!priv->cameras || !obj || !json_object_has_member(obj, "camera"))
+        return NULL;
+
+    return ipcam_itrain_cameras_lookup(priv->cameras,
+                                       json_object_get_string_member(obj, "camera"));
+}
+
+/*
+ * The camera a stream event is about in gateway mode.  Our media service
+ * does not name one, its events belong to gateway-local-camera.
+ */
+static IpcamITrainCamera *ipcam_itrain_event_camera(IpcamITrain *itrain, JsonObject *obj)
 {
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+
+    if (priv->cameras && !(obj && json_object_has_member(obj, "camera")))
+        return priv->local_camera;
+
+    return ipcam_itrain_notice_camera(itrain, obj);
 }
 
 const gpointer ipcam_itrain_get_property(IpcamITrain *itrain, const gchar *key)
@@ -145,24 +492,131 @@ const gpointer ipcam_itrain_get_property(IpcamITrain *itrain, const gchar *key)
     return ret;
 }
 
+/* a copy taken under the lock, for readers on the server thread */
+gchar *ipcam_itrain_dup_string_property(IpcamITrain *itrain, const gchar *key)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+    gchar *ret;
+
+    g_mutex_lock(&priv->prop_mutex);
+    ret = g_strdup(g_hash_table_lookup(priv->cached_properties, key));
+    g_mutex_unlock(&priv->prop_mutex);
+
+    return ret;
+}
+
 void ipcam_itrain_set_property(IpcamITrain *itrain, const gchar *key, gpointer value)
 {
     IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
 
+    gpointer old_key, old_value;
+
     g_mutex_lock(&priv->prop_mutex);
-    g_hash_table_insert(priv->cached_properties, (gpointer)key, value);
+    if (g_hash_table_lookup_extended(priv->cached_properties, key, &old_key, &old_value))
+        ipcam_itrain_mem_uncharge(ITRAIN_MEM_PROPERTY, ipcam_itrain_property_size(old_key, old_value));
+    ipcam_itrain_mem_charge(ITRAIN_MEM_PROPERTY, ipcam_itrain_property_size((gpointer)key, value));
+    g_hash_table_replace(priv->cached_properties, (gpointer)key, value);
     g_mutex_unlock(&priv->prop_mutex);
 }
 
+gboolean ipcam_itrain_update_string_property(IpcamITrain *itrain, const gchar *key, const gchar *value)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+    gpointer old_key, old_value = NULL;
+    gboolean exists, changed;
+
+    g_mutex_lock(&priv->prop_mutex);
+    exists = g_hash_table_lookup_extended(priv->cached_properties, key, &old_key, &old_value);
+    changed = g_strcmp0(old_value, value) != 0;
+    if (changed) {
+        gchar *new_key = g_strdup(key), *new_value = g_strdup(value);
+
+        if (exists)
+            ipcam_itrain_mem_uncharge(ITRAIN_MEM_PROPERTY, ipcam_itrain_property_size(old_key, old_value));
+        ipcam_itrain_mem_charge(ITRAIN_MEM_PROPERTY, ipcam_itrain_property_size(new_key, new_value));
+        g_hash_table_replace(priv->cached_properties, new_key, new_value);
+    }
+    g_mutex_unlock(&priv->prop_mutex);
+
+    return changed;
+}
+
+/* mirror the identity into the status page for local watchdogs */
+static void ipcam_itrain_publish_identity(IpcamITrain *itrain)
+{
+    ipcam_itrain_status_set_identity(ipcam_itrain_get_string_property(itrain, "szyc:train_num"),
+                                     ipcam_itrain_get_string_property(itrain, "szyc:carriage_num"),
+                                     ipcam_itrain_get_string_property(itrain, "szyc:position_num"),
+                                     g_get_monotonic_time());
+}
+
+static void ipcam_itrain_load_snapshot(IpcamITrain *itrain)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+    GHashTable *items;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (!priv->snapshot_path)
+        return;
+
+    items = ipcam_itrain_snapshot_load(priv->snapshot_path);
+    if (!items)
+        return;
+
+    g_hash_table_iter_init(&iter, items);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        ipcam_itrain_update_string_property(itrain, key, value);
+
+    g_print("ITrain: %u identity properties restored from %s.\n",
+            g_hash_table_size(items), priv->snapshot_path);
+    ipcam_itrain_publish_identity(itrain);
+    g_hash_table_destroy(items);
+}
+
+static void ipcam_itrain_save_snapshot(IpcamITrain *itrain)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+    GHashTable *items;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (!priv->snapshot_path)
+        return;
+
+    /*
+     * Only the identity settings are persisted, they are all strings.
+     * They are copied so the server thread is not held up by the write.
+     */
+    items = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    g_mutex_lock(&priv->prop_mutex);
+    g_hash_table_iter_init(&iter, priv->cached_properties);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (g_str_has_prefix(key, "base_info:") || g_str_has_prefix(key, "szyc:"))
+            g_hash_table_insert(items, g_strdup(key), g_strdup(value));
+    }
+    g_mutex_unlock(&priv->prop_mutex);
+
+    ipcam_itrain_snapshot_save(priv->snapshot_path, items);
+
+    g_hash_table_destroy(items);
+}
+
 void ipcam_itrain_video_occlusion_handler(IpcamITrain *itrain, JsonNode *body)
 {
     IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
     JsonObject *evt_obj = json_object_get_object_member(json_node_get_object(body), "event");
+    IpcamITrainCamera *camera;
     gint region = -1;
     gint state = -1;
 
     g_return_if_fail(evt_obj);
 
+    /* a gateway only serves the cameras it knows */
+    camera = ipcam_itrain_event_camera(itrain, evt_obj);
+    if (priv->cameras && !camera)
+        return;
+
     if (json_object_has_member(evt_obj, "region"))
         region = json_object_get_int_member(evt_obj, "region");
     if (json_object_has_member(evt_obj, "state"))
@@ -171,16 +625,87 @@ void ipcam_itrain_video_occlusion_handler(IpcamITrain *itrain, JsonNode *body)
     if (region >= 0 && state >= 0) {
 		gchar notify[64];
 		snprintf(notify, sizeof(notify),
-				 "OCCLUSION %d %d\n",
-				 region, state);
+				 "OCCLUSION %d %d %u\n",
+				 region, state, camera ? camera->index : 0);
 		ipcam_itrain_server_send_notify(priv->itrain_server, notify, strlen(notify));
     }
 }
 
+gboolean ipcam_itrain_is_video_liveness_event(IpcamITrain *itrain, const gchar *event)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+
+    return priv->video_liveness_event && g_strcmp0(event, priv->video_liveness_event) == 0;
+}
+
+/*
+ * The notice proves the stream is alive unless it carries an explicit
+ * "state": false, or a "frames" counter which did not advance.
+ */
+void ipcam_itrain_video_liveness_handler(IpcamITrain *itrain, JsonNode *body)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+    JsonObject *evt_obj = NULL;
+    IpcamITrainCamera *camera;
+    gint64 *video_frames = &priv->video_frames;
+    gboolean alive = TRUE;
+    gboolean explicit = FALSE;
+
+    if (body)
+        evt_obj = json_object_get_object_member(json_node_get_object(body), "event");
+
+    camera = ipcam_itrain_event_camera(itrain, evt_obj);
+    if (priv->cameras && !camera)
+        return;
+    if (camera)
+        video_frames = &camera->video_frames;
+
+    if (evt_obj && json_object_has_member(evt_obj, "state")) {
+        alive = json_object_get_boolean_member(evt_obj, "state");
+        explicit = TRUE;
+    }
+    else if (evt_obj && json_object_has_member(evt_obj, "frames")) {
+        gint64 frames = json_object_get_int_member(evt_obj, "frames");
+
+        alive = frames != *video_frames;
+        *video_frames = frames;
+    }
+
+    /* a stalled frame counter just lets the watchdog run out */
+    if (alive || explicit)
+        ipcam_itrain_server_video_alive(priv->itrain_server, camera ? camera->index : 0, alive);
+}
+
+/*
+ * A set_base_info or set_szyc notice naming one of our cameras, FALSE if
+ * it is about our own identity.  The key file is written back on change.
+ */
+static gboolean ipcam_itrain_update_camera_setting(IpcamITrain *itrain, JsonNode *body,
+                                                   const gchar *prefix)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
+    JsonObject *body_obj = json_node_get_object(body);
+    IpcamITrainCamera *camera = ipcam_itrain_notice_camera(itrain, body_obj);
+
+    if (!camera)
+        return FALSE;
+
+    /* saved and announced by the next ipcam_itrain_in_loop */
+    ipcam_itrain_cameras_update_items(priv->cameras, camera, prefix,
+                                      json_object_get_object_member(body_obj, "items"));
+
+    return TRUE;
+}
+
 void ipcam_itrain_update_base_info_setting(IpcamITrain *itrain, JsonNode *body)
 {
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
     JsonObject *items_obj = json_object_get_object_member(json_node_get_object(body), "items");
 	GList *members, *item;
+    gboolean changed = FALSE;
+
+    if (ipcam_itrain_update_camera_setting(itrain, body, "base_info:"))
+        return;
 
 	members = json_object_get_members(items_obj);
 	for (item = g_list_first(members); item; item = g_list_next(item)) {
@@ -188,17 +713,23 @@ void ipcam_itrain_update_base_info_setting(IpcamITrain *itrain, JsonNode *body)
 		gchar *key;
 		if (asprintf(&key, "base_info:%s", (const gchar *)item->data) > 0) {
 			const gchar *value = json_object_get_string_member(items_obj, name);
-			ipcam_itrain_set_string_property(itrain, key, value);
+			changed |= ipcam_itrain_update_string_property(itrain, key, value);
 			g_free(key);
 		}
 	}
     g_list_free(members);
+
+    /* reconcile the persisted snapshot with the live settings */
+    if (changed) {
+        ipcam_itrain_save_snapshot(itrain);
+        if (priv->itrain_server)
+            ipcam_itrain_server_update_identity(priv->itrain_server);
+    }
 }
 
 static void base_info_message_handler(GObject *obj, IpcamMessage *msg, gboolean timeout)
 {
 	IpcamITrain *itrain = IPCAM_ITRAIN(obj);
-    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
 	g_assert(IPCAM_IS_ITRAIN(itrain));
 
 	if (!timeout && msg) {
@@ -208,21 +739,34 @@ static void base_info_message_handler(GObject *obj, IpcamMessage *msg, gboolean
 			ipcam_itrain_update_base_info_setting(itrain, body);
 	}
 
+    ipcam_itrain_apply_protocol(itrain);
+    ipcam_itrain_startup_request_done(itrain, STARTUP_BASE_INFO, !timeout && msg);
+}
+
+static void ipcam_itrain_apply_protocol(IpcamITrain *itrain)
+{
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
     const gchar *model = ipcam_itrain_get_string_property(itrain, "base_info:model");
     const gchar *protocol = "DCTX";
+
     if (model) {
         if (g_ascii_strncasecmp(model, "DTTX", 4) == 0)
             protocol = "DTTX";
 
         g_object_set(priv->itrain_server, "protocol", protocol, NULL);
     }
-    g_print("ITrain: Using %s protocol.\n", protocol);
+    g_print("ITrain: Using %s as default protocol.\n", protocol);
 }
 
 void ipcam_itrain_update_szyc_setting(IpcamITrain *itrain, JsonNode *body)
 {
+    IpcamITrainPrivate *priv = ipcam_itrain_get_instance_private(itrain);
     JsonObject *items_obj = json_object_get_object_member(json_node_get_object(body), "items");
 	GList *members, *item;
+    gboolean changed = FALSE;
+
+    if (ipcam_itrain_update_camera_setting(itrain, body, "szyc:"))
+        return;
 
 	members = json_object_get_members(items_obj);
 	for (item = g_list_first(members); item; item = g_list_next(item)) {
@@ -230,11 +774,19 @@ void ipcam_itrain_update_szyc_setting(IpcamITrain *itrain, JsonNode *body)
 		gchar *key;
 		if (asprintf(&key, "szyc:%s", (const gchar *)item->data) > 0) {
 			const gchar *value = json_object_get_string_member(items_obj, name);
-			ipcam_itrain_set_string_property(itrain, key, value);
+			changed |= ipcam_itrain_update_string_property(itrain, key, value);
 			g_free(key);
 		}
 	}
     g_list_free(members);
+
+    /* reconcile the persisted snapshot with the live settings */
+    if (changed) {
+        ipcam_itrain_save_snapshot(itrain);
+        ipcam_itrain_publish_identity(itrain);
+        if (priv->itrain_server)
+            ipcam_itrain_server_update_identity(priv->itrain_server);
+    }
 }
 
 static void szyc_message_handler(GObject *obj, IpcamMessage *msg, gboolean timeout)
@@ -248,4 +800,6 @@ static void szyc_message_handler(GObject *obj, IpcamMessage *msg, gboolean timeo
 		if (body)
 			ipcam_itrain_update_szyc_setting(itrain, body);
 	}
+
+    ipcam_itrain_startup_request_done(itrain, STARTUP_SZYC, !timeout && msg);
 }
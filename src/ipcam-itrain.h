@@ -26,10 +26,22 @@ struct _IpcamITrainClass
 };
 
 
+typedef enum
+{
+    IPCAM_ITRAIN_STARTING,      /* identity or protocol still unknown */
+    IPCAM_ITRAIN_PROVISIONAL,   /* serving with the persisted identity */
+    IPCAM_ITRAIN_READY,         /* identity confirmed by iconfig */
+    IPCAM_ITRAIN_DEGRADED,      /* startup deadline passed, serving defaults */
+} IpcamITrainReadiness;
+
 GType ipcam_itrain_get_type(void);
+IpcamITrainReadiness ipcam_itrain_get_readiness(IpcamITrain *itrain);
+struct IpcamITrainCameras *ipcam_itrain_get_cameras(IpcamITrain *itrain);
 
 const gpointer ipcam_itrain_get_property(IpcamITrain *itrain, const gchar *key);
 void ipcam_itrain_set_property(IpcamITrain *itrain, const gchar *key, gpointer value);
+gboolean ipcam_itrain_update_string_property(IpcamITrain *itrain, const gchar *key, const gchar *value);
+gchar *ipcam_itrain_dup_string_property(IpcamITrain *itrain, const gchar *key);
 
 static inline const gchar *ipcam_itrain_get_string_property(IpcamITrain *itrain, const gchar *key)
 {
@@ -56,6 +68,8 @@ static inline void ipcam_itrain_set_int_property(IpcamITrain *itrain, gchar *key
 }
 
 void ipcam_itrain_video_occlusion_handler(IpcamITrain *itrain, JsonNode *body);
+gboolean ipcam_itrain_is_video_liveness_event(IpcamITrain *itrain, const gchar *event);
+void ipcam_itrain_video_liveness_handler(IpcamITrain *itrain, JsonNode *body);
 void ipcam_itrain_update_base_info_setting(IpcamITrain *itrain, JsonNode *body);
 void ipcam_itrain_update_szyc_setting(IpcamITrain *itrain, JsonNode *body);
 
@@ -0,0 +1,257 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-proto-common.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#include <string.h>
+#include <sys/socket.h>
+#include <json-glib/json-glib.h>
+#include <request_message.h>
+#include "ipcam-itrain.h"
+#include "ipcam-proto-common.h"
+#include "ipcam-itrain-log.h"
+#include "ipcam-itrain-mem.h"
+#include "ipcam-itrain-stats.h"
+#include "ipcam-itrain-clock.h"
+
+#define DEFAULT_BUFFER_SIZE 1024
+
+/*
+ * A gateway camera is not behind our iconfig: its identity lives in the
+ * cameras file and is updated here, the rest cannot reach the camera.
+ */
+static gboolean
+ipcam_proto_invocate_camera_action(IpcamConnection *conn, const char *action,
+                                   JsonNode *request)
+{
+    if (strcmp(action, "set_szyc") == 0) {
+        JsonObject *items = json_object_get_object_member(json_node_get_object(request),
+                                                          "items");
+
+        ipcam_itrain_cameras_update_items(ipcam_itrain_get_cameras(conn->itrain),
+                                          conn->camera, "szyc:", items);
+        return TRUE;
+    }
+
+    ipcam_itrain_stats_inc(ITRAIN_STAT_GATEWAY_REJECTED);
+    return FALSE;
+}
+
+gboolean
+ipcam_proto_invocate_action(IpcamConnection *conn, const char *action,
+                            JsonNode *request, JsonNode **response)
+{
+    IpcamITrain *itrain = conn->itrain;
+    const gchar *token;
+    IpcamRequestMessage *req_msg;
+    IpcamMessage *resp_msg;
+    gboolean ret = FALSE;
+    gsize request_size;
+
+    if (conn->camera)
+        return ipcam_proto_invocate_camera_action(conn, action, request);
+
+    request_size = ipcam_itrain_mem_json_size(request);
+
+    /* the request is held for the whole round trip */
+    ipcam_itrain_mem_charge(ITRAIN_MEM_JSON, request_size);
+    token = ipcam_base_app_get_config(IPCAM_BASE_APP(itrain), "token");
+
+    req_msg = g_object_new(IPCAM_REQUEST_MESSAGE_TYPE,
+                           "action", action,
+                           "body", request,
+                           NULL);
+
+    ipcam_base_app_send_message(IPCAM_BASE_APP(itrain),
+                                IPCAM_MESSAGE(req_msg),
+                                "iconfig", token, NULL, 10);
+
+    ret = ipcam_base_app_wait_response(IPCAM_BASE_APP(itrain),
+                                       ipcam_request_message_get_id(req_msg),
+                                       5000, &resp_msg);
+    if (ret)
+    {
+        JsonNode *resp_body;
+
+        if (response) {
+            g_object_get(G_OBJECT(resp_msg), "body", &resp_body, NULL);
+            *response = json_node_copy(resp_body);
+            ipcam_itrain_mem_charge(ITRAIN_MEM_JSON, ipcam_itrain_mem_json_size(*response));
+        }
+
+        g_object_unref(resp_msg);
+    }
+
+    g_object_unref(req_msg);
+    ipcam_itrain_mem_uncharge(ITRAIN_MEM_JSON, request_size);
+
+    return ret;
+}
+
+gboolean ipcam_proto_init_connection(IpcamConnection *conn)
+{
+    IpcamProtoConnectionPriv *priv = conn->priv;
+
+    priv->buffer = ipcam_itrain_mem_alloc(ITRAIN_MEM_BUFFER, DEFAULT_BUFFER_SIZE);
+    if (!priv->buffer) {
+        g_print("Out of memory for new connection buffer.\n");
+        return FALSE;
+    }
+    priv->buffer_size = DEFAULT_BUFFER_SIZE;
+    priv->data_size = 0;
+
+    ipcam_connection_enable_timeout(conn, PROTO_TIMEOUT_SEND_HEARTBEAT, TRUE);
+    ipcam_connection_set_timeout(conn, PROTO_TIMEOUT_SEND_HEARTBEAT, PROTO_HEARTBEAT_INTERVAL);
+    /* a whole train reconnects at once, keep their heartbeats apart */
+    ipcam_connection_spread_timeout(conn, PROTO_TIMEOUT_SEND_HEARTBEAT);
+    ipcam_connection_enable_timeout(conn, PROTO_TIMEOUT_RECV_HEARTBEAT, TRUE);
+    ipcam_connection_set_timeout(conn, PROTO_TIMEOUT_RECV_HEARTBEAT, PROTO_SESSION_TIMEOUT);
+
+    return TRUE;
+}
+
+void ipcam_proto_deinit_connection(IpcamConnection *conn)
+{
+    IpcamProtoConnectionPriv *priv = conn->priv;
+
+    ipcam_itrain_mem_free(ITRAIN_MEM_BUFFER, priv->buffer, priv->buffer_size);
+    priv->buffer = NULL;
+}
+
+gboolean ipcam_proto_dispatch_pdu(IpcamConnection *conn, const IpcamProtoMessage *messages,
+                                  IpcamTrainPDU *pdu)
+{
+    guint8 pdu_type = ipcam_train_pdu_get_type(pdu);
+    guint16 payload_size = ipcam_train_pdu_get_payload_size(pdu);
+    const IpcamProtoMessage *message = &messages[pdu_type];
+
+    /* whatever the client sends, it is alive */
+    ipcam_connection_reset_timeout(conn, PROTO_TIMEOUT_RECV_HEARTBEAT);
+    conn->last_received = ipcam_itrain_clock_now();
+
+    if (ipcam_connection_throttle_pdu(conn, pdu))
+        return FALSE;
+
+    if (!message->handler) {
+        ITRAIN_LOG(PDU_UNHANDLED, conn->sock, pdu_type);
+        return FALSE;
+    }
+
+    if (payload_size < message->size) {
+        ITRAIN_LOG(PDU_SHORT, conn->sock, pdu_type, payload_size);
+        return FALSE;
+    }
+
+    return message->handler(conn, pdu);
+}
+
+int ipcam_proto_data_arrive(IpcamConnection *conn, const IpcamProtoMessage *messages)
+{
+    IpcamProtoConnectionPriv *priv = conn->priv;
+    gpointer buffer = &priv->buffer[priv->data_size];
+    gssize space_left = priv->buffer_size - priv->data_size;
+    IpcamTrainPDU *pdu;
+    guint16 offset = 0;
+    int ret;
+
+    g_return_val_if_fail(space_left > 0, 0);
+
+    ret = ipcam_connection_recv(conn, buffer, space_left);
+    if (ret > 0) {
+        priv->data_size += ret;
+    }
+
+    /* find header */
+    while((priv->buffer[offset] != PACKET_START) && offset < priv->data_size)
+        offset++;
+
+    /* header not found, discard current buffer */
+    if (priv->buffer[offset] != PACKET_START) {
+        priv->data_size = 0;
+        return 0;
+    }
+
+    pdu = ipcam_train_pdu_new_from_buffer(&priv->buffer[offset], priv->data_size - offset);
+    if (pdu) {
+        ipcam_connection_trace_pdu(conn, pdu);
+        if (ipcam_train_pdu_verify_checksum(pdu)) {
+            ipcam_proto_dispatch_pdu(conn, messages, pdu);
+        }
+        else {
+            ITRAIN_LOG(PDU_CHECKSUM, conn->sock,
+                       ipcam_train_pdu_get_checksum(pdu),
+                       ipcam_train_pdu_checksum(pdu));
+        }
+
+        ipcam_train_pdu_free(pdu);
+
+        /* just discard the remain pdu */
+        priv->data_size = 0;
+    }
+
+    return 0;
+}
+
+/* no payload and the same every time, so no PDU is allocated for it */
+static gssize
+ipcam_proto_send_heartbeat(IpcamConnection *conn, guint8 type)
+{
+    /* start, type, payload size, checksum */
+    guint8 packet[5] = { PACKET_START, type, 0, 0, PACKET_START ^ type };
+
+    return ipcam_connection_send_packet(conn, packet, sizeof(packet));
+}
+
+void ipcam_proto_timeout(IpcamConnection *conn, guint32 id, guint8 heartbeat_type)
+{
+    gint64 interval, now;
+
+    switch(id) {
+    case PROTO_TIMEOUT_SEND_HEARTBEAT:
+        /*
+         * A fault event or a reply sent meanwhile did the job already,
+         * but only if the client talked back: a passive one answers
+         * heartbeats only, and must not run into its session timeout.
+         * Never skip twice in a row.
+         */
+        interval = (gint64)conn->timeouts[id].timeout_sec * G_USEC_PER_SEC;
+        now = ipcam_itrain_clock_now();
+        if (!conn->heartbeat_skipped &&
+            now - conn->last_sent < interval &&
+            now - conn->last_received < interval) {
+            conn->heartbeat_skipped = TRUE;
+            ipcam_itrain_stats_inc(ITRAIN_STAT_HEARTBEAT_SKIPPED);
+            break;
+        }
+        conn->heartbeat_skipped = FALSE;
+        ipcam_proto_send_heartbeat(conn, heartbeat_type);
+        ipcam_itrain_stats_inc(ITRAIN_STAT_HEARTBEAT_SENT);
+        break;
+    case PROTO_TIMEOUT_RECV_HEARTBEAT:
+        ITRAIN_LOG(SESSION_TIMEOUT, conn->sock);
+        ipcam_connection_free(conn);
+        break;
+    }
+}
+
+/* a NULL payload of size 0 only gets the checksum calculated */
+gssize ipcam_proto_send(IpcamConnection *conn, guint8 type,
+                        gconstpointer payload, guint16 size)
+{
+    IpcamTrainPDU *pdu;
+    gssize ret;
+
+    pdu = ipcam_train_pdu_new(type, size);
+    if (pdu == NULL) {
+        g_critical("Out of memory\n");
+        return -1;
+    }
+
+    ipcam_train_pdu_set_payload(pdu, (gpointer)payload);
+    ret = ipcam_connection_send_pdu(conn, pdu);
+    ipcam_train_pdu_free(pdu);
+
+    return ret;
+}
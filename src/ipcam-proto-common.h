@@ -0,0 +1,140 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * ipcam-proto-common.h
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ */
+
+#ifndef _IPCAM_PROTO_COMMON_H_
+#define _IPCAM_PROTO_COMMON_H_
+
+#include "ipcam-proto-interface.h"
+
+/*
+ * What the train protocols share: the receive buffer, the heartbeats and
+ * a dispatch table indexed by the PDU type.  A protocol describes its
+ * messages in a schema header with two X-macro lists,
+ *
+ *   requests: X(name, code, payload, size, handler, flags)
+ *   replies:  X(name, code, payload, size)
+ *
+ * where size is the payload size on the wire.  IPCAM_PROTO_DEFINE_MESSAGES
+ * turns them into MSGTYPE_<name> codes, size checks of the payload
+ * structs, the dispatch table and ipcam_proto_send_<name>() for replies;
+ * IPCAM_PROTO_DEFINE_TYPE then builds the IpcamTrainProtocolType.
+ */
+
+#define PROTO_TIMEOUT_SEND_HEARTBEAT    0
+#define PROTO_TIMEOUT_RECV_HEARTBEAT    1
+
+#define PROTO_HEARTBEAT_INTERVAL        5       /* sec, without other traffic */
+#define PROTO_SESSION_TIMEOUT           15      /* sec without any PDU received */
+
+/* request flags */
+#define PROTO_MSG_MATCH         (1 << 0)    /* only exists in this protocol */
+#define PROTO_MSG_THROTTLE      (1 << 1)    /* changes the configuration, rate limited */
+
+typedef gboolean (*IpcamProtoHandler)(IpcamConnection *conn, IpcamTrainPDU *pdu);
+
+typedef struct IpcamProtoMessage
+{
+    IpcamProtoHandler handler;      /* NULL for types we do not accept */
+    guint16           size;         /* minimal payload size */
+    guint8            flags;
+} IpcamProtoMessage;
+
+/* the connection data of every protocol starts with this */
+typedef struct IpcamProtoConnectionPriv
+{
+    guint8   *buffer;
+    guint32  buffer_size;
+    guint32  data_size;
+} IpcamProtoConnectionPriv;
+
+gboolean ipcam_proto_invocate_action(IpcamConnection *conn, const char *action,
+                                     JsonNode *request, JsonNode **response);
+gboolean ipcam_proto_init_connection(IpcamConnection *conn);
+void     ipcam_proto_deinit_connection(IpcamConnection *conn);
+int      ipcam_proto_data_arrive(IpcamConnection *conn, const IpcamProtoMessage *messages);
+gboolean ipcam_proto_dispatch_pdu(IpcamConnection *conn, const IpcamProtoMessage *messages,
+                                  IpcamTrainPDU *pdu);
+void     ipcam_proto_timeout(IpcamConnection *conn, guint32 id, guint8 heartbeat_type);
+gssize   ipcam_proto_send(IpcamConnection *conn, guint8 type,
+                          gconstpointer payload, guint16 size);
+
+#define IPCAM_PROTO_REQUEST_CODE(name, code, payload, size, handler, flags) \
+    MSGTYPE_##name = code,
+
+#define IPCAM_PROTO_REPLY_CODE(name, code, payload, size) \
+    MSGTYPE_##name = code,
+
+#define IPCAM_PROTO_REQUEST_CHECK(name, code, payload, size, handler, flags) \
+    _Static_assert(sizeof(payload) == size, #payload " does not match its wire size");
+
+#define IPCAM_PROTO_REPLY_CHECK(name, code, payload, size) \
+    _Static_assert(sizeof(payload) == size, #payload " does not match its wire size");
+
+/* the dispatcher checked the size, handlers get the payload typed */
+#define IPCAM_PROTO_DECODER(name, code, payload, size, handler, flags)      \
+    static gboolean handler(IpcamConnection *conn, const payload *request); \
+    static gboolean handler##_pdu(IpcamConnection *conn, IpcamTrainPDU *pdu) \
+    {                                                                       \
+        return handler(conn, ipcam_train_pdu_get_payload(pdu));             \
+    }
+
+#define IPCAM_PROTO_ENCODER(name, code, payload, size)                      \
+    static inline gssize                                                    \
+    ipcam_proto_send_##name(IpcamConnection *conn, const payload *reply)    \
+    {                                                                       \
+        return ipcam_proto_send(conn, code, reply, size);                   \
+    }
+
+#define IPCAM_PROTO_TABLE_ENTRY(name, code, payload, size, handler, flags) \
+    [code] = { handler##_pdu, size, flags },
+
+#define IPCAM_PROTO_DEFINE_MESSAGES(requests, replies)                      \
+    enum { requests(IPCAM_PROTO_REQUEST_CODE) replies(IPCAM_PROTO_REPLY_CODE) }; \
+    requests(IPCAM_PROTO_REQUEST_CHECK)                                     \
+    replies(IPCAM_PROTO_REPLY_CHECK)                                        \
+    requests(IPCAM_PROTO_DECODER)                                           \
+    replies(IPCAM_PROTO_ENCODER)                                            \
+    static const IpcamProtoMessage proto_messages[256] = {                  \
+        requests(IPCAM_PROTO_TABLE_ENTRY)                                   \
+    };
+
+/* needs prefix##_report_status(conn, occlusion_stat, loss_stat) */
+#define IPCAM_PROTO_DEFINE_TYPE(prefix, proto_name, priv_type, heartbeat)   \
+    static gboolean prefix##_match_pdu_type(guint8 type)                    \
+    {                                                                       \
+        return (proto_messages[type].flags & PROTO_MSG_MATCH) != 0;         \
+    }                                                                       \
+    static gboolean prefix##_throttle_pdu_type(guint8 type)                 \
+    {                                                                       \
+        return (proto_messages[type].flags & PROTO_MSG_THROTTLE) != 0;      \
+    }                                                                       \
+    static gboolean prefix##_dispatch_pdu(IpcamConnection *conn, IpcamTrainPDU *pdu) \
+    {                                                                       \
+        return ipcam_proto_dispatch_pdu(conn, proto_messages, pdu);         \
+    }                                                                       \
+    static int prefix##_data_arrive(IpcamConnection *conn)                  \
+    {                                                                       \
+        return ipcam_proto_data_arrive(conn, proto_messages);               \
+    }                                                                       \
+    static void prefix##_timeout(IpcamConnection *conn, guint32 id)         \
+    {                                                                       \
+        ipcam_proto_timeout(conn, id, heartbeat);                           \
+    }                                                                       \
+    IpcamTrainProtocolType prefix##_protocol_type = {                       \
+        .name              = proto_name,                                    \
+        .user_data_size    = sizeof(priv_type),                             \
+        .match_pdu_type    = prefix##_match_pdu_type,                       \
+        .throttle_pdu_type = prefix##_throttle_pdu_type,                    \
+        .dispatch_pdu      = prefix##_dispatch_pdu,                         \
+        .init_connection   = ipcam_proto_init_connection,                   \
+        .on_data_arrive    = prefix##_data_arrive,                          \
+        .on_timeout        = prefix##_timeout,                              \
+        .on_report_status  = prefix##_report_status,                        \
+        .deinit_connection = ipcam_proto_deinit_connection                  \
+    }
+
+#endif /* _IPCAM_PROTO_COMMON_H_ */
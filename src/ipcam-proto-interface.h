@@ -14,6 +14,7 @@
 
 #include "ipcam-itrain.h"
 #include "ipcam-itrain-message.h"
+#include "ipcam-itrain-camera.h"
 
 struct IpcamConnection;
 typedef struct IpcamConnection IpcamConnection;
@@ -24,26 +25,49 @@ typedef struct IpcamTimeout
 {
     gboolean enabled;
     guint32  timeout_sec;
-    time_t   expire;
+    gint64   expire;            /* ipcam_itrain_clock_now() */
 } IpcamTimeout;
 
 struct IpcamConnection
 {
     int          sock;
     IpcamITrain  *itrain;
+    IpcamITrainCamera *camera;  /* gateway mode, NULL for our own identity */
     IpcamTimeout timeouts[NR_TIMEOUTS];
+    gint64       last_sent;     /* last PDU other than a heartbeat */
+    gint64       last_received; /* last valid PDU from the client */
+    gboolean     heartbeat_skipped;
     gpointer     priv;
 };
 
 void    ipcam_connection_enable_timeout(IpcamConnection *conn, guint32 id, gboolean enabled);
 void    ipcam_connection_set_timeout(IpcamConnection *conn, guint32 id, gint32 timeout_sec);
 void    ipcam_connection_reset_timeout(IpcamConnection *conn, guint32 id);
+void    ipcam_connection_spread_timeout(IpcamConnection *conn, guint32 id);
 gssize  ipcam_connection_send_pdu(IpcamConnection *conn, IpcamTrainPDU *pdu);
+gssize  ipcam_connection_send_packet(IpcamConnection *conn, gconstpointer packet, gsize size);
+gssize  ipcam_connection_recv(IpcamConnection *conn, gpointer buf, gsize len);
+gboolean ipcam_connection_throttle_pdu(IpcamConnection *conn, IpcamTrainPDU *pdu);
+gboolean ipcam_connection_throttle_write(IpcamConnection *conn, guint8 type);
+void    ipcam_connection_trace_pdu(IpcamConnection *conn, IpcamTrainPDU *pdu);
+void    ipcam_connection_feed_osd(IpcamConnection *conn, const gchar *speed, const gchar *datetime);
 void    ipcam_connection_free(IpcamConnection *conn);
 
+/* the identity of the camera the client is talking to, g_free() it */
+static inline gchar *
+ipcam_connection_dup_string_property(IpcamConnection *conn, const gchar *key)
+{
+    return ipcam_itrain_camera_dup_string_property(conn->camera, conn->itrain, key);
+}
+
 typedef struct IpcamTrainProtocolType
 {
+    const gchar *name;
     guint32  user_data_size;
+    gboolean (*match_pdu_type)   (guint8 type);
+    gboolean (*throttle_pdu_type)(guint8 type);
+    gboolean (*dispatch_pdu)     (IpcamConnection *conn,
+                                  IpcamTrainPDU *pdu);
     gboolean (*init_connection)  (IpcamConnection *conn);
     int      (*on_data_arrive)   (IpcamConnection *conn);
     void     (*on_timeout)       (IpcamConnection *conn,
@@ -18,11 +18,41 @@
  */
 
 #include "ipcam-itrain.h"
+#include "ipcam-itrain-mem.h"
+
+#ifdef ITRAIN_PGO_GENERATE
+#include <signal.h>
+#include <unistd.h>
+
+/* from libgcov, linked in by -fprofile-generate */
+extern void __gcov_dump(void);
+
+/*
+ * The instrumented build writes its profile at exit, which is not safe
+ * from a signal handler: dump it explicitly and leave with _exit().
+ */
+static void pgo_exit_handler(int signo)
+{
+	__gcov_dump();
+	_exit(0);
+}
+#endif
 
 int main()
 {
+#ifdef ITRAIN_PGO_GENERATE
+	signal(SIGTERM, pgo_exit_handler);
+	signal(SIGINT, pgo_exit_handler);
+#endif
 	IpcamITrain *itrain = g_object_new(IPCAM_TYPE_ITRAIN, "name", "itrain", NULL);
 	ipcam_base_service_start(IPCAM_BASE_SERVICE(itrain));
+	/* stopped after a handoff: join the server thread, clear the status page */
+	g_object_unref(itrain);
+#ifdef ITRAIN_DEBUG
+	/* everything charged must be gone once the service is torn down */
+	if (!ipcam_itrain_mem_check_leaks())
+		return (1);
+#endif
 	return (0);
 }
 
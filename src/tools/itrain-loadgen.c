@@ -0,0 +1,326 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * itrain-loadgen.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ * Load generator for itrain: keeps a number of train protocol clients
+ * busy with status queries, one outstanding request per connection, and
+ * optionally feeds the OSD port with text datagrams.  Reports the request
+ * rate and round trip latencies.  Status queries are answered from the
+ * cached identity, so no other service has to be running; this is also
+ * the training workload of the PGO build.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "ipcam-itrain-message.h"
+
+#define MAX_CONNECTIONS         256
+#define RX_BUFFER_SIZE          1024
+#define OSD_CODE_TEXT           0x09
+
+typedef struct LoadProtocol
+{
+    const gchar *name;
+    guint8      query_type;
+    guint8      reply_type;
+} LoadProtocol;
+
+static const LoadProtocol load_protocols[] = {
+    { "dctx", 0x08, 0x58 },
+    { "dttx", 0x07, 0x57 },
+};
+
+typedef struct LoadConnection
+{
+    int     sock;
+    gint64  sent_at;        /* 0 while idle */
+    guint8  buffer[RX_BUFFER_SIZE];
+    guint   data_size;
+} LoadConnection;
+
+typedef struct LoadStats
+{
+    guint64 requests;
+    guint64 errors;
+    guint64 osd_sent;
+    GArray  *latencies;     /* usec, gint64 */
+} LoadStats;
+
+static guint8
+load_checksum(const guint8 *p, guint len)
+{
+    guint8 checksum = 0;
+    guint i;
+
+    for (i = 0; i < len; i++)
+        checksum ^= p[i];
+
+    return checksum;
+}
+
+/* header, no payload, checksum */
+static gboolean
+load_send_request(LoadConnection *conn, guint8 type)
+{
+    guint8 pdu[5] = { PACKET_START, type, 0, 0, 0 };
+
+    pdu[4] = load_checksum(pdu, 4);
+    if (send(conn->sock, pdu, sizeof(pdu), MSG_NOSIGNAL) != sizeof(pdu))
+        return FALSE;
+    conn->sent_at = g_get_monotonic_time();
+
+    return TRUE;
+}
+
+/* consume whole PDUs, TRUE once the reply to the query is among them */
+static gboolean
+load_receive(LoadConnection *conn, const LoadProtocol *protocol)
+{
+    gboolean replied = FALSE;
+    guint offset = 0;
+
+    while (conn->data_size - offset >= 5) {
+        guint8 *pdu = &conn->buffer[offset];
+        guint size;
+
+        if (pdu[0] != PACKET_START) {
+            offset++;
+            continue;
+        }
+        size = 4 + ((pdu[2] << 8) | pdu[3]) + 1;
+        if (size > sizeof(conn->buffer)) {
+            offset++;
+            continue;
+        }
+        if (conn->data_size - offset < size)
+            break;
+        if (pdu[1] == protocol->reply_type)
+            replied = TRUE;
+        offset += size;
+    }
+    conn->data_size -= offset;
+    memmove(conn->buffer, &conn->buffer[offset], conn->data_size);
+
+    return replied;
+}
+
+static int
+load_connect(const struct sockaddr_in *addr)
+{
+    int sock, one = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return sock;
+}
+
+static void
+load_send_osd(int sock, const struct sockaddr_in *addr, guint64 seq)
+{
+    guint8 datagram[64];
+    gchar text[32];
+    guint length = g_snprintf(text, sizeof(text), "%" G_GUINT64_FORMAT " km/h", seq % 400);
+    guint size = 11 + length;
+
+    datagram[0] = 0xff;
+    datagram[1] = OSD_CODE_TEXT;
+    datagram[2] = 0;                        /* keeptime */
+    datagram[3] = 0; datagram[4] = 16;      /* x */
+    datagram[5] = 0; datagram[6] = 16;      /* y */
+    datagram[7] = 0; datagram[8] = 24;      /* fontsize */
+    datagram[9] = length >> 8;
+    datagram[10] = length & 0xff;
+    memcpy(&datagram[11], text, length);
+    datagram[size] = load_checksum(datagram, size);
+
+    sendto(sock, datagram, size + 1, 0, (const struct sockaddr *)addr, sizeof(*addr));
+}
+
+static gint
+compare_latency(gconstpointer a, gconstpointer b)
+{
+    gint64 la = *(const gint64 *)a, lb = *(const gint64 *)b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+static void
+load_report(LoadStats *stats, guint connections, gint64 elapsed)
+{
+    GArray *l = stats->latencies;
+    gint64 sum = 0;
+    guint i;
+
+    g_array_sort(l, compare_latency);
+    for (i = 0; i < l->len; i++)
+        sum += g_array_index(l, gint64, i);
+
+    printf("connections %u\n", connections);
+    printf("requests %" G_GUINT64_FORMAT "\n", stats->requests);
+    printf("errors %" G_GUINT64_FORMAT "\n", stats->errors);
+    printf("osd_datagrams %" G_GUINT64_FORMAT "\n", stats->osd_sent);
+    printf("requests_per_sec %.0f\n", stats->requests * (double)G_USEC_PER_SEC / MAX(elapsed, 1));
+    if (l->len) {
+        printf("latency_avg_us %" G_GINT64_FORMAT "\n", sum / l->len);
+        printf("latency_p50_us %" G_GINT64_FORMAT "\n", g_array_index(l, gint64, l->len / 2));
+        printf("latency_p99_us %" G_GINT64_FORMAT "\n", g_array_index(l, gint64, l->len * 99 / 100));
+        printf("latency_max_us %" G_GINT64_FORMAT "\n", g_array_index(l, gint64, l->len - 1));
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-H HOST] [-p PORT] [-t dctx|dttx] [-c CONNECTIONS] [-d SECONDS]\n"
+            "          [-u OSD_PORT] [-r OSD_PER_SEC]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const gchar *host = "127.0.0.1";
+    const LoadProtocol *protocol = &load_protocols[0];
+    guint port = 10100, osd_port = 0, osd_rate = 50;
+    guint nr_conns = 8, duration = 10;
+    LoadConnection *conns;
+    struct pollfd fds[MAX_CONNECTIONS];
+    struct sockaddr_in addr, osd_addr;
+    LoadStats stats = { 0 };
+    gint64 start, end, now, osd_next;
+    int osd_sock = -1;
+    int opt;
+    guint i;
+
+    while ((opt = getopt(argc, argv, "H:p:t:c:d:u:r:")) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            protocol = g_ascii_strcasecmp(optarg, "dttx") == 0 ? &load_protocols[1] : &load_protocols[0];
+            break;
+        case 'c':
+            nr_conns = CLAMP(strtoul(optarg, NULL, 0), 1, MAX_CONNECTIONS);
+            break;
+        case 'd':
+            duration = strtoul(optarg, NULL, 0);
+            break;
+        case 'u':
+            osd_port = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            osd_rate = MAX(strtoul(optarg, NULL, 0), 1);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_aton(host, &addr.sin_addr) == 0) {
+        fprintf(stderr, "%s: invalid address\n", host);
+        return EXIT_FAILURE;
+    }
+    osd_addr = addr;
+    osd_addr.sin_port = htons(osd_port);
+
+    conns = g_new0(LoadConnection, nr_conns);
+    for (i = 0; i < nr_conns; i++) {
+        conns[i].sock = load_connect(&addr);
+        if (conns[i].sock < 0) {
+            fprintf(stderr, "connection %u to %s:%u failed: %s\n", i, host, port, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        fds[i].fd = conns[i].sock;
+        fds[i].events = POLLIN;
+    }
+    if (osd_port)
+        osd_sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    stats.latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+    start = g_get_monotonic_time();
+    end = start + (gint64)duration * G_USEC_PER_SEC;
+    osd_next = start;
+
+    for (i = 0; i < nr_conns; i++) {
+        if (!load_send_request(&conns[i], protocol->query_type))
+            stats.errors++;
+    }
+
+    while ((now = g_get_monotonic_time()) < end) {
+        int timeout = osd_sock >= 0 ? MAX(0, (osd_next - now) / 1000) : 100;
+
+        if (poll(fds, nr_conns, MIN(timeout, 100)) < 0 && errno != EINTR)
+            break;
+
+        now = g_get_monotonic_time();
+        for (i = 0; i < nr_conns; i++) {
+            LoadConnection *conn = &conns[i];
+            ssize_t ret;
+
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            ret = recv(conn->sock, &conn->buffer[conn->data_size],
+                       sizeof(conn->buffer) - conn->data_size, 0);
+            if (ret <= 0) {
+                fprintf(stderr, "connection %u closed by the server\n", i);
+                stats.errors++;
+                fds[i].fd = -1;
+                continue;
+            }
+            conn->data_size += ret;
+
+            if (load_receive(conn, protocol) && conn->sent_at) {
+                gint64 latency = now - conn->sent_at;
+
+                g_array_append_val(stats.latencies, latency);
+                stats.requests++;
+                conn->sent_at = 0;
+                if (!load_send_request(conn, protocol->query_type))
+                    stats.errors++;
+            }
+        }
+
+        if (osd_sock >= 0 && now >= osd_next) {
+            load_send_osd(osd_sock, &osd_addr, stats.osd_sent++);
+            osd_next += G_USEC_PER_SEC / osd_rate;
+        }
+    }
+
+    load_report(&stats, nr_conns, g_get_monotonic_time() - start);
+
+    for (i = 0; i < nr_conns; i++)
+        close(conns[i].sock);
+    if (osd_sock >= 0)
+        close(osd_sock);
+    g_array_free(stats.latencies, TRUE);
+    g_free(conns);
+
+    return stats.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
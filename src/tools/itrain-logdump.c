@@ -0,0 +1,135 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * itrain-logdump.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ * Decode the binary event log written by itrain, either the drained log
+ * file or a ring dump taken on SIGUSR2 or after a crash.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ipcam-itrain-log.h"
+
+static const struct {
+    const gchar *name;
+    guint8      category;
+    guint8      level;
+    const gchar *format;
+} events[NR_ITRAIN_LOG_EVENTS] = {
+#define ITRAIN_LOG_EVENT_INFO(id, category, level, format) \
+    [ITRAIN_LOG_##id] = { #id, ITRAIN_LOG_CAT_##category, ITRAIN_LOG_LEVEL_##level, format },
+    ITRAIN_LOG_EVENTS(ITRAIN_LOG_EVENT_INFO)
+#undef ITRAIN_LOG_EVENT_INFO
+};
+
+static const gchar *category_names[NR_ITRAIN_LOG_CATEGORIES] = {
+#define ITRAIN_LOG_CATEGORY_NAME(id, name) [ITRAIN_LOG_CAT_##id] = name,
+    ITRAIN_LOG_CATEGORIES(ITRAIN_LOG_CATEGORY_NAME)
+#undef ITRAIN_LOG_CATEGORY_NAME
+};
+
+static const gchar *level_names[NR_ITRAIN_LOG_LEVELS] = {
+#define ITRAIN_LOG_LEVEL_NAME(id, name) [ITRAIN_LOG_LEVEL_##id] = name,
+    ITRAIN_LOG_LEVELS(ITRAIN_LOG_LEVEL_NAME)
+#undef ITRAIN_LOG_LEVEL_NAME
+};
+
+static gint
+compare_records(gconstpointer a, gconstpointer b)
+{
+    const IpcamITrainLogRecord *ra = a, *rb = b;
+
+    return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+static void
+print_record(IpcamITrainLogRecord *record)
+{
+    guint32 args[ITRAIN_LOG_MAX_ARGS] = { 0 };
+    time_t sec = record->time / G_USEC_PER_SEC;
+    struct tm tm;
+    gchar when[32];
+
+    if (record->event >= NR_ITRAIN_LOG_EVENTS) {
+        printf("#%" G_GUINT64_FORMAT " unknown event %u\n", record->seq, record->event);
+        return;
+    }
+
+    memcpy(args, record->args, MIN(record->nargs, ITRAIN_LOG_MAX_ARGS) * sizeof(guint32));
+    localtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06d #%" G_GUINT64_FORMAT " %-6s %-5s ",
+           when, (int)(record->time % G_USEC_PER_SEC), record->seq,
+           category_names[events[record->event].category],
+           level_names[events[record->event].level]);
+    printf(events[record->event].format, args[0], args[1], args[2], args[3], args[4]);
+    printf("\n");
+}
+
+static gboolean
+decode_file(const gchar *path)
+{
+    IpcamITrainLogHeader header;
+    IpcamITrainLogRecord record;
+    GArray *records;
+    guint64 last_seq = 0;
+    FILE *fp;
+    guint i;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return FALSE;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, ITRAIN_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != ITRAIN_LOG_VERSION ||
+        header.record_size != sizeof(IpcamITrainLogRecord)) {
+        fprintf(stderr, "%s: not an itrain log of this version\n", path);
+        fclose(fp);
+        return FALSE;
+    }
+
+    /* ring dumps are unordered and may hold torn or empty records */
+    records = g_array_new(FALSE, FALSE, sizeof(IpcamITrainLogRecord));
+    while (fread(&record, sizeof(record), 1, fp) == 1) {
+        if (record.seq != 0)
+            g_array_append_val(records, record);
+    }
+    fclose(fp);
+
+    g_array_sort(records, compare_records);
+    for (i = 0; i < records->len; i++) {
+        IpcamITrainLogRecord *r = &g_array_index(records, IpcamITrainLogRecord, i);
+
+        if (last_seq && r->seq > last_seq + 1)
+            printf("... %" G_GUINT64_FORMAT " records lost\n", r->seq - last_seq - 1);
+        print_record(r);
+        last_seq = r->seq;
+    }
+    g_array_free(records, TRUE);
+
+    return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, ret = EXIT_SUCCESS;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s LOGFILE...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (!decode_file(argv[i]))
+            ret = EXIT_FAILURE;
+    }
+
+    return ret;
+}
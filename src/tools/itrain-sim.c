@@ -0,0 +1,357 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * itrain-sim.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ * Runs the server on a virtual clock against in-memory clients, so a day
+ * of heartbeats, session timeouts and fault reports (the defaults: 10000
+ * clients for 86400 s) does not take a day; the CPU time it did take is
+ * printed at the end.  The clients answer heartbeats within one step; a share of them goes silent
+ * now and then and reconnects once the server dropped the session.
+ * Occlusion is toggled at a fixed interval and every report counted.
+ *
+ * Everything is driven by the seed, so two runs with the same options
+ * print the same digest of the traffic.  The timer counters give the
+ * scheduling cost independent of the machine, the CPU time the real one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "ipcam-itrain.h"
+#include "ipcam-itrain-server.h"
+#include "ipcam-itrain-reactor.h"
+#include "ipcam-itrain-clock.h"
+#include "ipcam-itrain-stats.h"
+#include "ipcam-itrain-message.h"
+
+#define SIM_EPOCH               (1000 * G_USEC_PER_SEC)     /* clear of 0, which means never */
+#define SIM_RECONNECT_DELAY     (2 * G_USEC_PER_SEC)
+#define SIM_SILENT_DURATION     (30 * G_USEC_PER_SEC)
+
+#define HEARTBEAT_REQUEST       0x01
+#define HEARTBEAT_RESPONSE      0x51
+
+typedef struct SimProtocol
+{
+    const gchar *name;
+    guint8      fault_event;
+} SimProtocol;
+
+static const SimProtocol sim_protocols[] = {
+    { "dctx", 0x09 },
+    { "dttx", 0x08 },
+};
+
+typedef struct SimClient
+{
+    guint   id;
+    int     sock;               /* -1 while disconnected */
+    gint64  reconnect_at;
+    gint64  silent_until;       /* ignores heartbeats before that */
+} SimClient;
+
+typedef struct SimStats
+{
+    guint64 connects;
+    guint64 refused;
+    guint64 dropped;            /* sessions closed by the server */
+    guint64 heartbeats;
+    guint64 responses;
+    guint64 faults_injected;
+    guint64 fault_events;
+    gint64  fault_latency_max;  /* virtual usec from injection to delivery */
+    guint32 digest;
+} SimStats;
+
+typedef struct Simulation
+{
+    IpcamITrainServer   *server;
+    IpcamReactor        *reactor;
+    const SimProtocol   *protocol;
+    SimClient           *clients;
+    guint               nr_clients;
+    GHashTable          *by_sock;
+    GQueue              reconnect;      /* disconnected clients, same delay so in time order */
+    GRand               *rand;
+    guint               silent_permille;
+    gdouble             silent_credit;
+    gint64              fault_injected_at;
+    SimStats            stats;
+} Simulation;
+
+/* FNV-1a over what the clients saw and when */
+static void
+sim_digest(Simulation *sim, guint32 value)
+{
+    guint i;
+
+    for (i = 0; i < 4; i++) {
+        sim->stats.digest ^= (value >> (i * 8)) & 0xff;
+        sim->stats.digest *= 16777619;
+    }
+}
+
+static void
+sim_send(Simulation *sim, SimClient *client, guint8 type)
+{
+    guint8 pdu[5] = { PACKET_START, type, 0, 0, 0 };
+
+    pdu[4] = pdu[0] ^ pdu[1] ^ pdu[2] ^ pdu[3];
+    ipcam_reactor_sim_write(sim->reactor, client->sock, pdu, sizeof(pdu));
+}
+
+static void
+sim_connect(Simulation *sim, SimClient *client)
+{
+    /* 10.x.y.z, one address per client */
+    client->sock = ipcam_itrain_server_sim_connect(sim->server, 0x0a000000 + client->id + 1);
+    if (client->sock < 0) {
+        sim->stats.refused++;
+        client->reconnect_at = ipcam_itrain_clock_now() + SIM_RECONNECT_DELAY;
+        g_queue_push_tail(&sim->reconnect, client);
+        return;
+    }
+
+    g_hash_table_insert(sim->by_sock, GINT_TO_POINTER(client->sock), client);
+    sim->stats.connects++;
+}
+
+static void
+sim_client_receive(Simulation *sim, SimClient *client)
+{
+    gint64 now = ipcam_itrain_clock_now();
+    guint8 buffer[4096];
+    gssize len;
+
+    while ((len = ipcam_reactor_sim_read(sim->reactor, client->sock, buffer, sizeof(buffer))) > 0) {
+        gssize offset = 0;
+
+        /* the server writes whole PDUs */
+        while (offset + 5 <= len && buffer[offset] == PACKET_START) {
+            guint8 type = buffer[offset + 1];
+
+            sim_digest(sim, (guint32)(now / 1000));
+            sim_digest(sim, (client->id << 8) | type);
+
+            if (type == HEARTBEAT_REQUEST) {
+                sim->stats.heartbeats++;
+                if (now >= client->silent_until) {
+                    sim_send(sim, client, HEARTBEAT_RESPONSE);
+                    sim->stats.responses++;
+                }
+            }
+            else if (type == sim->protocol->fault_event) {
+                sim->stats.fault_events++;
+                sim->stats.fault_latency_max = MAX(sim->stats.fault_latency_max,
+                                                   now - sim->fault_injected_at);
+            }
+            offset += 5 + ((buffer[offset + 2] << 8) | buffer[offset + 3]);
+        }
+    }
+
+    if (len == 0) {
+        /* the server dropped the session */
+        g_hash_table_remove(sim->by_sock, GINT_TO_POINTER(client->sock));
+        ipcam_reactor_sim_hangup(sim->reactor, client->sock);
+        client->sock = -1;
+        client->reconnect_at = now + SIM_RECONNECT_DELAY;
+        g_queue_push_tail(&sim->reconnect, client);
+        sim->stats.dropped++;
+    }
+}
+
+/* the clients react to what the server sent during the last step_ms */
+static void
+sim_step(Simulation *sim, guint step_ms)
+{
+    gint64 now = ipcam_itrain_clock_now();
+    SimClient *client;
+    int sock;
+
+    while ((sock = ipcam_reactor_sim_next_output(sim->reactor)) >= 0) {
+        client = g_hash_table_lookup(sim->by_sock, GINT_TO_POINTER(sock));
+        if (client)
+            sim_client_receive(sim, client);
+    }
+
+    while ((client = g_queue_peek_head(&sim->reconnect)) != NULL &&
+           now >= client->reconnect_at) {
+        g_queue_pop_head(&sim->reconnect);
+        sim_connect(sim, client);
+    }
+
+    /* silent_permille of the clients per simulated second stop answering */
+    sim->silent_credit += (gdouble)sim->nr_clients * sim->silent_permille * step_ms / (1000 * 1000);
+    while (sim->silent_credit >= 1) {
+        client = &sim->clients[g_rand_int_range(sim->rand, 0, sim->nr_clients)];
+        client->silent_until = now + SIM_SILENT_DURATION;
+        sim->silent_credit -= 1;
+    }
+}
+
+static void
+sim_inject_fault(Simulation *sim, gboolean occluded)
+{
+    gchar cmd[32];
+
+    g_snprintf(cmd, sizeof(cmd), "OCCLUSION 0 %d\n", occluded);
+    ipcam_itrain_server_send_notify(sim->server, cmd, strlen(cmd));
+    sim->fault_injected_at = ipcam_itrain_clock_now();
+    sim->stats.faults_injected++;
+}
+
+static gint64
+cpu_time_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+    return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t dctx|dttx] [-c CLIENTS] [-d SECONDS] [-s SEED]\n"
+            "          [-q SILENT_PERMILLE] [-f FAULT_INTERVAL] [-S STEP_MS]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    Simulation sim;
+    IpcamITrain *itrain;
+    guint duration = 86400, fault_interval = 60, step_ms = 100;
+    guint32 seed = 1;
+    gint64 start, end, now, next_fault, real_start, cpu_start, real, cpu;
+    gint64 checked, fired;
+    gboolean occluded = FALSE;
+    int opt;
+    guint i;
+
+    memset(&sim, 0, sizeof(sim));
+    sim.protocol = &sim_protocols[0];
+    sim.nr_clients = 10000;
+    sim.silent_permille = 1;
+
+    while ((opt = getopt(argc, argv, "t:c:d:s:q:f:S:")) != -1) {
+        switch (opt) {
+        case 't':
+            sim.protocol = g_ascii_strcasecmp(optarg, "dttx") == 0 ? &sim_protocols[1] : &sim_protocols[0];
+            break;
+        case 'c':
+            sim.nr_clients = MAX(strtoul(optarg, NULL, 0), 1);
+            break;
+        case 'd':
+            duration = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'q':
+            sim.silent_permille = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            fault_interval = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            step_ms = MAX(strtoul(optarg, NULL, 0), 1);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    ipcam_itrain_clock_set_virtual(SIM_EPOCH);
+
+    /* never started, it only holds the identity the replies are built from */
+    itrain = g_object_new(IPCAM_TYPE_ITRAIN, "name", "itrain-sim", NULL);
+    ipcam_itrain_set_string_property(itrain, "szyc:train_num", "1");
+    ipcam_itrain_set_string_property(itrain, "szyc:carriage_num", "1");
+    ipcam_itrain_set_string_property(itrain, "szyc:position_num", "1");
+
+    sim.server = g_object_new(IPCAM_TYPE_ITRAIN_SERVER,
+                              "itrain", itrain,
+                              "simulated", TRUE,
+                              "protocol", sim.protocol->name,
+                              "port", 0,
+                              "mcast-interfaces", "",
+                              "max-connections", sim.nr_clients,
+                              "max-per-ip", 0,
+                              NULL);
+    sim.reactor = ipcam_itrain_server_sim_reactor(sim.server);
+    sim.by_sock = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_queue_init(&sim.reconnect);
+    sim.rand = g_rand_new_with_seed(seed);
+    sim.stats.digest = 2166136261u;
+
+    /* the whole train comes up at once */
+    sim.clients = g_new0(SimClient, sim.nr_clients);
+    for (i = 0; i < sim.nr_clients; i++) {
+        sim.clients[i].id = i;
+        sim.clients[i].sock = -1;
+        sim_connect(&sim, &sim.clients[i]);
+    }
+
+    start = ipcam_itrain_clock_now();
+    end = start + (gint64)duration * G_USEC_PER_SEC;
+    next_fault = fault_interval ? start + (gint64)fault_interval * G_USEC_PER_SEC : G_MAXINT64;
+    real_start = g_get_monotonic_time();
+    cpu_start = cpu_time_usec();
+
+    for (now = start; now < end; now = ipcam_itrain_clock_now()) {
+        gint64 until = MIN(now + step_ms * 1000, end);
+
+        if (now >= next_fault) {
+            occluded = !occluded;
+            sim_inject_fault(&sim, occluded);
+            next_fault += (gint64)fault_interval * G_USEC_PER_SEC;
+        }
+        ipcam_itrain_server_sim_run(sim.server, MIN(until, next_fault));
+        sim_step(&sim, step_ms);
+    }
+
+    real = g_get_monotonic_time() - real_start;
+    cpu = cpu_time_usec() - cpu_start;
+    checked = ipcam_itrain_stats_get(ITRAIN_STAT_TIMER_CHECKED);
+    fired = ipcam_itrain_stats_get(ITRAIN_STAT_TIMER_FIRED);
+
+    printf("protocol %s\n", sim.protocol->name);
+    printf("clients %u\n", sim.nr_clients);
+    printf("seed %u\n", seed);
+    printf("simulated_sec %u\n", duration);
+    printf("real_ms %" G_GINT64_FORMAT "\n", real / 1000);
+    printf("cpu_ms %" G_GINT64_FORMAT "\n", cpu / 1000);
+    printf("speedup %.0f\n", (double)duration * G_USEC_PER_SEC / MAX(real, 1));
+    printf("connects %" G_GUINT64_FORMAT "\n", sim.stats.connects);
+    printf("refused %" G_GUINT64_FORMAT "\n", sim.stats.refused);
+    printf("sessions_dropped %" G_GUINT64_FORMAT "\n", sim.stats.dropped);
+    printf("heartbeats %" G_GUINT64_FORMAT "\n", sim.stats.heartbeats);
+    printf("heartbeat_responses %" G_GUINT64_FORMAT "\n", sim.stats.responses);
+    printf("heartbeats_skipped %" G_GINT64_FORMAT "\n", ipcam_itrain_stats_get(ITRAIN_STAT_HEARTBEAT_SKIPPED));
+    printf("faults_injected %" G_GUINT64_FORMAT "\n", sim.stats.faults_injected);
+    printf("fault_events %" G_GUINT64_FORMAT "\n", sim.stats.fault_events);
+    printf("fault_latency_max_ms %" G_GINT64_FORMAT "\n", sim.stats.fault_latency_max / 1000);
+    printf("timer_checked %" G_GINT64_FORMAT "\n", checked);
+    printf("timer_fired %" G_GINT64_FORMAT "\n", fired);
+    printf("timer_checked_per_sec %.0f\n", (double)checked / MAX(duration, 1));
+    printf("cpu_ns_per_heartbeat %.0f\n", cpu * 1000.0 / MAX(sim.stats.heartbeats, 1));
+    printf("digest %08x\n", sim.stats.digest);
+
+    g_object_unref(sim.server);
+    g_hash_table_destroy(sim.by_sock);
+    g_queue_clear(&sim.reconnect);
+    g_rand_free(sim.rand);
+    g_free(sim.clients);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,727 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * itrain-soak.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ * Soak benchmark: runs the server thread in this process on loopback and
+ * holds a large number of real TCP clients on it for a long run.  Every
+ * client answers its heartbeats, a few per second send a status query,
+ * and occlusion is toggled through the notify pipe at a fixed interval so
+ * each toggle fans a fault event out to all of them.
+ *
+ * Reported are the RSS added per connection, the server thread CPU time
+ * per heartbeat, the fan-out latency from injection to each client and
+ * the query latency per window, whose p99 in the last window against the
+ * first is the drift.  With -b the run fails if any of those is worse
+ * than the stored baseline by more than the tolerance; -W stores one.
+ * A dropped session or a lost fault event always fails the run.
+ *
+ * The itrain:low_latency settings are switches (-C -P -M -B -N -A), so
+ * the same load can be run with and without each of them; the server's
+ * own latency.* distributions are printed at the end of every run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "ipcam-itrain.h"
+#include "ipcam-itrain-server.h"
+#include "ipcam-itrain-stats.h"
+#include "ipcam-itrain-message.h"
+#include "ipcam-itrain-rt.h"
+
+#define SOAK_EVENTS             256
+#define SOAK_CARRY_SIZE         32
+#define SOAK_CONNECT_TIMEOUT    (30 * G_USEC_PER_SEC)
+#define SOAK_DRAIN_TIME         (2 * G_USEC_PER_SEC)
+
+#define HEARTBEAT_REQUEST       0x01
+#define HEARTBEAT_RESPONSE      0x51
+
+typedef struct SoakProtocol
+{
+    const gchar *name;
+    guint8      query_type;
+    guint8      reply_type;
+    guint8      fault_event;
+} SoakProtocol;
+
+static const SoakProtocol soak_protocols[] = {
+    { "dctx", 0x08, 0x58, 0x09 },
+    { "dttx", 0x07, 0x57, 0x08 },
+};
+
+typedef struct SoakClient
+{
+    int     sock;               /* -1 once the server dropped it */
+    gint64  query_sent_at;      /* 0 while idle */
+    guint8  carry[SOAK_CARRY_SIZE];
+    guint   carry_len;
+} SoakClient;
+
+typedef struct SoakStats
+{
+    guint64 heartbeats;
+    guint64 responses;
+    guint64 queries;
+    guint64 faults_injected;
+    guint64 fault_events;
+    guint64 dropped;
+    guint64 errors;
+    GArray  *fanout;            /* usec, gint64, whole run */
+    GArray  *query;             /* usec, gint64, current window */
+    GArray  *query_all;
+    GArray  *window_fanout;
+} SoakStats;
+
+typedef struct Soak
+{
+    IpcamITrainServer   *server;
+    const SoakProtocol  *protocol;
+    SoakClient          *clients;
+    guint               nr_clients;
+    guint               next_probe;     /* round robin over the clients */
+    gint64              fault_injected_at;
+    SoakStats           stats;
+} Soak;
+
+/* the metrics compared against the baseline, lower is better */
+typedef struct SoakResult
+{
+    gdouble rss_per_conn_bytes;
+    gdouble cpu_ns_per_heartbeat;
+    gdouble fanout_p99_us;
+    gdouble query_p99_drift;
+} SoakResult;
+
+#define SOAK_GATED(X)                                   \
+    X(rss_per_conn_bytes)                               \
+    X(cpu_ns_per_heartbeat)                             \
+    X(fanout_p99_us)                                    \
+    X(query_p99_drift)
+
+static gint
+compare_usec(gconstpointer a, gconstpointer b)
+{
+    gint64 la = *(const gint64 *)a, lb = *(const gint64 *)b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+/* sorts in place */
+static gint64
+percentile(GArray *samples, guint pct)
+{
+    if (samples->len == 0)
+        return 0;
+    g_array_sort(samples, compare_usec);
+
+    return g_array_index(samples, gint64, MIN(samples->len * pct / 100, samples->len - 1));
+}
+
+static gint64
+read_rss_bytes(void)
+{
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (!fp)
+        return 0;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+
+    return (gint64)resident * sysconf(_SC_PAGESIZE);
+}
+
+/* utime + stime of the server thread, found by the name it was started with */
+static gint64
+read_server_cpu_usec(void)
+{
+    DIR *dir = opendir("/proc/self/task");
+    struct dirent *entry;
+    gint64 usec = -1;
+
+    if (!dir)
+        return -1;
+
+    while (usec < 0 && (entry = readdir(dir)) != NULL) {
+        gchar path[64], buf[512];
+        unsigned long utime, stime;
+        gchar *p;
+        FILE *fp;
+
+        if (entry->d_name[0] == '.')
+            continue;
+        g_snprintf(path, sizeof(path), "/proc/self/task/%s/stat", entry->d_name);
+        if ((fp = fopen(path, "r")) == NULL)
+            continue;
+        if (fgets(buf, sizeof(buf), fp) &&
+            strstr(buf, "(itrain-server)") &&
+            (p = strrchr(buf, ')')) != NULL &&
+            sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                   &utime, &stime) == 2)
+            usec = (gint64)(utime + stime) * G_USEC_PER_SEC / sysconf(_SC_CLK_TCK);
+        fclose(fp);
+    }
+    closedir(dir);
+
+    return usec;
+}
+
+static gboolean
+raise_fd_limit(guint needed)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return FALSE;
+    if (rl.rlim_cur >= needed)
+        return TRUE;
+    if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < needed)
+        return FALSE;
+    rl.rlim_cur = needed;
+
+    return setrlimit(RLIMIT_NOFILE, &rl) == 0;
+}
+
+static gboolean
+soak_send(SoakClient *client, guint8 type)
+{
+    guint8 pdu[5] = { PACKET_START, type, 0, 0, 0 };
+
+    pdu[4] = pdu[0] ^ pdu[1] ^ pdu[2] ^ pdu[3];
+
+    return send(client->sock, pdu, sizeof(pdu), MSG_NOSIGNAL) == sizeof(pdu);
+}
+
+static int
+soak_connect(const struct sockaddr_in *addr)
+{
+    int sock, one = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+
+    return sock;
+}
+
+static void
+soak_drop(Soak *soak, SoakClient *client, int epoll_fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->sock, NULL);
+    close(client->sock);
+    client->sock = -1;
+    soak->stats.dropped++;
+}
+
+static void
+soak_handle_pdu(Soak *soak, SoakClient *client, guint8 type, gint64 now)
+{
+    if (type == HEARTBEAT_REQUEST) {
+        soak->stats.heartbeats++;
+        if (soak_send(client, HEARTBEAT_RESPONSE))
+            soak->stats.responses++;
+        else
+            soak->stats.errors++;
+    }
+    else if (type == soak->protocol->fault_event) {
+        gint64 latency = now - soak->fault_injected_at;
+
+        soak->stats.fault_events++;
+        g_array_append_val(soak->stats.fanout, latency);
+        g_array_append_val(soak->stats.window_fanout, latency);
+    }
+    else if (type == soak->protocol->reply_type && client->query_sent_at) {
+        gint64 latency = now - client->query_sent_at;
+
+        soak->stats.queries++;
+        g_array_append_val(soak->stats.query, latency);
+        g_array_append_val(soak->stats.query_all, latency);
+        client->query_sent_at = 0;
+    }
+}
+
+static void
+soak_client_receive(Soak *soak, SoakClient *client, int epoll_fd)
+{
+    gint64 now = g_get_monotonic_time();
+    guint8 buffer[SOAK_CARRY_SIZE + 4096];
+    gssize len;
+
+    memcpy(buffer, client->carry, client->carry_len);
+    while ((len = recv(client->sock, &buffer[client->carry_len],
+                       sizeof(buffer) - client->carry_len, 0)) > 0) {
+        guint total = client->carry_len + len;
+        guint offset = 0;
+
+        while (total - offset >= 5) {
+            guint size;
+
+            if (buffer[offset] != PACKET_START) {
+                offset++;
+                continue;
+            }
+            size = 5 + ((buffer[offset + 2] << 8) | buffer[offset + 3]);
+            if (total - offset < size)
+                break;
+            soak_handle_pdu(soak, client, buffer[offset + 1], now);
+            offset += size;
+        }
+
+        client->carry_len = total - offset;
+        if (client->carry_len > SOAK_CARRY_SIZE) {
+            /* nothing we send for is that long */
+            soak->stats.errors++;
+            client->carry_len = 0;
+        }
+        memmove(buffer, &buffer[total - client->carry_len], client->carry_len);
+    }
+    memcpy(client->carry, buffer, client->carry_len);
+
+    if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        soak_drop(soak, client, epoll_fd);
+}
+
+/* one status query for each of the next count idle clients */
+static void
+soak_probe(Soak *soak, guint count)
+{
+    guint i;
+
+    for (i = 0; i < count; i++) {
+        SoakClient *client = &soak->clients[soak->next_probe];
+
+        soak->next_probe = (soak->next_probe + 1) % soak->nr_clients;
+        if (client->sock < 0 || client->query_sent_at)
+            continue;
+        if (soak_send(client, soak->protocol->query_type))
+            client->query_sent_at = g_get_monotonic_time();
+        else
+            soak->stats.errors++;
+    }
+}
+
+static void
+soak_inject_fault(Soak *soak, gboolean occluded)
+{
+    gchar cmd[32];
+
+    g_snprintf(cmd, sizeof(cmd), "OCCLUSION 0 %d\n", occluded);
+    soak->fault_injected_at = g_get_monotonic_time();
+    ipcam_itrain_server_send_notify(soak->server, cmd, strlen(cmd));
+    soak->stats.faults_injected++;
+}
+
+static void
+soak_poll(Soak *soak, int epoll_fd, int timeout_ms)
+{
+    struct epoll_event events[SOAK_EVENTS];
+    int i, n;
+
+    n = epoll_wait(epoll_fd, events, SOAK_EVENTS, timeout_ms);
+    for (i = 0; i < n; i++) {
+        SoakClient *client = &soak->clients[events[i].data.u32];
+
+        if (client->sock >= 0)
+            soak_client_receive(soak, client, epoll_fd);
+    }
+}
+
+static gboolean
+load_baseline(const gchar *path, SoakResult *baseline)
+{
+    gchar line[128], key[64];
+    gdouble value;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return FALSE;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || sscanf(line, "%63s %lf", key, &value) != 2)
+            continue;
+#define SOAK_LOAD(name) if (strcmp(key, #name) == 0) baseline->name = value;
+        SOAK_GATED(SOAK_LOAD)
+#undef SOAK_LOAD
+    }
+    fclose(fp);
+
+    return TRUE;
+}
+
+static gboolean
+save_baseline(const gchar *path, const SoakResult *result, guint nr_clients)
+{
+    FILE *fp;
+
+    if ((fp = fopen(path, "w")) == NULL)
+        return FALSE;
+
+    fprintf(fp, "# itrain-soak -c %u\n", nr_clients);
+#define SOAK_SAVE(name) fprintf(fp, "%s %.2f\n", #name, result->name);
+    SOAK_GATED(SOAK_SAVE)
+#undef SOAK_SAVE
+
+    return fclose(fp) == 0;
+}
+
+/* a metric missing from the baseline (0) is not checked */
+static gboolean
+check_baseline(const SoakResult *result, const SoakResult *baseline, guint tolerance)
+{
+    gboolean ok = TRUE;
+
+#define SOAK_CHECK(name)                                                \
+    if (baseline->name > 0 &&                                           \
+        result->name > baseline->name * (100 + tolerance) / 100) {      \
+        printf("regression %s %.2f baseline %.2f\n", #name,             \
+               result->name, baseline->name);                           \
+        ok = FALSE;                                                     \
+    }
+    SOAK_GATED(SOAK_CHECK)
+#undef SOAK_CHECK
+
+    return ok;
+}
+
+/* the distributions the server recorded itself, see ipcam-itrain-stats.h */
+static void
+print_server_latencies(void)
+{
+    static const gchar *names[] = {
+#define SOAK_LATENCY_NAME(id, name) name,
+        ITRAIN_LATENCIES(SOAK_LATENCY_NAME)
+#undef SOAK_LATENCY_NAME
+    };
+    guint id;
+
+    for (id = 0; id < NR_ITRAIN_LATENCIES; id++) {
+        printf("%s.count %" G_GINT64_FORMAT "\n", names[id],
+               ipcam_itrain_stats_latency_count(id));
+        printf("%s.p50_us %" G_GINT64_FORMAT "\n", names[id],
+               ipcam_itrain_stats_latency_percentile(id, 500));
+        printf("%s.p99_us %" G_GINT64_FORMAT "\n", names[id],
+               ipcam_itrain_stats_latency_percentile(id, 990));
+        printf("%s.max_us %" G_GINT64_FORMAT "\n", names[id],
+               ipcam_itrain_stats_latency_percentile(id, 1000));
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t dctx|dttx] [-p PORT] [-c CLIENTS] [-d SECONDS] [-f FAULT_INTERVAL]\n"
+            "          [-q QUERIES_PER_SEC] [-w WINDOW_SECONDS] [-b BASELINE] [-W BASELINE]\n"
+            "          [-T TOLERANCE_PERCENT] [-C SERVER_CPUS] [-P FIFO_PRIORITY] [-M]\n"
+            "          [-B BUSY_POLL_USEC] [-N] [-A] [-I epoll|io_uring]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    Soak soak;
+    SoakResult result, baseline;
+    IpcamITrain *itrain;
+    struct sockaddr_in addr;
+    const gchar *baseline_path = NULL, *save_path = NULL, *server_cpus = NULL;
+    const gchar *io_backend = "epoll";
+    guint fifo_priority = 0, busy_poll = 0;
+    gboolean lock_memory = FALSE, tcp_nodelay = FALSE, tcp_quickack = FALSE;
+    guint port = 10190, duration = 3600, fault_interval = 10;
+    guint query_rate = 100, window = 60, tolerance = 20;
+    gint64 start, end, now, next_fault, next_probe, window_end, deadline;
+    gint64 rss_base, rss_steady = 0, rss_end, cpu_start, cpu;
+    gint64 syscalls_start, syscalls;
+    gint64 query_p99_first = -1, query_p99_last = 0, connect_time;
+    guint64 expected;
+    gboolean occluded = FALSE, ok = TRUE;
+    guint nr_windows = 0;
+    int epoll_fd, opt;
+    guint i;
+
+    memset(&soak, 0, sizeof(soak));
+    memset(&baseline, 0, sizeof(baseline));
+    soak.protocol = &soak_protocols[0];
+    soak.nr_clients = 10000;
+
+    while ((opt = getopt(argc, argv, "t:p:c:d:f:q:w:b:W:T:C:P:MB:NAI:")) != -1) {
+        switch (opt) {
+        case 't':
+            soak.protocol = g_ascii_strcasecmp(optarg, "dttx") == 0 ? &soak_protocols[1] : &soak_protocols[0];
+            break;
+        case 'p':
+            port = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            soak.nr_clients = MAX(strtoul(optarg, NULL, 0), 1);
+            break;
+        case 'd':
+            duration = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            fault_interval = MAX(strtoul(optarg, NULL, 0), 1);
+            break;
+        case 'q':
+            query_rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            window = MAX(strtoul(optarg, NULL, 0), 1);
+            break;
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 'W':
+            save_path = optarg;
+            break;
+        case 'T':
+            tolerance = strtoul(optarg, NULL, 0);
+            break;
+        case 'C':
+            server_cpus = optarg;
+            break;
+        case 'P':
+            fifo_priority = MIN(strtoul(optarg, NULL, 0), 99);
+            break;
+        case 'M':
+            lock_memory = TRUE;
+            break;
+        case 'B':
+            busy_poll = strtoul(optarg, NULL, 0);
+            break;
+        case 'N':
+            tcp_nodelay = TRUE;
+            break;
+        case 'A':
+            tcp_quickack = TRUE;
+            break;
+        case 'I':
+            io_backend = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (server_cpus && !ipcam_itrain_rt_check_cpus(server_cpus)) {
+        fprintf(stderr, "invalid cpu list: %s\n", server_cpus);
+        return EXIT_FAILURE;
+    }
+    if (baseline_path && !load_baseline(baseline_path, &baseline)) {
+        fprintf(stderr, "%s: %s\n", baseline_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* both ends of every connection, plus some room for the server */
+    if (!raise_fd_limit(soak.nr_clients * 2 + 64)) {
+        fprintf(stderr, "need %u file descriptors, raise the hard limit (ulimit -Hn)\n",
+                soak.nr_clients * 2 + 64);
+        return EXIT_FAILURE;
+    }
+
+    /* everything on the client side is allocated before the RSS baseline */
+    soak.clients = g_new0(SoakClient, soak.nr_clients);
+    soak.stats.fanout = g_array_sized_new(FALSE, FALSE, sizeof(gint64), soak.nr_clients * 2);
+    soak.stats.window_fanout = g_array_sized_new(FALSE, FALSE, sizeof(gint64), soak.nr_clients * 2);
+    soak.stats.query = g_array_sized_new(FALSE, FALSE, sizeof(gint64), query_rate * window * 2);
+    soak.stats.query_all = g_array_new(FALSE, FALSE, sizeof(gint64));
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (lock_memory)
+        ipcam_itrain_rt_lock_memory();
+
+    /* never started, it only holds the identity the replies are built from */
+    itrain = g_object_new(IPCAM_TYPE_ITRAIN, "name", "itrain-soak", NULL);
+    ipcam_itrain_set_string_property(itrain, "szyc:train_num", "1");
+    ipcam_itrain_set_string_property(itrain, "szyc:carriage_num", "1");
+    ipcam_itrain_set_string_property(itrain, "szyc:position_num", "1");
+
+    soak.server = g_object_new(IPCAM_TYPE_ITRAIN_SERVER,
+                               "itrain", itrain,
+                               "protocol", soak.protocol->name,
+                               "address", "127.0.0.1",
+                               "port", port,
+                               "mcast-interfaces", "",
+                               "backlog", 1024,
+                               "max-connections", soak.nr_clients,
+                               "max-per-ip", 0,
+                               "occlusion-on-delay", 0,
+                               "occlusion-off-delay", 0,
+                               "video-loss-timeout", 0,
+                               "server-cpus", server_cpus,
+                               "fifo-priority", fifo_priority,
+                               "busy-poll", busy_poll,
+                               "tcp-nodelay", tcp_nodelay,
+                               "tcp-quickack", tcp_quickack,
+                               "io-backend", io_backend,
+                               NULL);
+    ipcam_itrain_server_set_accepting(soak.server, TRUE);
+    g_usleep(G_USEC_PER_SEC / 10);
+    rss_base = read_rss_bytes();
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < soak.nr_clients; i++) {
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.u32 = i };
+
+        soak.clients[i].sock = soak_connect(&addr);
+        if (soak.clients[i].sock < 0) {
+            fprintf(stderr, "connection %u failed: %s\n", i, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, soak.clients[i].sock, &event);
+    }
+    while (ipcam_itrain_stats_get(ITRAIN_STAT_CONN_ACTIVE) < soak.nr_clients) {
+        if (g_get_monotonic_time() - start > SOAK_CONNECT_TIMEOUT) {
+            fprintf(stderr, "server accepted %" G_GINT64_FORMAT " of %u connections\n",
+                    ipcam_itrain_stats_get(ITRAIN_STAT_CONN_ACTIVE), soak.nr_clients);
+            return EXIT_FAILURE;
+        }
+        soak_poll(&soak, epoll_fd, 10);
+    }
+    connect_time = g_get_monotonic_time() - start;
+
+    start = g_get_monotonic_time();
+    end = start + (gint64)duration * G_USEC_PER_SEC;
+    next_fault = start + (gint64)fault_interval * G_USEC_PER_SEC;
+    next_probe = start;
+    window_end = start + (gint64)window * G_USEC_PER_SEC;
+    cpu_start = read_server_cpu_usec();
+    syscalls_start = ipcam_itrain_stats_get(ITRAIN_STAT_IO_SYSCALLS);
+
+    while ((now = g_get_monotonic_time()) < end) {
+        deadline = MIN(MIN(next_fault, next_probe), MIN(window_end, end));
+        soak_poll(&soak, epoll_fd, MAX(0, (deadline - now + 999) / 1000));
+
+        now = g_get_monotonic_time();
+        if (now >= next_probe) {
+            /* ten batches a second */
+            soak_probe(&soak, (query_rate + 9) / 10);
+            next_probe += G_USEC_PER_SEC / 10;
+        }
+        if (now >= next_fault) {
+            occluded = !occluded;
+            soak_inject_fault(&soak, occluded);
+            next_fault += (gint64)fault_interval * G_USEC_PER_SEC;
+        }
+        if (now >= window_end) {
+            gint64 rss = read_rss_bytes();
+            gint64 query_p99 = percentile(soak.stats.query, 99);
+
+            if (nr_windows == 0) {
+                /* every connection has been through a few heartbeats by now */
+                rss_steady = rss;
+                query_p99_first = query_p99;
+            }
+            query_p99_last = query_p99;
+            printf("window %u rss_kb %" G_GINT64_FORMAT " query_p99_us %" G_GINT64_FORMAT
+                   " fanout_p99_us %" G_GINT64_FORMAT "\n",
+                   nr_windows, rss / 1024, query_p99, percentile(soak.stats.window_fanout, 99));
+            fflush(stdout);
+            g_array_set_size(soak.stats.query, 0);
+            g_array_set_size(soak.stats.window_fanout, 0);
+            nr_windows++;
+            window_end += (gint64)window * G_USEC_PER_SEC;
+        }
+    }
+
+    /* let the last fan-out arrive */
+    end = g_get_monotonic_time() + SOAK_DRAIN_TIME;
+    while ((now = g_get_monotonic_time()) < end)
+        soak_poll(&soak, epoll_fd, MAX(0, (end - now) / 1000));
+
+    cpu = read_server_cpu_usec() - cpu_start;
+    syscalls = ipcam_itrain_stats_get(ITRAIN_STAT_IO_SYSCALLS) - syscalls_start;
+    rss_end = read_rss_bytes();
+    if (nr_windows == 0)
+        rss_steady = rss_end;
+
+    result.rss_per_conn_bytes = (gdouble)(rss_steady - rss_base) / soak.nr_clients;
+    result.cpu_ns_per_heartbeat = cpu * 1000.0 / MAX(soak.stats.heartbeats, 1);
+    result.fanout_p99_us = percentile(soak.stats.fanout, 99);
+    result.query_p99_drift = query_p99_first > 0 ? (gdouble)query_p99_last / query_p99_first : 0;
+    expected = soak.stats.faults_injected * soak.nr_clients;
+
+    printf("protocol %s\n", soak.protocol->name);
+    printf("clients %u\n", soak.nr_clients);
+    printf("duration_sec %u\n", duration);
+    printf("low_latency server-cpus=%s fifo-priority=%u mlockall=%d busy-poll=%u"
+           " tcp-nodelay=%d tcp-quickack=%d\n",
+           server_cpus ? server_cpus : "-", fifo_priority, lock_memory, busy_poll,
+           tcp_nodelay, tcp_quickack);
+    printf("io_backend %s\n", io_backend);
+    printf("connect_ms %" G_GINT64_FORMAT "\n", connect_time / 1000);
+    printf("rss_base_kb %" G_GINT64_FORMAT "\n", rss_base / 1024);
+    printf("rss_per_conn_bytes %.0f\n", result.rss_per_conn_bytes);
+    printf("rss_growth_kb %" G_GINT64_FORMAT "\n", (rss_end - rss_steady) / 1024);
+    printf("heartbeats %" G_GUINT64_FORMAT "\n", soak.stats.heartbeats);
+    printf("heartbeat_responses %" G_GUINT64_FORMAT "\n", soak.stats.responses);
+    printf("server_cpu_ms %" G_GINT64_FORMAT "\n", cpu / 1000);
+    printf("cpu_ns_per_heartbeat %.0f\n", result.cpu_ns_per_heartbeat);
+    printf("io_syscalls %" G_GINT64_FORMAT "\n", syscalls);
+    printf("io_syscalls_per_heartbeat %.2f\n", (gdouble)syscalls / MAX(soak.stats.heartbeats, 1));
+    printf("faults_injected %" G_GUINT64_FORMAT "\n", soak.stats.faults_injected);
+    printf("fault_events %" G_GUINT64_FORMAT "\n", soak.stats.fault_events);
+    printf("fault_events_missing %" G_GUINT64_FORMAT "\n",
+           expected > soak.stats.fault_events ? expected - soak.stats.fault_events : 0);
+    printf("fanout_p50_us %" G_GINT64_FORMAT "\n", percentile(soak.stats.fanout, 50));
+    printf("fanout_p99_us %.0f\n", result.fanout_p99_us);
+    printf("fanout_max_us %" G_GINT64_FORMAT "\n", percentile(soak.stats.fanout, 100));
+    printf("queries %" G_GUINT64_FORMAT "\n", soak.stats.queries);
+    printf("query_p50_us %" G_GINT64_FORMAT "\n", percentile(soak.stats.query_all, 50));
+    printf("query_p99_us %" G_GINT64_FORMAT "\n", percentile(soak.stats.query_all, 99));
+    printf("query_p99_first_us %" G_GINT64_FORMAT "\n", MAX(query_p99_first, 0));
+    printf("query_p99_last_us %" G_GINT64_FORMAT "\n", query_p99_last);
+    printf("query_p99_drift %.2f\n", result.query_p99_drift);
+    print_server_latencies();
+    printf("sessions_dropped %" G_GUINT64_FORMAT "\n", soak.stats.dropped);
+    printf("errors %" G_GUINT64_FORMAT "\n", soak.stats.errors);
+
+    if (soak.stats.dropped || soak.stats.errors || expected > soak.stats.fault_events)
+        ok = FALSE;
+    if (baseline_path && !check_baseline(&result, &baseline, tolerance))
+        ok = FALSE;
+    if (save_path && ok && !save_baseline(save_path, &result, soak.nr_clients)) {
+        fprintf(stderr, "%s: %s\n", save_path, strerror(errno));
+        ok = FALSE;
+    }
+    printf("result %s\n", ok ? "pass" : "fail");
+
+    for (i = 0; i < soak.nr_clients; i++) {
+        if (soak.clients[i].sock >= 0)
+            close(soak.clients[i].sock);
+    }
+    close(epoll_fd);
+    g_object_unref(soak.server);
+    g_array_free(soak.stats.fanout, TRUE);
+    g_array_free(soak.stats.window_fanout, TRUE);
+    g_array_free(soak.stats.query, TRUE);
+    g_array_free(soak.stats.query_all, TRUE);
+    g_free(soak.clients);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,328 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * itrain-tracedump.c
+ * Copyright (C) 2014 Watson Xu <xuhuashan@gmail.com>
+ *
+ * List the PDU trace ring written by itrain, or export it to pcapng.
+ * Each PDU becomes an IPv4/TCP packet of its connection so the usual
+ * tools can follow the streams; sequence numbers are made up from the
+ * bytes seen and start over where the ring lost records.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "ipcam-itrain-trace.h"
+
+#define PCAPNG_SHB              0x0a0d0d0a
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_EPB              0x00000006
+#define PCAPNG_BYTE_ORDER       0x1a2b3c4d
+#define PCAPNG_OPT_COMMENT      1
+#define LINKTYPE_RAW            101
+
+#define PACKET_HEADER_SIZE      40      /* IPv4 and TCP, no options */
+
+typedef struct TraceStream
+{
+    guint32 next_seq[2];    /* by direction */
+} TraceStream;
+
+static gint
+compare_records(gconstpointer a, gconstpointer b)
+{
+    const IpcamITrainTraceRecord *ra = a, *rb = b;
+
+    return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+static GArray *
+load_records(const gchar *path)
+{
+    IpcamITrainTraceHeader header;
+    IpcamITrainTraceRecord record;
+    GArray *records;
+    FILE *fp;
+    guint i;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return NULL;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, ITRAIN_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != ITRAIN_TRACE_VERSION ||
+        header.record_size != sizeof(IpcamITrainTraceRecord) ||
+        fseek(fp, ITRAIN_TRACE_HEADER_SIZE, SEEK_SET) != 0) {
+        fprintf(stderr, "%s: not an itrain trace of this version\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    /* records still being written when we stopped have seq 0 */
+    records = g_array_new(FALSE, FALSE, sizeof(IpcamITrainTraceRecord));
+    for (i = 0; i < header.nr_records; i++) {
+        if (fread(&record, sizeof(record), 1, fp) != 1)
+            break;
+        if (record.seq != 0)
+            g_array_append_val(records, record);
+    }
+    fclose(fp);
+
+    g_array_sort(records, compare_records);
+
+    return records;
+}
+
+static void
+print_record(IpcamITrainTraceRecord *record)
+{
+    time_t sec = record->time / G_USEC_PER_SEC;
+    struct in_addr peer = { record->flow.peer_addr };
+    guint i, caplen = MIN(record->length, ITRAIN_TRACE_SNAPLEN);
+    struct tm tm;
+    gchar when[32];
+
+    localtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06d conn %u %s %s:%u %u bytes:",
+           when, (int)(record->time % G_USEC_PER_SEC), record->flow.conn_id,
+           record->direction == ITRAIN_TRACE_IN ? "<-" : "->",
+           inet_ntoa(peer), ntohs(record->flow.peer_port), record->length);
+    for (i = 0; i < caplen; i++)
+        printf(" %02x", record->data[i]);
+    printf("%s\n", caplen < record->length ? " ..." : "");
+}
+
+static guint16
+checksum_fold(guint32 sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return ~sum;
+}
+
+static guint32
+checksum_add(guint32 sum, const guint8 *data, gsize size)
+{
+    gsize i;
+
+    for (i = 0; i + 1 < size; i += 2)
+        sum += (data[i] << 8) | data[i + 1];
+    if (size & 1)
+        sum += data[size - 1] << 8;
+
+    return sum;
+}
+
+/* wrap the PDU of record into an IPv4/TCP packet, returns its size */
+static guint
+build_packet(IpcamITrainTraceRecord *record, TraceStream *stream, guint8 *packet)
+{
+    IpcamITrainTraceFlow *flow = &record->flow;
+    gboolean in = record->direction == ITRAIN_TRACE_IN;
+    guint caplen = MIN(record->length, ITRAIN_TRACE_SNAPLEN);
+    guint16 total = PACKET_HEADER_SIZE + record->length;
+    guint8 *ip = packet, *tcp = packet + 20;
+    guint32 src = in ? flow->peer_addr : flow->local_addr;
+    guint32 dst = in ? flow->local_addr : flow->peer_addr;
+    guint32 seq = stream->next_seq[record->direction];
+    guint32 ack = stream->next_seq[!record->direction];
+    guint8 pseudo[12];
+    guint16 sum;
+
+    memset(packet, 0, PACKET_HEADER_SIZE);
+
+    ip[0] = 0x45;
+    ip[2] = total >> 8;
+    ip[3] = total & 0xff;
+    ip[8] = 64;
+    ip[9] = 6;      /* TCP */
+    memcpy(&ip[12], &src, 4);
+    memcpy(&ip[16], &dst, 4);
+    sum = checksum_fold(checksum_add(0, ip, 20));
+    ip[10] = sum >> 8;
+    ip[11] = sum & 0xff;
+
+    memcpy(&tcp[0], in ? &flow->peer_port : &flow->local_port, 2);
+    memcpy(&tcp[2], in ? &flow->local_port : &flow->peer_port, 2);
+    seq = htonl(seq);
+    ack = htonl(ack);
+    memcpy(&tcp[4], &seq, 4);
+    memcpy(&tcp[8], &ack, 4);
+    tcp[12] = 5 << 4;
+    tcp[13] = 0x18;         /* PSH, ACK */
+    tcp[14] = 0xff;
+    tcp[15] = 0xff;
+    memcpy(packet + PACKET_HEADER_SIZE, record->data, caplen);
+
+    /* the checksum can only be right when the whole PDU was kept */
+    if (caplen == record->length) {
+        memcpy(&pseudo[0], &src, 4);
+        memcpy(&pseudo[4], &dst, 4);
+        pseudo[8] = 0;
+        pseudo[9] = 6;
+        pseudo[10] = (20 + record->length) >> 8;
+        pseudo[11] = (20 + record->length) & 0xff;
+        sum = checksum_fold(checksum_add(checksum_add(0, pseudo, sizeof(pseudo)),
+                                         tcp, 20 + record->length));
+        tcp[16] = sum >> 8;
+        tcp[17] = sum & 0xff;
+    }
+
+    stream->next_seq[record->direction] += record->length;
+
+    return PACKET_HEADER_SIZE + caplen;
+}
+
+static void
+write_block(FILE *fp, guint32 type, const void *body, guint32 size)
+{
+    static const guint8 pad[4];
+    guint32 total = 12 + ((size + 3) & ~3);
+
+    fwrite(&type, 4, 1, fp);
+    fwrite(&total, 4, 1, fp);
+    fwrite(body, size, 1, fp);
+    fwrite(pad, (4 - (size & 3)) & 3, 1, fp);
+    fwrite(&total, 4, 1, fp);
+}
+
+static gboolean
+export_pcapng(GArray *records, const gchar *path, guint32 conn_id)
+{
+    GHashTable *streams;
+    FILE *fp;
+    guint i;
+
+    fp = fopen(path, "wb");
+    if (!fp) {
+        perror(path);
+        return FALSE;
+    }
+
+    {
+        struct {
+            guint32 byte_order;
+            guint16 major, minor;
+            gint64  section_length;
+        } shb = { PCAPNG_BYTE_ORDER, 1, 0, -1 };
+        struct {
+            guint16 linktype, reserved;
+            guint32 snaplen;
+        } idb = { LINKTYPE_RAW, 0, PACKET_HEADER_SIZE + ITRAIN_TRACE_SNAPLEN };
+
+        write_block(fp, PCAPNG_SHB, &shb, sizeof(shb));
+        write_block(fp, PCAPNG_IDB, &idb, sizeof(idb));
+    }
+
+    streams = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    for (i = 0; i < records->len; i++) {
+        IpcamITrainTraceRecord *r = &g_array_index(records, IpcamITrainTraceRecord, i);
+        TraceStream *stream;
+        guint32 epb[(20 + PACKET_HEADER_SIZE + ITRAIN_TRACE_SNAPLEN + 4 + 32 + 4) / 4];
+        guint8 *body = (guint8 *)epb;
+        guint caplen, size;
+        gchar comment[32];
+        guint16 opt[2];
+
+        if (conn_id && r->flow.conn_id != conn_id)
+            continue;
+
+        stream = g_hash_table_lookup(streams, GUINT_TO_POINTER(r->flow.conn_id));
+        if (!stream) {
+            stream = g_new0(TraceStream, 1);
+            stream->next_seq[ITRAIN_TRACE_IN] = 1;
+            stream->next_seq[ITRAIN_TRACE_OUT] = 1;
+            g_hash_table_insert(streams, GUINT_TO_POINTER(r->flow.conn_id), stream);
+        }
+
+        memset(epb, 0, sizeof(epb));
+        caplen = build_packet(r, stream, body + 20);
+        epb[0] = 0;     /* interface */
+        epb[1] = (guint64)r->time >> 32;
+        epb[2] = (guint64)r->time & 0xffffffff;
+        epb[3] = caplen;
+        epb[4] = PACKET_HEADER_SIZE + r->length;
+        size = 20 + ((caplen + 3) & ~3);
+
+        /* tag the packet with the connection, ports may be reused */
+        snprintf(comment, sizeof(comment), "conn %u", r->flow.conn_id);
+        opt[0] = PCAPNG_OPT_COMMENT;
+        opt[1] = strlen(comment);
+        memcpy(body + size, opt, sizeof(opt));
+        memcpy(body + size + 4, comment, opt[1]);
+        size += 4 + ((opt[1] + 3) & ~3);
+        size += 4;      /* opt_endofopt, already zero */
+
+        write_block(fp, PCAPNG_EPB, body, size);
+    }
+    g_hash_table_destroy(streams);
+
+    if (fclose(fp) != 0) {
+        perror(path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-c CONN] [-o OUT.pcapng] TRACEFILE\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const gchar *output = NULL;
+    guint32 conn_id = 0;
+    GArray *records;
+    gboolean ret = TRUE;
+    int opt;
+    guint i;
+
+    while ((opt = getopt(argc, argv, "c:o:")) != -1) {
+        switch (opt) {
+        case 'c':
+            conn_id = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    records = load_records(argv[optind]);
+    if (!records)
+        return EXIT_FAILURE;
+
+    if (output) {
+        ret = export_pcapng(records, output, conn_id);
+    }
+    else {
+        for (i = 0; i < records->len; i++) {
+            IpcamITrainTraceRecord *r = &g_array_index(records, IpcamITrainTraceRecord, i);
+
+            if (!conn_id || r->flow.conn_id == conn_id)
+                print_record(r);
+        }
+    }
+    g_array_free(records, TRUE);
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}